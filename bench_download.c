@@ -0,0 +1,941 @@
+// Download benchmarks, meant to run against bench_server on localhost
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "https_download.h"
+#include "https_parser.h"
+#include "system_abstraction.h"
+
+#define BENCH_DEFAULT_URL          "https://127.0.0.1:4433/size/1"
+#define BENCH_DEFAULT_ROUNDS       50
+#define BENCH_THROUGHPUT_URL       "https://127.0.0.1:4433/size/67108864"
+#define BENCH_THROUGHPUT_ROUNDS    3
+#define BENCH_OUTPUT_PATH          "./bench_download.tmp"
+#define BENCH_PARSE_BODY_LEN       (32 * 1024 * 1024)
+#define BENCH_PARSE_CHUNK_LEN      (16 * 1024)
+#define BENCH_PARSE_ROUNDS         5
+#define BENCH_PARSE_HEAD_COUNT     20000
+#define BENCH_CONCURRENT_URL       "https://127.0.0.1:4433/size/1048576"
+#define BENCH_CONCURRENT_TRANSFERS 1024
+#define BENCH_CONCURRENT_CONNS     256
+#define BENCH_FILE_SIZE            (256 * 1024 * 1024)
+#define BENCH_FILE_PIECE           (16 * 1024)     // One TLS record, as the download loop writes
+#define BENCH_FILE_ROUNDS          3
+#define BENCH_CIPHER_URL           "https://127.0.0.1:4433/size/16777216"
+#define BENCH_E2E_BASE             "https://127.0.0.1:4433"
+#define BENCH_E2E_ROUNDS           20
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long bench_file_size(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    long long size;
+
+    if(!fp)
+        return 0;
+    fseek(fp, 0L, SEEK_END);
+    size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time `rounds` downloads of a tiny resource on fresh connections, so each
+// one is dominated by its TLS handshake
+static int bench_handshake_run(const char *label, const char *url, int rounds, int resume)
+{
+    https_client_config_t config;
+    https_client_t *client;
+    https_client_stats_t stats;
+    double *samples, total = 0;
+    int failures = 0;
+
+    https_client_config_init(&config);
+    config.max_idle_connections = 0;   // force a new connection every time
+    if(!resume)
+        config.session_cache_size = 0;
+
+    client = https_client_create(&config);
+    samples = (double *)calloc(rounds, sizeof(double));
+    if(!client || !samples) {
+        fprintf(stderr, "bench: setup failed\n");
+        https_client_destroy(client);
+        free(samples);
+        return -1;
+    }
+
+    // warm-up, also seeds the session cache
+    if(https_client_download(client, url, "/dev/null") != 0) {
+        fprintf(stderr, "bench: warm-up download of %s failed, is bench_server running?\n", url);
+        https_client_destroy(client);
+        free(samples);
+        return -1;
+    }
+
+    for(int i = 0; i < rounds; i++) {
+        double start = bench_now();
+        if(https_client_download(client, url, "/dev/null") != 0)
+            failures++;
+        samples[i] = (bench_now() - start) * 1000.0;
+        total += samples[i];
+    }
+    https_client_get_stats(client, &stats);
+
+    qsort(samples, rounds, sizeof(double), bench_compare_double);
+    printf("%-8s rounds=%d failures=%d avg=%.3fms p50=%.3fms min=%.3fms max=%.3fms full=%llu resumed=%llu\n",
+           label, rounds, failures, total / rounds, samples[rounds / 2], samples[0], samples[rounds - 1],
+           (unsigned long long)stats.tls_full_handshakes, (unsigned long long)stats.tls_resumed_handshakes);
+
+    https_client_destroy(client);
+    free(samples);
+    return failures ? -1 : 0;
+}
+
+static int bench_handshake(const char *url, int rounds)
+{
+    int ret = 0;
+
+    printf("== Handshake latency: %s ==\n", url);
+    ret |= bench_handshake_run("full", url, rounds, 0);
+    ret |= bench_handshake_run("resumed", url, rounds, 1);
+    return ret;
+}
+
+// Download the same large resource with one receive buffer size; a zero
+// size runs the client defaults, which grow the buffer adaptively.
+// write_buffers > 0 writes the file through the write-behind thread.
+static int bench_throughput_run(const char *url, int rounds, uint32_t buffer_size, int write_buffers)
+{
+    https_client_stats_t stats;
+    https_client_config_t config;
+    https_download_opts_t opts;
+    https_client_t *client;
+    double elapsed = 0, best = 0;
+    long long bytes = 0;
+    int failures = 0;
+    char label[32];
+
+    https_client_config_init(&config);
+    if(buffer_size > 0)
+        config.max_buffer_size = 0;     // fixed size, no growth
+    client = https_client_create(&config);
+    if(!client) {
+        fprintf(stderr, "bench: setup failed\n");
+        return -1;
+    }
+    https_download_opts_init(&opts);
+    opts.buffer_size = buffer_size;
+    opts.write_buffers = write_buffers;
+
+    for(int i = 0; i < rounds; i++) {
+        double start = bench_now(), took;
+        if(https_client_download_ex(client, url, BENCH_OUTPUT_PATH, &opts) != 0) {
+            failures++;
+            continue;
+        }
+        took = bench_now() - start;
+        elapsed += took;
+        bytes += bench_file_size(BENCH_OUTPUT_PATH);
+        if(best == 0 || took < best)
+            best = took;
+    }
+    https_client_get_stats(client, &stats);
+    https_client_destroy(client);
+    remove(BENCH_OUTPUT_PATH);
+
+    if(buffer_size > 0)
+        snprintf(label, sizeof(label), "%u", buffer_size);
+    else
+        snprintf(label, sizeof(label), write_buffers > 0 ? "adaptive+wb" : "adaptive");
+    if(elapsed > 0 && write_buffers > 0) {
+        printf("buffer=%-11s rounds=%d failures=%d avg=%.1fMB/s best=%.1fMB/s download_wait=%.1fms writer_wait=%.1fms\n",
+               label, rounds, failures, bytes / elapsed / (1024.0 * 1024.0),
+               (bytes / (double)(rounds - failures)) / best / (1024.0 * 1024.0),
+               stats.write_wait_us / 1000.0, stats.writer_idle_us / 1000.0);
+    } else if(elapsed > 0) {
+        printf("buffer=%-11s rounds=%d failures=%d avg=%.1fMB/s best=%.1fMB/s\n", label, rounds, failures,
+               bytes / elapsed / (1024.0 * 1024.0), (bytes / (double)(rounds - failures)) / best / (1024.0 * 1024.0));
+    } else {
+        printf("buffer=%-11s rounds=%d failures=%d\n", label, rounds, failures);
+    }
+    return failures ? -1 : 0;
+}
+
+static int bench_throughput(const char *url, int rounds)
+{
+    static const uint32_t sizes[] = { 512, 4096, 16384, 65536, 0 };
+    int ret = 0;
+
+    printf("== Body throughput by receive buffer size: %s ==\n", url);
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        ret |= bench_throughput_run(url, rounds, sizes[i], 0);
+    // adaptive buffer again, with the file written behind by another thread
+    ret |= bench_throughput_run(url, rounds, 0, 4);
+    return ret;
+}
+
+// The parser itself never touches body bytes, so the sink reads them all
+// the way a real consumer would; otherwise only callbacks are counted
+static uint64_t bench_parse_sum;
+
+static int bench_parse_on_body(void *ctx, const uint8_t *data, uint32_t len)
+{
+    uint64_t sum = 0, word;
+    uint32_t i;
+
+    for(i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, 8);
+        sum ^= word;
+    }
+    for(; i < len; i++)
+        sum ^= data[i];
+    bench_parse_sum ^= sum;
+    *(uint64_t *)ctx += len;
+    return 0;
+}
+
+// Feed a whole response through the parser in fragments of frag_len bytes
+static int bench_parse_feed(const uint8_t *rsp, size_t rsp_len, size_t frag_len, uint64_t *body)
+{
+    https_parser_callbacks_t cb = { NULL, bench_parse_on_body, body };
+    static https_parser_t parser;
+    size_t off;
+
+    https_parser_init(&parser, &cb);
+    for(off = 0; off < rsp_len; off += frag_len) {
+        uint32_t n = (uint32_t)(rsp_len - off < frag_len ? rsp_len - off : frag_len);
+        if(https_parser_execute(&parser, rsp + off, n) < 0)
+            return -1;
+    }
+    return parser.state == HTTPS_PARSE_DONE ? 0 : -1;
+}
+
+// Build a Content-Length or chunked response around a body of body_len bytes
+static uint8_t *bench_parse_build(int chunked, size_t body_len, size_t *rsp_len)
+{
+    uint8_t *rsp = (uint8_t *)malloc(body_len + body_len / BENCH_PARSE_CHUNK_LEN * 16 + 512);
+    size_t len, off;
+
+    if(!rsp)
+        return NULL;
+    if(chunked) {
+        len = (size_t)sprintf((char *)rsp, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n");
+        for(off = 0; off < body_len; off += BENCH_PARSE_CHUNK_LEN) {
+            size_t n = body_len - off < BENCH_PARSE_CHUNK_LEN ? body_len - off : BENCH_PARSE_CHUNK_LEN;
+            len += (size_t)sprintf((char *)rsp + len, "%zx\r\n", n);
+            memset(rsp + len, 'x', n);
+            len += n;
+            memcpy(rsp + len, "\r\n", 2);
+            len += 2;
+        }
+        len += (size_t)sprintf((char *)rsp + len, "0\r\n\r\n");
+    } else {
+        len = (size_t)sprintf((char *)rsp, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", body_len);
+        memset(rsp + len, 'x', body_len);
+        len += body_len;
+    }
+    *rsp_len = len;
+    return rsp;
+}
+
+// Parser throughput on synthetic in-memory responses, no network involved
+static int bench_parse(int rounds)
+{
+    static const size_t frags[] = { 7, 512, 16384, 65536 };
+    static const char head[] =
+        "HTTP/1.1 206 Partial Content\r\nServer: bench\r\nDate: Thu, 01 Jan 2026 00:00:00 GMT\r\n"
+        "Content-Type: application/octet-stream\r\nContent-Length: 1\r\nContent-Range: bytes 0-0/1048576\r\n"
+        "ETag: \"0123456789abcdef\"\r\nLast-Modified: Thu, 01 Jan 2026 00:00:00 GMT\r\nAccept-Ranges: bytes\r\n"
+        "Cache-Control: max-age=3600\r\nVary: Accept-Encoding\r\nX-Request-Id: 0123456789abcdef0123456789abcdef\r\n"
+        "Connection: keep-alive\r\n\r\nx";
+    int ret = 0;
+
+    printf("== Response parser throughput ==\n");
+    for(int chunked = 0; chunked <= 1; chunked++) {
+        size_t rsp_len;
+        uint8_t *rsp = bench_parse_build(chunked, BENCH_PARSE_BODY_LEN, &rsp_len);
+        if(!rsp) {
+            fprintf(stderr, "bench: setup failed\n");
+            return -1;
+        }
+        for(size_t f = 0; f < sizeof(frags) / sizeof(frags[0]); f++) {
+            double start = bench_now(), took;
+            uint64_t body = 0;
+            int failures = 0;
+            for(int i = 0; i < rounds; i++)
+                failures += bench_parse_feed(rsp, rsp_len, frags[f], &body) != 0;
+            took = bench_now() - start;
+            printf("body=%-8s fragment=%-6zu rounds=%d failures=%d %.1fMB/s\n", chunked ? "chunked" : "length",
+                   frags[f], rounds, failures, rsp_len * (double)rounds / took / (1024.0 * 1024.0));
+            ret |= failures || body != (uint64_t)BENCH_PARSE_BODY_LEN * rounds ? -1 : 0;
+        }
+        free(rsp);
+    }
+
+    // response heads alone, as seen by small keep-alive requests
+    for(size_t f = 0; f < 2; f++) {
+        size_t frag = f == 0 ? sizeof(head) - 1 : 16;
+        double start = bench_now(), took;
+        uint64_t body = 0;
+        int failures = 0;
+        for(int i = 0; i < BENCH_PARSE_HEAD_COUNT * rounds; i++)
+            failures += bench_parse_feed((const uint8_t *)head, sizeof(head) - 1, frag, &body) != 0;
+        took = bench_now() - start;
+        printf("head     fragment=%-6zu count=%d failures=%d %.0f heads/s %.1fMB/s\n", frag,
+               BENCH_PARSE_HEAD_COUNT * rounds, failures, BENCH_PARSE_HEAD_COUNT * rounds / took,
+               (sizeof(head) - 1) * (double)BENCH_PARSE_HEAD_COUNT * rounds / took / (1024.0 * 1024.0));
+        ret |= failures ? -1 : 0;
+    }
+    return ret;
+}
+
+// Resident set size of the process, for memory per connection
+static long long bench_rss_bytes(void)
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    long long pages = 0, rss = 0;
+
+    if(!fp)
+        return 0;
+    if(fscanf(fp, "%lld %lld", &pages, &rss) != 2)
+        rss = 0;
+    fclose(fp);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+// CPU time used by the whole process, all threads included
+static double bench_cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int bench_count_sink(void *user_ctx, https_sink_event_t event, const https_sink_info_t *info,
+                            const uint8_t *data, uint32_t len)
+{
+    (void)info;
+    (void)data;
+    if(event == HTTPS_SINK_DATA)
+        *(uint64_t *)user_ctx += len;
+    return 0;
+}
+
+static void bench_concurrent_report(const char *label, https_client_t *client, int transfers, int conns,
+                                    int failures, double took, double cpu, uint64_t bytes, long long rss_delta)
+{
+    https_client_stats_t stats;
+
+    https_client_get_stats(client, &stats);
+    printf("%-8s transfers=%d connections=%d failures=%d time=%.2fs %.1fMB/s cpu=%.2fs rss=+%.1fMB %.1fKB/conn"
+           " full=%llu resumed=%llu\n", label, transfers, conns, failures, took, bytes / took / (1024.0 * 1024.0),
+           cpu, rss_delta / (1024.0 * 1024.0), rss_delta / 1024.0 / conns,
+           (unsigned long long)stats.tls_full_handshakes, (unsigned long long)stats.tls_resumed_handshakes);
+}
+
+static https_client_t *bench_concurrent_client(int conns)
+{
+    https_client_config_t config;
+
+    https_client_config_init(&config);
+    config.max_idle_connections = conns;   // every connection survives to the next transfer
+    return https_client_create(&config);
+}
+
+// All transfers from one thread through the event engine; no more than
+// conns are submitted at a time so queued requests don't count as memory
+static int bench_engine(const char *url, int transfers, int conns)
+{
+    https_client_t *client = bench_concurrent_client(conns);
+    https_engine_t *engine = client ? https_engine_create(client, conns) : NULL;
+    https_completion_t done[64];
+    long long base_rss, peak_rss;
+    uint64_t bytes = 0;
+    int submitted = 0, finished = 0, failures = 0;
+    double start, cpu;
+
+    if(!engine) {
+        fprintf(stderr, "bench: setup failed\n");
+        https_client_destroy(client);
+        return -1;
+    }
+
+    printf("== Concurrent downloads, event engine: %s ==\n", url);
+    base_rss = peak_rss = bench_rss_bytes();
+    start = bench_now();
+    cpu = bench_cpu_seconds();
+    while(finished < transfers) {
+        while(submitted < transfers && https_engine_pending(engine) < conns) {
+            if(https_engine_submit(engine, url, bench_count_sink, &bytes) != 0) {
+                failures++;
+                finished++;
+            }
+            submitted++;
+        }
+        if(https_engine_poll(engine, 1000) < 0)
+            break;
+        for(int n = https_engine_complete(engine, done, 64), i = 0; i < n; i++) {
+            failures += done[i].result != 0;
+            finished++;
+        }
+        long long rss = bench_rss_bytes();
+        if(rss > peak_rss)
+            peak_rss = rss;
+    }
+    failures += transfers - finished;
+
+    bench_concurrent_report("engine", client, transfers, conns, failures, bench_now() - start,
+                            bench_cpu_seconds() - cpu, bytes, peak_rss - base_rss);
+    https_engine_destroy(engine);
+    https_client_destroy(client);
+    return failures ? -1 : 0;
+}
+
+typedef struct {
+    https_client_t *client;
+    const char *url;
+    pthread_mutex_t lock;
+    int next;
+    int transfers;
+    int failures;
+    int running;
+    uint64_t bytes;
+} bench_threads_t;
+
+static void *bench_threads_worker(void *arg)
+{
+    bench_threads_t *b = (bench_threads_t *)arg;
+    uint64_t bytes = 0;
+    int failures = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&b->lock);
+        int mine = b->next < b->transfers ? b->next++ : -1;
+        pthread_mutex_unlock(&b->lock);
+        if(mine < 0)
+            break;
+        failures += https_client_download_to_sink(b->client, b->url, bench_count_sink, &bytes) != 0;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->bytes += bytes;
+    b->failures += failures;
+    b->running--;
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+// The same transfers as bench_engine(), one blocking download per thread
+static int bench_threads(const char *url, int transfers, int conns)
+{
+    bench_threads_t b;
+    pthread_t *threads = (pthread_t *)calloc(conns, sizeof(pthread_t));
+    long long base_rss, peak_rss;
+    int started = 0, running;
+    double start, cpu;
+
+    memset(&b, 0, sizeof(b));
+    b.client = bench_concurrent_client(conns);
+    b.url = url;
+    b.transfers = transfers;
+    pthread_mutex_init(&b.lock, NULL);
+    if(!b.client || !threads) {
+        fprintf(stderr, "bench: setup failed\n");
+        https_client_destroy(b.client);
+        free(threads);
+        return -1;
+    }
+
+    printf("== Concurrent downloads, thread per connection: %s ==\n", url);
+    base_rss = peak_rss = bench_rss_bytes();
+    start = bench_now();
+    cpu = bench_cpu_seconds();
+    b.running = conns;
+    for(int i = 0; i < conns; i++) {
+        if(pthread_create(&threads[i], NULL, bench_threads_worker, &b) != 0)
+            break;
+        started++;
+    }
+    pthread_mutex_lock(&b.lock);
+    b.running -= conns - started;
+    pthread_mutex_unlock(&b.lock);
+
+    do {
+        long long rss = bench_rss_bytes();
+        if(rss > peak_rss)
+            peak_rss = rss;
+        sys_delay_ms(10);
+        pthread_mutex_lock(&b.lock);
+        running = b.running;
+        pthread_mutex_unlock(&b.lock);
+    } while(running > 0);
+    for(int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    b.failures += transfers - b.next;
+    bench_concurrent_report("threads", b.client, transfers, started > 0 ? started : 1, b.failures,
+                            bench_now() - start, bench_cpu_seconds() - cpu, b.bytes, peak_rss - base_rss);
+    https_client_destroy(b.client);
+    pthread_mutex_destroy(&b.lock);
+    free(threads);
+    return b.failures ? -1 : 0;
+}
+
+// Write throughput of every sys_file backend, offline. Each round
+// preallocates the file like a download with a known size does, writes it
+// in record-sized pieces and ends with fsync, so the page cache can't hide
+// the cost of getting the data to the device.
+static int bench_filewrite(const char *path, int rounds)
+{
+    static const sys_file_backend_t backends[] = {
+        SYS_FILE_BACKEND_STDIO, SYS_FILE_BACKEND_WRITE, SYS_FILE_BACKEND_DIRECT, SYS_FILE_BACKEND_URING,
+        SYS_FILE_BACKEND_MMAP
+    };
+    uint8_t *piece = malloc(BENCH_FILE_PIECE);
+    int ret = 0;
+
+    if(!piece) {
+        fprintf(stderr, "bench: setup failed\n");
+        return -1;
+    }
+    for(uint32_t i = 0; i < BENCH_FILE_PIECE; i++)
+        piece[i] = (uint8_t)(i * 13);
+
+    printf("== File write throughput (%d MB to %s) ==\n", BENCH_FILE_SIZE / (1024 * 1024), path);
+    for(size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        double elapsed = 0, cpu = 0, best = 0;
+        sys_file_backend_t used = backends[b];
+        int failures = 0;
+
+        for(int r = 0; r < rounds; r++) {
+            sys_file_t file;
+            double start = bench_now(), cpu_start = bench_cpu_seconds(), took;
+            int ok = sys_file_open_backend(&file, path, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE, backends[b]) == SYS_FILE_OK;
+
+            if(ok) {
+                used = file.backend;
+                ok = sys_file_preallocate(&file, BENCH_FILE_SIZE) != SYS_FILE_NO_SPACE;
+                for(uint32_t off = 0; ok && off < BENCH_FILE_SIZE; off += BENCH_FILE_PIECE) {
+                    uint32_t written;
+                    ok = sys_file_write(&file, piece, BENCH_FILE_PIECE, &written) == SYS_FILE_OK;
+                }
+                ok = ok && sys_file_sync(&file) == SYS_FILE_OK;
+                sys_file_close(&file);
+            }
+            took = bench_now() - start;
+            cpu += bench_cpu_seconds() - cpu_start;
+            if(!ok || bench_file_size(path) != BENCH_FILE_SIZE) {
+                failures++;
+                continue;
+            }
+            elapsed += took;
+            if(best == 0 || took < best)
+                best = took;
+        }
+        remove(path);
+
+        if(failures == rounds) {
+            printf("backend=%-9s all %d rounds failed\n", sys_file_backend_name(backends[b]), rounds);
+            ret = -1;
+            continue;
+        }
+        printf("backend=%-9s used=%-9s rounds=%d failures=%d avg=%.1fMB/s best=%.1fMB/s cpu=%.2fs/GB\n",
+               sys_file_backend_name(backends[b]), sys_file_backend_name(used), rounds, failures,
+               (double)BENCH_FILE_SIZE * (rounds - failures) / elapsed / (1024.0 * 1024.0),
+               BENCH_FILE_SIZE / best / (1024.0 * 1024.0), cpu / ((double)BENCH_FILE_SIZE * rounds / (1024.0 * 1024.0 * 1024.0)));
+        ret |= failures ? -1 : 0;
+    }
+    free(piece);
+    return ret;
+}
+
+// Suites of both profiles, fast ones first
+static const char *bench_cipher_suites[] = {
+    "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",
+    "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256",
+    "TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256",
+    "TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256",
+    "TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384",
+    "TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384",
+    "TLS-RSA-WITH-AES-256-CBC-SHA256",
+    "TLS-RSA-WITH-AES-128-CBC-SHA256",
+    "TLS-RSA-WITH-AES-256-CBC-SHA",
+    "TLS-RSA-WITH-AES-128-CBC-SHA",
+    "TLS-RSA-WITH-3DES-EDE-CBC-SHA",
+    NULL
+};
+
+// Handshake latency and bulk throughput of one profile or one forced
+// suite. Each handshake is a full one on a new connection.
+static int bench_cipher_run(const char *label, int profile, const char *suite, const char *url, int rounds)
+{
+    https_client_config_t config;
+    https_client_t *client;
+    double *samples, total = 0, elapsed = 0;
+    uint64_t bytes = 0;
+    int failures = 0, ret = -1;
+
+    https_client_config_init(&config);
+    config.tls_profile = profile;
+    config.ciphersuites = suite;
+    config.max_idle_connections = 0;
+    config.session_cache_size = 0;
+
+    client = https_client_create(&config);
+    samples = (double *)calloc(rounds, sizeof(double));
+    if(!client || !samples) {
+        printf("%-46s unsupported by this mbedTLS\n", label);
+        goto bench_cipher_run_exit;
+    }
+    if(https_client_download(client, BENCH_DEFAULT_URL, "/dev/null") != 0) {
+        printf("%-46s handshake failed, not offered by the server?\n", label);
+        goto bench_cipher_run_exit;
+    }
+
+    for(int i = 0; i < rounds; i++) {
+        double start = bench_now();
+        if(https_client_download(client, BENCH_DEFAULT_URL, "/dev/null") != 0)
+            failures++;
+        samples[i] = (bench_now() - start) * 1000.0;
+        total += samples[i];
+    }
+    qsort(samples, rounds, sizeof(double), bench_compare_double);
+
+    for(int i = 0; i < BENCH_THROUGHPUT_ROUNDS; i++) {
+        uint64_t received = 0;
+        double start = bench_now();
+
+        if(https_client_download_to_sink(client, url, bench_count_sink, &received) != 0) {
+            failures++;
+            continue;
+        }
+        elapsed += bench_now() - start;
+        bytes += received;
+    }
+
+    printf("%-46s handshake avg=%.3fms p50=%.3fms throughput=%.1fMB/s failures=%d\n", label,
+           total / rounds, samples[rounds / 2], elapsed > 0 ? bytes / elapsed / (1024.0 * 1024.0) : 0.0,
+           failures);
+    ret = failures ? -1 : 0;
+
+bench_cipher_run_exit:
+    https_client_destroy(client);
+    free(samples);
+    return ret;
+}
+
+static int bench_ciphers(const char *url, int rounds)
+{
+    int ret = 0;
+
+    printf("== TLS profiles and cipher suites: %s ==\n", url);
+    ret |= bench_cipher_run("profile=fast", HTTPS_TLS_PROFILE_FAST, NULL, url, rounds);
+    ret |= bench_cipher_run("profile=compat", HTTPS_TLS_PROFILE_COMPAT, NULL, url, rounds);
+    // a suite the server or this mbedTLS lacks is reported, not fatal
+    for(int i = 0; bench_cipher_suites[i]; i++)
+        bench_cipher_run(bench_cipher_suites[i], HTTPS_TLS_PROFILE_COMPAT, bench_cipher_suites[i], url, rounds);
+    return ret;
+}
+
+// End-to-end scenarios against bench_server, see its query options
+typedef struct {
+    const char *name;
+    const char *path;           // Appended to the base URL
+    int rounds;                 // 0 = the -n count
+    int pooled;                 // Keep-alive and session resumption on
+    int connections;            // > 0: Range download with resume into a file
+    int to_file;                // Through https_client_download_ex() into a file, else into a counting sink
+} bench_e2e_case_t;
+
+static const bench_e2e_case_t bench_e2e_cases[] = {
+    { "handshake",  "/size/1024",                  0, 0, 0, 0 },
+    { "keepalive",  "/size/1024",                  0, 1, 0, 0 },
+    { "delay",      "/size/1024?delay=20",         0, 1, 0, 0 },
+    { "large",      "/size/67108864",              3, 1, 0, 1 },
+    { "chunked",    "/size/67108864?chunked",      3, 1, 0, 1 },
+    { "parallel",   "/size/67108864",              3, 1, 4, 1 },
+    { "disconnect", "/size/16777216?drop=1048576", 3, 1, 1, 1 },
+    { NULL, NULL, 0, 0, 0, 0 }
+};
+
+typedef struct {
+    double start;
+    double ttfb;                // Seconds until the response head, 0 = not seen
+    uint64_t bytes;
+} bench_e2e_sink_t;
+
+static int bench_e2e_sink(void *user_ctx, https_sink_event_t event, const https_sink_info_t *info,
+                          const uint8_t *data, uint32_t len)
+{
+    bench_e2e_sink_t *s = (bench_e2e_sink_t *)user_ctx;
+
+    (void)info;
+    (void)data;
+    if(event == HTTPS_SINK_BEGIN && s->ttfb == 0)
+        s->ttfb = bench_now() - s->start;
+    else if(event == HTTPS_SINK_DATA)
+        s->bytes += len;
+    return 0;
+}
+
+// Nearest-rank percentile of sorted samples
+static double bench_percentile(const double *sorted, int count, int percent)
+{
+    int rank = (count * percent + 99) / 100;
+
+    if(count == 0)
+        return 0;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void bench_e2e_print(FILE *fp, const char *label, double *samples, int count, int json)
+{
+    qsort(samples, count, sizeof(double), bench_compare_double);
+    if(json) {
+        if(count == 0)
+            fprintf(fp, ",\"%s\":null", label);
+        else
+            fprintf(fp, ",\"%s\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f}", label,
+                    bench_percentile(samples, count, 50), bench_percentile(samples, count, 90),
+                    bench_percentile(samples, count, 99));
+    } else if(count > 0) {
+        fprintf(fp, " %s=%.2f/%.2f/%.2fms", label, bench_percentile(samples, count, 50),
+                bench_percentile(samples, count, 90), bench_percentile(samples, count, 99));
+    }
+}
+
+static int bench_e2e_run(const bench_e2e_case_t *c, const char *base, int rounds, FILE *json)
+{
+    https_client_config_t config;
+    https_client_stats_t before, after;
+    sys_mem_stats_t mem_warm, mem_end;
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_client_t *client;
+    double *total_ms, *handshake_ms, *ttfb_ms, elapsed = 0, heap_per_download = 0;
+    int handshakes = 0, ttfbs = 0, failures = 0, done = 0;
+    uint64_t bytes = 0;
+    char url[256], sidecar[256];
+
+    snprintf(url, sizeof(url), "%s%s", base, c->path);
+    snprintf(sidecar, sizeof(sidecar), "%s.resume", BENCH_OUTPUT_PATH);
+    https_client_config_init(&config);
+    if(!c->pooled) {
+        config.max_idle_connections = 0;
+        config.session_cache_size = 0;
+    }
+    https_download_opts_init(&opts);
+    opts.connections = c->connections;
+    opts.resume = c->connections > 0;
+    opts.stats = &ts;
+
+    client = https_client_create(&config);
+    total_ms = (double *)calloc(rounds * 3, sizeof(double));
+    if(!client || !total_ms) {
+        fprintf(stderr, "bench: setup failed\n");
+        https_client_destroy(client);
+        free(total_ms);
+        return -1;
+    }
+    handshake_ms = total_ms + rounds;
+    ttfb_ms = handshake_ms + rounds;
+
+    for(int i = 0; i < rounds; i++) {
+        bench_e2e_sink_t sink = { 0, 0, 0 };
+        uint64_t handshakes_before;
+        int ret;
+
+        remove(BENCH_OUTPUT_PATH);
+        remove(sidecar);
+        // the first round warms the pools, the rest should need no heap
+        if(i == 1)
+            sys_mem_get_stats(&mem_warm);
+        https_client_get_stats(client, &before);
+        sink.start = bench_now();
+        if(c->to_file) {
+            ret = https_client_download_ex(client, url, BENCH_OUTPUT_PATH, &opts);
+            sink.bytes = (uint64_t)bench_file_size(BENCH_OUTPUT_PATH);
+            if(ts.first_byte_us)
+                sink.ttfb = (ts.first_byte_us - ts.start_us) / 1000000.0;
+        } else {
+            ret = https_client_download_to_sink(client, url, bench_e2e_sink, &sink);
+        }
+        if(ret != 0) {
+            failures++;
+            continue;
+        }
+        total_ms[done] = (bench_now() - sink.start) * 1000.0;
+        elapsed += total_ms[done++] / 1000.0;
+        bytes += sink.bytes;
+        if(sink.ttfb > 0)
+            ttfb_ms[ttfbs++] = sink.ttfb * 1000.0;
+
+        // handshakes of this download, averaged when it needed several
+        https_client_get_stats(client, &after);
+        handshakes_before = before.tls_full_handshakes + before.tls_resumed_handshakes;
+        if(after.tls_full_handshakes + after.tls_resumed_handshakes > handshakes_before)
+            handshake_ms[handshakes++] = (after.tls_handshake_us - before.tls_handshake_us) / 1000.0 /
+                    (double)(after.tls_full_handshakes + after.tls_resumed_handshakes - handshakes_before);
+    }
+    if(rounds > 1) {
+        sys_mem_get_stats(&mem_end);
+        heap_per_download = (mem_end.heap_allocs - mem_warm.heap_allocs) / (double)(rounds - 1);
+    }
+    https_client_destroy(client);
+    remove(BENCH_OUTPUT_PATH);
+    remove(sidecar);
+
+    printf("%-10s rounds=%d failures=%d %.1fMB/s", c->name, rounds, failures,
+           elapsed > 0 ? bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+    bench_e2e_print(stdout, "total", total_ms, done, 0);
+    bench_e2e_print(stdout, "handshake", handshake_ms, handshakes, 0);
+    bench_e2e_print(stdout, "ttfb", ttfb_ms, ttfbs, 0);
+    printf(" heap=%.1f/download\n", heap_per_download);
+
+    // one JSON object per line, so runs can be appended and compared
+    if(json) {
+        fprintf(json, "{\"bench\":\"e2e\",\"case\":\"%s\",\"time\":%lld,\"url\":\"%s\",\"rounds\":%d,"
+                "\"failures\":%d,\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.3f", c->name,
+                (long long)time(NULL), url, rounds, failures, (unsigned long long)bytes, elapsed,
+                elapsed > 0 ? bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+        bench_e2e_print(json, "total_ms", total_ms, done, 1);
+        bench_e2e_print(json, "handshake_ms", handshake_ms, handshakes, 1);
+        bench_e2e_print(json, "ttfb_ms", ttfb_ms, ttfbs, 1);
+        fprintf(json, ",\"heap_allocs_per_download\":%.2f}\n", heap_per_download);
+        fflush(json);
+    }
+
+    free(total_ms);
+    return failures ? -1 : 0;
+}
+
+static int bench_e2e(const char *base, int rounds, const char *json_path)
+{
+    FILE *json = NULL;
+    int ret = 0;
+
+    if(json_path) {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "a");
+        if(!json) {
+            fprintf(stderr, "bench: cannot open %s\n", json_path);
+            return -1;
+        }
+    }
+
+    printf("== End to end: %s ==\n", base);
+    for(int i = 0; bench_e2e_cases[i].name; i++) {
+        const bench_e2e_case_t *c = &bench_e2e_cases[i];
+        ret |= bench_e2e_run(c, base, c->rounds > 0 ? c->rounds : rounds, json);
+    }
+
+    if(json && json != stdout)
+        fclose(json);
+    return ret;
+}
+
+static void print_usage(const char *program_name)
+{
+    printf("Usage: %s <benchmark> [options]\n", program_name);
+    printf("Benchmarks:\n");
+    printf("  handshake   Full vs resumed TLS handshake latency\n");
+    printf("  throughput  Body throughput for several receive buffer sizes and with write-behind\n");
+    printf("  parse       Response parser throughput, offline\n");
+    printf("  engine      Many concurrent downloads from one thread through the event engine\n");
+    printf("  threads     The same downloads with one blocking thread per connection\n");
+    printf("  filewrite   File write throughput of each storage backend, offline\n");
+    printf("  ciphers     Handshake latency and throughput of each TLS profile and cipher suite\n");
+    printf("  e2e         End-to-end scenarios: MB/s with handshake and time-to-first-byte percentiles\n");
+    printf("Options:\n");
+    printf("  -u <url>    URL to download (default %s,\n", BENCH_DEFAULT_URL);
+    printf("              %s for throughput,\n", BENCH_THROUGHPUT_URL);
+    printf("              %s for the ciphers throughput part,\n", BENCH_CIPHER_URL);
+    printf("              base URL %s for e2e,\n", BENCH_E2E_BASE);
+    printf("              %s for engine and threads)\n", BENCH_CONCURRENT_URL);
+    printf("  -n <count>  Number of rounds (default %d, %d for throughput, %d for parse, %d for filewrite),\n",
+           BENCH_DEFAULT_ROUNDS, BENCH_THROUGHPUT_ROUNDS, BENCH_PARSE_ROUNDS, BENCH_FILE_ROUNDS);
+    printf("              or downloads for engine and threads (default %d),\n", BENCH_CONCURRENT_TRANSFERS);
+    printf("              or rounds of the small e2e scenarios (default %d)\n", BENCH_E2E_ROUNDS);
+    printf("  -c <count>  Concurrent connections for engine and threads (default %d)\n", BENCH_CONCURRENT_CONNS);
+    printf("  -o <path>   File written by filewrite (default %s)\n", BENCH_OUTPUT_PATH);
+    printf("  -j <path>   Append e2e results to <path> as JSON lines, \"-\" for stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *url = NULL;
+    int rounds = -1;
+    int conns = BENCH_CONCURRENT_CONNS;
+    const char *output = BENCH_OUTPUT_PATH;
+    const char *json = NULL;
+
+    if(argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        print_usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+
+    for(int i = 2; i < argc; i++) {
+        if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            url = argv[++i];
+        } else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            conns = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(rounds == 0 || rounds < -1) {
+        fprintf(stderr, "bench: invalid round count\n");
+        return 1;
+    }
+    if(conns <= 0) {
+        fprintf(stderr, "bench: invalid connection count\n");
+        return 1;
+    }
+
+    if(strcmp(argv[1], "handshake") == 0)
+        return bench_handshake(url ? url : BENCH_DEFAULT_URL,
+                               rounds > 0 ? rounds : BENCH_DEFAULT_ROUNDS) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "throughput") == 0)
+        return bench_throughput(url ? url : BENCH_THROUGHPUT_URL,
+                                rounds > 0 ? rounds : BENCH_THROUGHPUT_ROUNDS) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "parse") == 0)
+        return bench_parse(rounds > 0 ? rounds : BENCH_PARSE_ROUNDS) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "engine") == 0)
+        return bench_engine(url ? url : BENCH_CONCURRENT_URL,
+                            rounds > 0 ? rounds : BENCH_CONCURRENT_TRANSFERS, conns) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "threads") == 0)
+        return bench_threads(url ? url : BENCH_CONCURRENT_URL,
+                             rounds > 0 ? rounds : BENCH_CONCURRENT_TRANSFERS, conns) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "ciphers") == 0)
+        return bench_ciphers(url ? url : BENCH_CIPHER_URL,
+                             rounds > 0 ? rounds : BENCH_DEFAULT_ROUNDS) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "e2e") == 0)
+        return bench_e2e(url ? url : BENCH_E2E_BASE, rounds > 0 ? rounds : BENCH_E2E_ROUNDS, json) == 0 ? 0 : 1;
+    if(strcmp(argv[1], "filewrite") == 0)
+        return bench_filewrite(output, rounds > 0 ? rounds : BENCH_FILE_ROUNDS) == 0 ? 0 : 1;
+
+    print_usage(argv[0]);
+    return 1;
+}
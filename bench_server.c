@@ -0,0 +1,483 @@
+// Local HTTPS server used by the benchmarks
+//
+// Serves synthetic payloads over mbedTLS so download performance can be
+// measured offline and reproducibly. Every connection gets its own thread.
+//
+//   GET /size/<bytes>[?<option>&...]   returns <bytes> of generated data (keep-alive)
+//
+// Byte n of every payload is (n * 7 + 3) & 0xff, so ranges of the same
+// resource line up. Range requests get a 206 unless "norange" is given.
+// Options:
+//   chunked        send the body with Transfer-Encoding: chunked
+//   delay=<ms>     wait before sending the response head
+//   drop=<bytes>   cut the connection, without close_notify, after <bytes>
+//                  of any response body longer than that; a resumed
+//                  download gets further with every attempt
+//   norange        ignore Range headers
+//   redirect=<n>   answer with a redirect to the same resource with n - 1,
+//                  so the data comes after n hops
+//   code=<status>  status of those redirects (default 302)
+//   via=<host>     make the redirects absolute, to <host> on the same port
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/certs.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/ssl_ticket.h"
+#include "system_abstraction.h"
+
+#define BENCH_SERVER_PORT          "4433"
+#define BENCH_SERVER_REQ_LEN       4096
+#define BENCH_SERVER_CHUNK_LEN     16384
+#define BENCH_SERVER_BACKLOG       1024           // Room for bursts of connects from the engine benchmark
+#define BENCH_SERVER_PERIOD        256            // The payload pattern repeats every this many bytes
+#define BENCH_SERVER_DROPPED       1              // bench_serve_request() cut the connection on purpose
+
+typedef struct {
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt srvcert;
+    mbedtls_pk_context pkey;
+#if defined(MBEDTLS_ECDSA_C)
+    mbedtls_x509_crt srvcert_ec;    // Second certificate, for the ECDHE_ECDSA suites
+    mbedtls_pk_context pkey_ec;
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_context cache;
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_ticket_context ticket;
+#endif
+    unsigned char payload[BENCH_SERVER_CHUNK_LEN];
+} bench_server_t;
+
+typedef struct {
+    bench_server_t *server;
+    mbedtls_net_context client_fd;
+} bench_conn_t;
+
+static int bench_ssl_write_all(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+{
+    while(len > 0) {
+        int ret = mbedtls_ssl_write(ssl, buf, len);
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            continue;
+        if(ret <= 0)
+            return -1;
+        buf += ret;
+        len -= (size_t)ret;
+    }
+    return 0;
+}
+
+// Read one request head into buf, returns its length or -1 when the client is gone
+static int bench_read_request(mbedtls_ssl_context *ssl, char *buf, int buf_len)
+{
+    int len = 0;
+
+    while(len < buf_len - 1) {
+        int ret = mbedtls_ssl_read(ssl, (unsigned char *)buf + len, buf_len - 1 - len);
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            continue;
+        if(ret <= 0)
+            return -1;
+        len += ret;
+        buf[len] = '\0';
+        if(strstr(buf, "\r\n\r\n"))
+            return len;
+    }
+    return -1;
+}
+
+typedef struct {
+    unsigned long long size;
+    int chunked;
+    unsigned int delay_ms;
+    unsigned long long drop;        // 0 = never
+    int ranges;
+    unsigned int redirects;         // Hops left before the data
+    unsigned int redirect_code;
+    char via[64];                   // Host of absolute redirects, "" = relative ones
+} bench_request_t;
+
+// Value of a request header, NULL when absent
+static const char *bench_request_header(const char *request, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line = strstr(request, "\r\n");
+
+    while(line && line[2] != '\r') {
+        line += 2;
+        if(strncasecmp(line, name, len) == 0 && line[len] == ':') {
+            line += len + 1;
+            while(*line == ' ')
+                line++;
+            return line;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+// "GET /size/<bytes>?opt&opt HTTP/1.1"
+static int bench_parse_request(const char *request, bench_request_t *req)
+{
+    const char *p;
+    char *end;
+
+    memset(req, 0, sizeof(*req));
+    req->ranges = 1;
+    req->redirect_code = 302;
+    if(strncmp(request, "GET /size/", 10) != 0)
+        return -1;
+    req->size = strtoull(request + 10, &end, 10);
+    if(end == request + 10)
+        return -1;
+    for(p = end; *p == '?' || *p == '&'; ) {
+        p++;
+        if(strncmp(p, "chunked", 7) == 0)
+            req->chunked = 1;
+        else if(strncmp(p, "norange", 7) == 0)
+            req->ranges = 0;
+        else if(strncmp(p, "delay=", 6) == 0)
+            req->delay_ms = (unsigned int)strtoul(p + 6, NULL, 10);
+        else if(strncmp(p, "drop=", 5) == 0)
+            req->drop = strtoull(p + 5, NULL, 10);
+        else if(strncmp(p, "redirect=", 9) == 0)
+            req->redirects = (unsigned int)strtoul(p + 9, NULL, 10);
+        else if(strncmp(p, "code=", 5) == 0)
+            req->redirect_code = (unsigned int)strtoul(p + 5, NULL, 10);
+        else if(strncmp(p, "via=", 4) == 0)
+            snprintf(req->via, sizeof(req->via), "%.*s", (int)strcspn(p + 4, "& "), p + 4);
+        p += strcspn(p, "& ");
+    }
+    return 0;
+}
+
+// Send len payload bytes starting at resource offset pos, stopping after
+// limit bytes (0 = no limit)
+static int bench_send_body(bench_server_t *server, mbedtls_ssl_context *ssl, unsigned long long pos,
+                           unsigned long long len, int chunked, unsigned long long limit)
+{
+    unsigned long long sent = 0;
+    char line[32];
+    int drop = 0;
+
+    while(sent < len) {
+        size_t piece = BENCH_SERVER_CHUNK_LEN - BENCH_SERVER_PERIOD;
+        size_t phase = (size_t)((pos + sent) % BENCH_SERVER_PERIOD);
+
+        if(len - sent < piece)
+            piece = (size_t)(len - sent);
+        if(limit > 0 && limit < len && sent + piece > limit) {
+            piece = (size_t)(limit - sent);
+            drop = 1;
+        }
+        if(chunked) {
+            int n = snprintf(line, sizeof(line), "%zx\r\n", piece);
+            if(bench_ssl_write_all(ssl, (const unsigned char *)line, (size_t)n) != 0)
+                return -1;
+        }
+        if(bench_ssl_write_all(ssl, server->payload + phase, piece) != 0)
+            return -1;
+        if(drop)
+            return BENCH_SERVER_DROPPED;
+        if(chunked && bench_ssl_write_all(ssl, (const unsigned char *)"\r\n", 2) != 0)
+            return -1;
+        sent += piece;
+    }
+    if(chunked && bench_ssl_write_all(ssl, (const unsigned char *)"0\r\n\r\n", 5) != 0)
+        return -1;
+    return 0;
+}
+
+// Redirect to the request target with the redirect count one lower
+static int bench_send_redirect(mbedtls_ssl_context *ssl, const char *request, const bench_request_t *req)
+{
+    static const char body[] = "Moved\n";
+    char head[BENCH_SERVER_REQ_LEN + 256];
+    char origin[128] = "";
+    const char *target = request + 4;
+    const char *end = target + strcspn(target, " \r");
+    const char *count = strstr(target, "redirect=") + 9;
+    const char *rest = count + strspn(count, "0123456789");
+    int head_len;
+
+    if(req->via[0]) {
+        const char *host = bench_request_header(request, "Host");
+        const char *port = host ? memchr(host, ':', strcspn(host, "\r")) : NULL;
+        snprintf(origin, sizeof(origin), "https://%s:%d", req->via, port ? atoi(port + 1) : 443);
+    }
+    head_len = snprintf(head, sizeof(head), "HTTP/1.1 %u Redirect\r\nLocation: %s%.*s%u%.*s\r\n"
+            "Content-Length: %zu\r\n\r\n%s", req->redirect_code, origin, (int)(count - target), target,
+            req->redirects - 1, (int)(end - rest), rest, strlen(body), body);
+    if(head_len >= (int)sizeof(head))
+        return -1;
+    return bench_ssl_write_all(ssl, (const unsigned char *)head, (size_t)head_len);
+}
+
+static int bench_serve_request(bench_server_t *server, mbedtls_ssl_context *ssl, const char *request)
+{
+    char head[512];
+    bench_request_t req;
+    unsigned long long first = 0, last = 0;
+    const char *range;
+    int head_len, partial = 0;
+
+    if(bench_parse_request(request, &req) != 0) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        return bench_ssl_write_all(ssl, (const unsigned char *)not_found, strlen(not_found));
+    }
+    if(req.delay_ms > 0)
+        sys_delay_ms(req.delay_ms);
+    if(req.redirects > 0)
+        return bench_send_redirect(ssl, request, &req);
+
+    // a single range: "a-b", "a-" or the suffix form "-n"
+    range = req.ranges ? bench_request_header(request, "Range") : NULL;
+    if(range && strncmp(range, "bytes=", 6) == 0 && !strchr(range, ',')) {
+        if(range[6] == '-') {
+            unsigned long long n = strtoull(range + 7, NULL, 10);
+            first = n < req.size ? req.size - n : 0;
+            last = req.size - 1;
+        } else if(sscanf(range + 6, "%llu-%llu", &first, &last) < 2) {
+            last = req.size - 1;
+        }
+        if(first >= req.size || first > last) {
+            head_len = snprintf(head, sizeof(head), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                    "Content-Range: bytes */%llu\r\nContent-Length: 0\r\n\r\n", req.size);
+            return bench_ssl_write_all(ssl, (const unsigned char *)head, (size_t)head_len);
+        }
+        if(last >= req.size)
+            last = req.size - 1;
+        partial = 1;
+    } else {
+        last = req.size - 1;
+    }
+
+    head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: application/octet-stream\r\n"
+            "ETag: \"bench-%llu\"\r\n%s", partial ? "206 Partial Content" : "200 OK", req.size,
+            req.ranges ? "Accept-Ranges: bytes\r\n" : "");
+    if(partial)
+        head_len += snprintf(head + head_len, sizeof(head) - head_len, "Content-Range: bytes %llu-%llu/%llu\r\n",
+                             first, last, req.size);
+    if(req.chunked)
+        head_len += snprintf(head + head_len, sizeof(head) - head_len, "Transfer-Encoding: chunked\r\n\r\n");
+    else
+        head_len += snprintf(head + head_len, sizeof(head) - head_len, "Content-Length: %llu\r\n\r\n",
+                             req.size > 0 ? last - first + 1 : 0);
+    if(bench_ssl_write_all(ssl, (const unsigned char *)head, (size_t)head_len) != 0)
+        return -1;
+
+    return bench_send_body(server, ssl, first, req.size > 0 ? last - first + 1 : 0, req.chunked,
+                           req.drop);
+}
+
+static void *bench_conn_thread(void *arg)
+{
+    bench_conn_t *c = (bench_conn_t *)arg;
+    mbedtls_ssl_context ssl;
+    char request[BENCH_SERVER_REQ_LEN];
+    int ret;
+
+    mbedtls_ssl_init(&ssl);
+    if(mbedtls_ssl_setup(&ssl, &c->server->conf) != 0)
+        goto bench_conn_exit;
+    mbedtls_ssl_set_bio(&ssl, &c->client_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+
+    while((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+        if(ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+            goto bench_conn_exit;
+    }
+
+    // keep-alive: serve requests until the client closes
+    while(bench_read_request(&ssl, request, sizeof(request)) > 0) {
+        ret = bench_serve_request(c->server, &ssl, request);
+        if(ret == BENCH_SERVER_DROPPED)
+            goto bench_conn_exit;
+        if(ret != 0)
+            break;
+    }
+    mbedtls_ssl_close_notify(&ssl);
+
+bench_conn_exit:
+    mbedtls_ssl_free(&ssl);
+    mbedtls_net_free(&c->client_fd);
+    sys_free(c);
+    return NULL;
+}
+
+static int bench_server_setup(bench_server_t *server)
+{
+    const char *pers = "bench_server";
+    int ret;
+    size_t i;
+
+    for(i = 0; i < sizeof(server->payload); i++)
+        server->payload[i] = (unsigned char)(i * 7 + 3);
+
+    mbedtls_ssl_config_init(&server->conf);
+    mbedtls_entropy_init(&server->entropy);
+    mbedtls_ctr_drbg_init(&server->ctr_drbg);
+    mbedtls_x509_crt_init(&server->srvcert);
+    mbedtls_pk_init(&server->pkey);
+#if defined(MBEDTLS_ECDSA_C)
+    mbedtls_x509_crt_init(&server->srvcert_ec);
+    mbedtls_pk_init(&server->pkey_ec);
+#endif
+
+    if((ret = mbedtls_ctr_drbg_seed(&server->ctr_drbg, mbedtls_entropy_func, &server->entropy,
+                                   (const unsigned char *)pers, strlen(pers))) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_ctr_drbg_seed ret(-0x%x)", -ret);
+        return -1;
+    }
+
+    // the test certificate bundled with mbedTLS is good enough for localhost
+    if((ret = mbedtls_x509_crt_parse(&server->srvcert, (const unsigned char *)mbedtls_test_srv_crt,
+                                    mbedtls_test_srv_crt_len)) != 0 ||
+       (ret = mbedtls_pk_parse_key(&server->pkey, (const unsigned char *)mbedtls_test_srv_key,
+                                   mbedtls_test_srv_key_len, NULL, 0)) != 0) {
+        SYS_LOG_ERROR("[BENCH] Loading test certificate failed ret(-0x%x)", -ret);
+        return -1;
+    }
+#if defined(MBEDTLS_ECDSA_C)
+    if((ret = mbedtls_x509_crt_parse(&server->srvcert_ec, (const unsigned char *)mbedtls_test_srv_crt_ec,
+                                    mbedtls_test_srv_crt_ec_len)) != 0 ||
+       (ret = mbedtls_pk_parse_key(&server->pkey_ec, (const unsigned char *)mbedtls_test_srv_key_ec,
+                                   mbedtls_test_srv_key_ec_len, NULL, 0)) != 0) {
+        SYS_LOG_ERROR("[BENCH] Loading EC test certificate failed ret(-0x%x)", -ret);
+        return -1;
+    }
+#endif
+
+    if((ret = mbedtls_ssl_config_defaults(&server->conf, MBEDTLS_SSL_IS_SERVER,
+                                         MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_ssl_config_defaults ret(-0x%x)", -ret);
+        return -1;
+    }
+    mbedtls_ssl_conf_rng(&server->conf, mbedtls_ctr_drbg_random, &server->ctr_drbg);
+    if((ret = mbedtls_ssl_conf_own_cert(&server->conf, &server->srvcert, &server->pkey)) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_ssl_conf_own_cert ret(-0x%x)", -ret);
+        return -1;
+    }
+#if defined(MBEDTLS_ECDSA_C)
+    // mbedTLS picks the certificate matching the negotiated suite
+    if((ret = mbedtls_ssl_conf_own_cert(&server->conf, &server->srvcert_ec, &server->pkey_ec)) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_ssl_conf_own_cert ret(-0x%x)", -ret);
+        return -1;
+    }
+#endif
+
+    // both resumption mechanisms, so clients can be measured with either
+#if defined(MBEDTLS_SSL_CACHE_C)
+    mbedtls_ssl_cache_init(&server->cache);
+    mbedtls_ssl_conf_session_cache(&server->conf, &server->cache,
+                                   mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+#endif
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_ticket_init(&server->ticket);
+    if((ret = mbedtls_ssl_ticket_setup(&server->ticket, mbedtls_ctr_drbg_random, &server->ctr_drbg,
+                                      MBEDTLS_CIPHER_AES_256_GCM, 86400)) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_ssl_ticket_setup ret(-0x%x)", -ret);
+        return -1;
+    }
+    mbedtls_ssl_conf_session_tickets_cb(&server->conf, mbedtls_ssl_ticket_write,
+                                        mbedtls_ssl_ticket_parse, &server->ticket);
+#endif
+
+    return 0;
+}
+
+static void print_usage(const char *program_name)
+{
+    printf("Usage: %s [options]\n", program_name);
+    printf("Options:\n");
+    printf("  -p <port>   Listen port on 127.0.0.1 (default %s)\n", BENCH_SERVER_PORT);
+    printf("  -h          Show this help message\n");
+    printf("\n");
+    printf("Requests:\n");
+    printf("  GET /size/<bytes>   Return <bytes> of generated data, Range requests get a 206\n");
+    printf("Query options, joined with '&':\n");
+    printf("  chunked        Use Transfer-Encoding: chunked\n");
+    printf("  delay=<ms>     Wait before sending the response head\n");
+    printf("  drop=<bytes>   Cut the connection after <bytes> of any longer response body\n");
+    printf("  norange        Ignore Range headers\n");
+    printf("  redirect=<n>   Get to the data through <n> redirects\n");
+    printf("  code=<status>  Status of the redirects (default 302)\n");
+    printf("  via=<host>     Redirect to <host> on the same port instead of a relative path\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static bench_server_t server;
+    mbedtls_net_context listen_fd;
+    const char *port = BENCH_SERVER_PORT;
+    int ret;
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // clients that hang up mid-body must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if(bench_server_setup(&server) != 0)
+        return 1;
+
+    mbedtls_net_init(&listen_fd);
+    if((ret = mbedtls_net_bind(&listen_fd, "127.0.0.1", port, MBEDTLS_NET_PROTO_TCP)) != 0) {
+        SYS_LOG_ERROR("[BENCH] mbedtls_net_bind ret(%d)", ret);
+        return 1;
+    }
+    // mbedtls_net_bind() listens with a backlog of 10, too short for
+    // hundreds of clients connecting at once
+    listen(listen_fd.fd, BENCH_SERVER_BACKLOG);
+    SYS_LOG_INFO("[BENCH] Listening on https://127.0.0.1:%s", port);
+
+    for(;;) {
+        pthread_t thread;
+        bench_conn_t *c = (bench_conn_t *)sys_calloc(1, sizeof(bench_conn_t));
+        if(!c)
+            break;
+        c->server = &server;
+        mbedtls_net_init(&c->client_fd);
+
+        if(mbedtls_net_accept(&listen_fd, &c->client_fd, NULL, 0, NULL) != 0) {
+            sys_free(c);
+            continue;
+        }
+        int nodelay = 1;
+        setsockopt(c->client_fd.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        if(pthread_create(&thread, NULL, bench_conn_thread, c) != 0) {
+            mbedtls_net_free(&c->client_fd);
+            sys_free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    mbedtls_net_free(&listen_fd);
+    return 0;
+}
@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "download_metrics.h"
+
+#define METRICS_PHASES       6
+#define METRICS_MAX_BUCKETS  16
+#define METRICS_MAX_PATH     4096
+
+// Phases in order; each lasts from the end of the previous one that happened
+static const char *const metrics_phase_names[METRICS_PHASES] = {
+    "dns", "connect", "tls", "request", "wait", "transfer"
+};
+
+typedef struct {
+    const char *name;               // Metric name without the download_ prefix
+    const char *help;
+    const double *bounds;           // Upper bounds of the buckets, +Inf is implied
+    int nbounds;
+} metrics_hist_def_t;
+
+typedef struct {
+    uint64_t counts[METRICS_MAX_BUCKETS + 1];   // Per bucket, not cumulative; the last one is +Inf
+    uint64_t count;
+    double sum;
+} metrics_hist_t;
+
+static const double metrics_latency_bounds[] = {
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300
+};
+
+static const double metrics_throughput_bounds[] = {
+    65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824
+};
+
+enum { METRICS_HIST_DURATION, METRICS_HIST_TTFB, METRICS_HIST_HANDSHAKE, METRICS_HIST_THROUGHPUT, METRICS_HISTS };
+
+static const metrics_hist_def_t metrics_hist_defs[METRICS_HISTS] = {
+    { "duration_seconds", "Time of successful downloads from start to end",
+      metrics_latency_bounds, sizeof(metrics_latency_bounds) / sizeof(metrics_latency_bounds[0]) },
+    { "ttfb_seconds", "Time from the start of a download to its response head",
+      metrics_latency_bounds, sizeof(metrics_latency_bounds) / sizeof(metrics_latency_bounds[0]) },
+    { "handshake_seconds", "TLS handshake time of downloads that opened a connection",
+      metrics_latency_bounds, sizeof(metrics_latency_bounds) / sizeof(metrics_latency_bounds[0]) },
+    { "throughput_bytes_per_second", "Average body rate of successful downloads",
+      metrics_throughput_bounds, sizeof(metrics_throughput_bounds) / sizeof(metrics_throughput_bounds[0]) },
+};
+
+// Totals over all downloads of a run
+typedef struct {
+    int succeeded;
+    int failed;
+    int errors[HTTPS_ERROR_OTHER + 1];
+    uint64_t body_bytes;
+    uint64_t wire_bytes_in;
+    uint64_t wire_bytes_out;
+    uint64_t requests;
+    uint64_t retries;
+    uint64_t handshake_retries;
+    uint64_t redirects;
+    uint64_t io_wait_us;
+    uint64_t backoff_us;
+    double phases[METRICS_PHASES];
+    metrics_hist_t hists[METRICS_HISTS];
+} metrics_summary_t;
+
+static void metrics_phases(const https_transfer_stats_t *ts, double seconds[METRICS_PHASES])
+{
+    const uint64_t ends[METRICS_PHASES] = {
+        ts->dns_us, ts->connect_us, ts->handshake_us, ts->request_us, ts->first_byte_us, ts->end_us
+    };
+    uint64_t prev = ts->start_us;
+    int i;
+
+    for(i = 0; i < METRICS_PHASES; i++) {
+        seconds[i] = 0;
+        if(prev && ends[i] >= prev) {
+            seconds[i] = (ends[i] - prev) / 1000000.0;
+            prev = ends[i];
+        }
+    }
+}
+
+static double metrics_seconds(uint64_t from_us, uint64_t to_us)
+{
+    return from_us && to_us >= from_us ? (to_us - from_us) / 1000000.0 : 0;
+}
+
+// A download stopped before the library saw it (bad URL) has no class yet
+static int metrics_error_class(const metrics_download_t *d)
+{
+    if(d->result == 0)
+        return HTTPS_ERROR_NONE;
+    return d->stats.error_class != HTTPS_ERROR_NONE ? d->stats.error_class : HTTPS_ERROR_OTHER;
+}
+
+static void metrics_hist_add(metrics_hist_t *h, const metrics_hist_def_t *def, double value)
+{
+    int i = 0;
+
+    while(i < def->nbounds && value > def->bounds[i])
+        i++;
+    h->counts[i]++;
+    h->count++;
+    h->sum += value;
+}
+
+static void metrics_summarize(const metrics_run_t *run, metrics_summary_t *sum)
+{
+    int i, p;
+
+    memset(sum, 0, sizeof(*sum));
+    for(i = 0; i < run->count; i++) {
+        const metrics_download_t *d = &run->downloads[i];
+        const https_transfer_stats_t *ts = &d->stats;
+        double phases[METRICS_PHASES];
+
+        if(d->result == 0)
+            sum->succeeded++;
+        else
+            sum->failed++;
+        sum->errors[metrics_error_class(d)]++;
+        sum->body_bytes += ts->body_bytes;
+        sum->wire_bytes_in += ts->wire_bytes_in;
+        sum->wire_bytes_out += ts->wire_bytes_out;
+        sum->requests += ts->requests;
+        sum->retries += ts->retries;
+        sum->handshake_retries += ts->handshake_retries;
+        sum->redirects += ts->redirects;
+        sum->io_wait_us += ts->io_wait_us;
+        sum->backoff_us += ts->backoff_us;
+        metrics_phases(ts, phases);
+        for(p = 0; p < METRICS_PHASES; p++)
+            sum->phases[p] += phases[p];
+
+        if(d->result == 0) {
+            metrics_hist_add(&sum->hists[METRICS_HIST_DURATION], &metrics_hist_defs[METRICS_HIST_DURATION],
+                    metrics_seconds(ts->start_us, ts->end_us));
+            if(ts->avg_bytes_per_sec > 0)
+                metrics_hist_add(&sum->hists[METRICS_HIST_THROUGHPUT], &metrics_hist_defs[METRICS_HIST_THROUGHPUT],
+                        ts->avg_bytes_per_sec);
+        }
+        if(ts->first_byte_us)
+            metrics_hist_add(&sum->hists[METRICS_HIST_TTFB], &metrics_hist_defs[METRICS_HIST_TTFB],
+                    metrics_seconds(ts->start_us, ts->first_byte_us));
+        if(ts->handshake_us)
+            metrics_hist_add(&sum->hists[METRICS_HIST_HANDSHAKE], &metrics_hist_defs[METRICS_HIST_HANDSHAKE],
+                    metrics_seconds(ts->connect_us, ts->handshake_us));
+    }
+}
+
+// Open the temporary file that metrics_close() renames to path
+static FILE *metrics_open(const char *path, char *tmp_path, size_t tmp_size)
+{
+    FILE *fp;
+
+    if(strcmp(path, "-") == 0)
+        return stdout;
+    if(snprintf(tmp_path, tmp_size, "%s.tmp", path) >= (int)tmp_size)
+        return NULL;
+    fp = fopen(tmp_path, "w");
+    return fp;
+}
+
+static int metrics_close(FILE *fp, const char *path, const char *tmp_path)
+{
+    int ret = 0;
+
+    if(fp == stdout)
+        return fflush(stdout) == 0 ? 0 : -1;
+    if(ferror(fp))
+        ret = -1;
+    if(fclose(fp) != 0)
+        ret = -1;
+    if(ret == 0 && rename(tmp_path, path) != 0)
+        ret = -1;
+    if(ret != 0)
+        remove(tmp_path);
+    return ret;
+}
+
+static void metrics_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for(; s && *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if(c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static void metrics_json_download(FILE *fp, const metrics_download_t *d)
+{
+    const https_transfer_stats_t *ts = &d->stats;
+    double phases[METRICS_PHASES];
+    int p;
+
+    metrics_phases(ts, phases);
+    fprintf(fp, "    {\"url\": ");
+    metrics_json_string(fp, d->url);
+    fprintf(fp, ", \"path\": ");
+    if(d->path)
+        metrics_json_string(fp, d->path);
+    else
+        fprintf(fp, "null");
+    fprintf(fp, ",\n     \"result\": %d, \"success\": %s, \"error_class\": \"%s\", \"status_code\": %u,\n",
+            d->result, d->result == 0 ? "true" : "false", https_error_class_name(metrics_error_class(d)),
+            ts->status_code);
+    fprintf(fp, "     \"phases_seconds\": {");
+    for(p = 0; p < METRICS_PHASES; p++)
+        fprintf(fp, "%s\"%s\": %.6f", p ? ", " : "", metrics_phase_names[p], phases[p]);
+    fprintf(fp, "},\n");
+    fprintf(fp, "     \"total_seconds\": %.6f, \"ttfb_seconds\": %.6f,\n",
+            metrics_seconds(ts->start_us, ts->end_us), metrics_seconds(ts->start_us, ts->first_byte_us));
+    fprintf(fp, "     \"body_bytes\": %llu, \"wire_bytes_in\": %llu, \"wire_bytes_out\": %llu, \"ssl_reads\": %llu,\n",
+            (unsigned long long)ts->body_bytes, (unsigned long long)ts->wire_bytes_in,
+            (unsigned long long)ts->wire_bytes_out, (unsigned long long)ts->ssl_reads);
+    fprintf(fp, "     \"requests\": %u, \"retries\": %u, \"handshake_retries\": %u,"
+            " \"reused_connection\": %s, \"session_resumed\": %s,\n",
+            ts->requests, ts->retries, ts->handshake_retries,
+            ts->reused_connection ? "true" : "false", ts->session_resumed ? "true" : "false");
+    fprintf(fp, "     \"io_wait_seconds\": %.6f, \"backoff_seconds\": %.6f,\n",
+            ts->io_wait_us / 1000000.0, ts->backoff_us / 1000000.0);
+    fprintf(fp, "     \"redirects\": %u, \"redirect_seconds\": %.6f,\n", ts->redirects, ts->redirect_us / 1000000.0);
+    fprintf(fp, "     \"dns_cached\": %s, \"connect_attempts\": %u, \"remote_addr\": ",
+            ts->dns_cached ? "true" : "false", ts->connect_attempts);
+    metrics_json_string(fp, ts->remote_addr);
+    fprintf(fp, ",\n     \"tls_version\": ");
+    metrics_json_string(fp, ts->tls_version);
+    fprintf(fp, ", \"ciphersuite\": ");
+    metrics_json_string(fp, ts->ciphersuite);
+    fprintf(fp, ",\n     \"avg_bytes_per_second\": %.1f, \"peak_bytes_per_second\": %.1f}",
+            ts->avg_bytes_per_sec, ts->peak_bytes_per_sec);
+}
+
+static void metrics_json_hist(FILE *fp, const metrics_hist_t *h, const metrics_hist_def_t *def)
+{
+    uint64_t cumulative = 0;
+    int i;
+
+    fprintf(fp, "    \"%s\": {\"count\": %llu, \"sum\": %.6f, \"buckets\": [", def->name,
+            (unsigned long long)h->count, h->sum);
+    for(i = 0; i < def->nbounds; i++) {
+        cumulative += h->counts[i];
+        fprintf(fp, "%s{\"le\": %.10g, \"count\": %llu}", i ? ", " : "", def->bounds[i], (unsigned long long)cumulative);
+    }
+    fprintf(fp, ", {\"le\": \"+Inf\", \"count\": %llu}]}", (unsigned long long)h->count);
+}
+
+int metrics_write_json(const metrics_run_t *run, const char *path)
+{
+    char tmp_path[METRICS_MAX_PATH];
+    metrics_summary_t sum;
+    double elapsed = run->elapsed_us / 1000000.0;
+    FILE *fp;
+    int i;
+
+    fp = metrics_open(path, tmp_path, sizeof(tmp_path));
+    if(!fp)
+        return -1;
+    metrics_summarize(run, &sum);
+
+    fprintf(fp, "{\n  \"timestamp\": %lld,\n  \"elapsed_seconds\": %.6f,\n  \"downloads\": [\n",
+            (long long)time(NULL), elapsed);
+    for(i = 0; i < run->count; i++) {
+        metrics_json_download(fp, &run->downloads[i]);
+        fprintf(fp, "%s\n", i + 1 < run->count ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"summary\": {\"downloads\": %d, \"succeeded\": %d, \"failed\": %d, \"body_bytes\": %llu,"
+            " \"bytes_per_second\": %.1f, \"retries\": %llu, \"handshake_retries\": %llu,\n              \"errors\": {",
+            run->count, sum.succeeded, sum.failed, (unsigned long long)sum.body_bytes,
+            elapsed > 0 ? sum.body_bytes / elapsed : 0.0, (unsigned long long)sum.retries,
+            (unsigned long long)sum.handshake_retries);
+    for(i = HTTPS_ERROR_NONE + 1; i <= HTTPS_ERROR_OTHER; i++)
+        fprintf(fp, "%s\"%s\": %d", i > 1 ? ", " : "", https_error_class_name(i), sum.errors[i]);
+    fprintf(fp, "}}");
+
+    if(run->batch) {
+        fprintf(fp, ",\n  \"histograms\": {\n");
+        for(i = 0; i < METRICS_HISTS; i++) {
+            metrics_json_hist(fp, &sum.hists[i], &metrics_hist_defs[i]);
+            fprintf(fp, "%s\n", i + 1 < METRICS_HISTS ? "," : "");
+        }
+        fprintf(fp, "  }");
+    }
+    fprintf(fp, "\n}\n");
+
+    return metrics_close(fp, path, tmp_path);
+}
+
+static void metrics_prom_header(FILE *fp, const char *name, const char *type, const char *help)
+{
+    fprintf(fp, "# HELP download_%s %s\n# TYPE download_%s %s\n", name, help, name, type);
+}
+
+static void metrics_prom_gauge(FILE *fp, const char *name, const char *help, double value)
+{
+    metrics_prom_header(fp, name, "gauge", help);
+    fprintf(fp, "download_%s %.6f\n", name, value);
+}
+
+static void metrics_prom_count(FILE *fp, const char *name, const char *help, uint64_t value)
+{
+    metrics_prom_header(fp, name, "gauge", help);
+    fprintf(fp, "download_%s %llu\n", name, (unsigned long long)value);
+}
+
+static void metrics_prom_hist(FILE *fp, const metrics_hist_t *h, const metrics_hist_def_t *def)
+{
+    uint64_t cumulative = 0;
+    int i;
+
+    metrics_prom_header(fp, def->name, "histogram", def->help);
+    for(i = 0; i < def->nbounds; i++) {
+        cumulative += h->counts[i];
+        fprintf(fp, "download_%s_bucket{le=\"%.10g\"} %llu\n", def->name, def->bounds[i], (unsigned long long)cumulative);
+    }
+    fprintf(fp, "download_%s_bucket{le=\"+Inf\"} %llu\n", def->name, (unsigned long long)h->count);
+    fprintf(fp, "download_%s_sum %.6f\n", def->name, h->sum);
+    fprintf(fp, "download_%s_count %llu\n", def->name, (unsigned long long)h->count);
+}
+
+// Values describe the last run, so they are gauges rather than counters
+int metrics_write_prometheus(const metrics_run_t *run, const char *path)
+{
+    char tmp_path[METRICS_MAX_PATH];
+    metrics_summary_t sum;
+    double elapsed = run->elapsed_us / 1000000.0;
+    FILE *fp;
+    int i;
+
+    fp = metrics_open(path, tmp_path, sizeof(tmp_path));
+    if(!fp)
+        return -1;
+    metrics_summarize(run, &sum);
+
+    metrics_prom_count(fp, "last_run_timestamp_seconds", "Unix time the last run finished", (uint64_t)time(NULL));
+    metrics_prom_gauge(fp, "run_duration_seconds", "Wall time of the last run", elapsed);
+    metrics_prom_header(fp, "files", "gauge", "Downloads of the last run by result");
+    fprintf(fp, "download_files{result=\"success\"} %d\n", sum.succeeded);
+    fprintf(fp, "download_files{result=\"failure\"} %d\n", sum.failed);
+    metrics_prom_header(fp, "errors", "gauge", "Failed downloads of the last run by error class");
+    for(i = HTTPS_ERROR_NONE + 1; i <= HTTPS_ERROR_OTHER; i++)
+        fprintf(fp, "download_errors{class=\"%s\"} %d\n", https_error_class_name(i), sum.errors[i]);
+    metrics_prom_count(fp, "body_bytes", "Response body bytes received in the last run", sum.body_bytes);
+    metrics_prom_header(fp, "wire_bytes", "gauge", "Bytes on the TLS connections in the last run");
+    fprintf(fp, "download_wire_bytes{direction=\"in\"} %llu\n", (unsigned long long)sum.wire_bytes_in);
+    fprintf(fp, "download_wire_bytes{direction=\"out\"} %llu\n", (unsigned long long)sum.wire_bytes_out);
+    metrics_prom_gauge(fp, "run_bytes_per_second", "Body bytes of the last run over its wall time",
+            elapsed > 0 ? sum.body_bytes / elapsed : 0.0);
+    metrics_prom_count(fp, "requests", "HTTP requests sent in the last run", sum.requests);
+    metrics_prom_count(fp, "retries", "Requests repeated in the last run", sum.retries);
+    metrics_prom_count(fp, "handshake_retries", "TLS handshake attempts retried in the last run",
+            sum.handshake_retries);
+    metrics_prom_count(fp, "redirects", "Redirects followed in the last run", sum.redirects);
+    metrics_prom_gauge(fp, "io_wait_seconds", "Time spent waiting for sockets to get ready in the last run",
+            sum.io_wait_us / 1000000.0);
+    metrics_prom_gauge(fp, "backoff_seconds", "Time slept before retries in the last run", sum.backoff_us / 1000000.0);
+    metrics_prom_header(fp, "phase_seconds", "gauge", "Time spent in each phase, summed over the downloads of the last run");
+    for(i = 0; i < METRICS_PHASES; i++)
+        fprintf(fp, "download_phase_seconds{phase=\"%s\"} %.9f\n", metrics_phase_names[i], sum.phases[i]);
+
+    if(run->batch) {
+        for(i = 0; i < METRICS_HISTS; i++)
+            metrics_prom_hist(fp, &sum.hists[i], &metrics_hist_defs[i]);
+    }
+
+    return metrics_close(fp, path, tmp_path);
+}
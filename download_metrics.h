@@ -0,0 +1,53 @@
+#ifndef DOWNLOAD_METRICS_H
+#define DOWNLOAD_METRICS_H
+
+// Machine-readable results of a download_tool run
+//
+// One record per download is turned into a JSON document or a Prometheus
+// textfile-collector file. Both are written to "<path>.tmp" and renamed
+// into place, so a scraper never reads half a file.
+
+#include <stdint.h>
+#include "https_download.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char *url;
+    const char *path;               // Where the file was saved, NULL when it never got that far
+    int result;                     // Return value of the download
+    https_transfer_stats_t stats;
+} metrics_download_t;
+
+typedef struct {
+    const metrics_download_t *downloads;
+    int count;
+    int batch;                      // Came from a list: histograms are added
+    uint64_t elapsed_us;            // Wall time of the whole run
+} metrics_run_t;
+
+/**
+ * Write the run as a JSON document
+ *
+ * @param run The finished downloads
+ * @param path Output file, "-" for standard output
+ * @return 0 on success, -1 if the file could not be written
+ */
+int metrics_write_json(const metrics_run_t *run, const char *path);
+
+/**
+ * Write the run in the Prometheus text exposition format
+ *
+ * @param run The finished downloads
+ * @param path Output file, normally "<collector dir>/download.prom", "-" for standard output
+ * @return 0 on success, -1 if the file could not be written
+ */
+int metrics_write_prometheus(const metrics_run_t *run, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DOWNLOAD_METRICS_H
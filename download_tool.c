@@ -1,239 +1,941 @@
-#define _GNU_SOURCE  // for asprintf
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <libgen.h>
-#include <unistd.h>
-#include "https_download.h"
-#include "system_abstraction.h"
-
-void print_usage(const char* program_name)
-{
-    printf("用法: %s [选项] <下载链接> [保存路径]\n", program_name);
-    printf("\n");
-    printf("参数:\n");
-    printf("  <下载链接>    要下载的 HTTPS URL\n");
-    printf("  [保存路径]    可选，指定保存文件的路径\n");
-    printf("                如果不指定，将使用 URL 中的文件名保存到当前目录\n");
-    printf("\n");
-    printf("选项:\n");
-    printf("  -h, --help    显示此帮助信息\n");
-    printf("  -v, --verbose 显示详细信息\n");
-    printf("  -o <文件>     指定输出文件名\n");
-    printf("\n");
-    printf("示例:\n");
-    printf("  %s https://httpbin.org/json\n", program_name);
-    printf("  %s https://httpbin.org/json ./data.json\n", program_name);
-    printf("  %s -o myfile.json https://httpbin.org/json\n", program_name);
-    printf("  %s -v https://raw.githubusercontent.com/curl/curl/master/README.md\n", program_name);
-}
-
-char* extract_filename_from_url(const char* url)
-{
-    // 查找最后一个 '/' 后的内容作为文件名
-    const char* last_slash = strrchr(url, '/');
-    if (!last_slash) {
-        return strdup("downloaded_file");
-    }
-    
-    const char* filename = last_slash + 1;
-    
-    // 如果文件名为空或只有查询参数，使用默认名称
-    if (!filename[0] || filename[0] == '?') {
-        return strdup("downloaded_file");
-    }
-    
-    // 移除查询参数
-    char* result = strdup(filename);
-    char* query = strchr(result, '?');
-    if (query) {
-        *query = '\0';
-    }
-    
-    // 如果结果为空，使用默认名称
-    if (!result[0]) {
-        free(result);
-        return strdup("downloaded_file");
-    }
-    
-    return result;
-}
-
-int file_exists(const char* filename)
-{
-    return (access(filename, F_OK) == 0);
-}
-
-char* get_unique_filename(const char* original_filename)
-{
-    if (!file_exists(original_filename)) {
-        return strdup(original_filename);
-    }
-    
-    // 文件已存在，生成唯一的文件名
-    char* base_name = strdup(original_filename);
-    char* extension = strrchr(base_name, '.');
-    
-    if (extension) {
-        *extension = '\0';
-        extension++; // 跳过 '.'
-    }
-    
-    for (int i = 1; i < 1000; i++) {
-        char* new_filename = NULL;
-        int ret;
-        if (extension) {
-            ret = asprintf(&new_filename, "%s_%d.%s", base_name, i, extension);
-        } else {
-            ret = asprintf(&new_filename, "%s_%d", base_name, i);
-        }
-        
-        if (ret == -1) {
-            free(base_name);
-            return strdup("downloaded_file_unique");
-        }
-        
-        if (!file_exists(new_filename)) {
-            free(base_name);
-            return new_filename;
-        }
-        
-        free(new_filename);
-    }
-    
-    free(base_name);
-    return strdup("downloaded_file_unique");
-}
-
-long get_file_size(const char* filename)
-{
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) return -1;
-    
-    fseek(fp, 0L, SEEK_END);
-    long size = ftell(fp);
-    fclose(fp);
-    
-    return size;
-}
-
-void format_file_size(long bytes, char* buffer, size_t buffer_size)
-{
-    const char* units[] = {"B", "KB", "MB", "GB"};
-    int unit_index = 0;
-    double size = (double)bytes;
-    
-    while (size >= 1024.0 && unit_index < 3) {
-        size /= 1024.0;
-        unit_index++;
-    }
-    
-    if (unit_index == 0) {
-        snprintf(buffer, buffer_size, "%ld %s", bytes, units[unit_index]);
-    } else {
-        snprintf(buffer, buffer_size, "%.2f %s", size, units[unit_index]);
-    }
-}
-
-int main(int argc, char* argv[])
-{
-    char* url = NULL;
-    char* output_file = NULL;
-    int verbose = 0;
-    int show_help = 0;
-    
-    // 解析命令行参数
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            show_help = 1;
-            break;
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            verbose = 1;
-        } else if (strcmp(argv[i], "-o") == 0) {
-            if (i + 1 < argc) {
-                output_file = argv[++i];
-            } else {
-                fprintf(stderr, "错误: -o 选项需要一个文件名参数\n");
-                return 1;
-            }
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "错误: 未知选项 %s\n", argv[i]);
-            print_usage(argv[0]);
-            return 1;
-        } else if (!url) {
-            url = argv[i];
-        } else if (!output_file) {
-            output_file = argv[i];
-        } else {
-            fprintf(stderr, "错误: 参数过多\n");
-            print_usage(argv[0]);
-            return 1;
-        }
-    }
-    
-    if (show_help) {
-        print_usage(argv[0]);
-        return 0;
-    }
-    
-    if (!url) {
-        fprintf(stderr, "错误: 请提供下载链接\n");
-        print_usage(argv[0]);
-        return 1;
-    }
-    
-    // 检查是否为 HTTPS URL
-    if (strncmp(url, "https://", 8) != 0) {
-        fprintf(stderr, "错误: 只支持 HTTPS 协议的 URL\n");
-        return 1;
-    }
-    
-    // 确定输出文件名
-    char* final_output_file = NULL;
-    if (output_file) {
-        final_output_file = get_unique_filename(output_file);
-    } else {
-        char* extracted_name = extract_filename_from_url(url);
-        final_output_file = get_unique_filename(extracted_name);
-        free(extracted_name);
-    }
-    
-    if (verbose) {
-        printf("下载 URL: %s\n", url);
-        printf("保存到: %s\n", final_output_file);
-        printf("开始下载...\n");
-    } else {
-        printf("正在下载 %s ...\n", url);
-    }
-    
-    // 执行下载
-    int result = https_download(url, final_output_file);
-    
-    if (result == 0) {
-        long file_size = get_file_size(final_output_file);
-        char size_str[64];
-        format_file_size(file_size, size_str, sizeof(size_str));
-        
-        printf("✓ 下载完成!\n");
-        printf("文件保存为: %s\n", final_output_file);
-        printf("文件大小: %s\n", size_str);
-        
-        if (verbose) {
-            printf("下载状态: 成功\n");
-        }
-    } else {
-        fprintf(stderr, "✗ 下载失败 (错误代码: %d)\n", result);
-        fprintf(stderr, "请检查:\n");
-        fprintf(stderr, "  - 网络连接是否正常\n");
-        fprintf(stderr, "  - URL 是否正确\n");
-        fprintf(stderr, "  - 是否有写入文件的权限\n");
-        
-        // 清理可能创建的空文件
-        if (file_exists(final_output_file) && get_file_size(final_output_file) == 0) {
-            unlink(final_output_file);
-        }
-    }
-    
-    free(final_output_file);
-    return result;
-}
+#define _GNU_SOURCE  // for asprintf
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include "https_download.h"
+#include "system_abstraction.h"
+#include "download_metrics.h"
+
+#define BATCH_MAX_WORKERS 64
+
+void print_usage(const char* program_name)
+{
+    printf("用法: %s [选项] <下载链接> [保存路径]\n", program_name);
+    printf("      %s [选项] -i <链接列表文件>\n", program_name);
+    printf("\n");
+    printf("参数:\n");
+    printf("  <下载链接>    要下载的 HTTPS URL\n");
+    printf("  [保存路径]    可选，指定保存文件的路径\n");
+    printf("                如果不指定，将使用 URL 中的文件名保存到当前目录\n");
+    printf("\n");
+    printf("选项:\n");
+    printf("  -h, --help    显示此帮助信息\n");
+    printf("  -v, --verbose 显示详细信息\n");
+    printf("  -o <文件>     指定输出文件名\n");
+    printf("  -j <连接数>   使用多个连接分段并行下载 (1-16，默认 1)\n");
+    printf("                批量模式下为同时下载的文件数 (1-%d，默认 4)\n", BATCH_MAX_WORKERS);
+    printf("  -c, --continue 断点续传：继续未完成的下载，进度记录在 <文件>.resume 中\n");
+    printf("  -w, --write-behind 由单独的写线程写文件，磁盘慢时不阻塞网络接收\n");
+    printf("  --io <方式>   写文件的方式: stdio (默认)、write、direct (O_DIRECT，不占用页缓存)、\n");
+    printf("                uring (io_uring) 或 mmap (写入文件映射)；不支持时退回 write\n");
+    printf("  --sha256 <值> 下载时同步计算 SHA-256 并与给定的 64 位十六进制值比较，\n");
+    printf("                不一致时删除文件并返回失败\n");
+    printf("  --tls <配置>  TLS 加密套件配置: compat (默认，RSA 密钥交换，兼容老服务器) 或\n");
+    printf("                fast (ECDHE + AES-GCM/ChaCha20，握手前向安全，大文件吞吐更高)\n");
+    printf("  --log <级别>  库日志的级别: error、info (默认) 或 debug\n");
+    printf("  -i <文件>     批量模式：从文件读取链接列表，\"-\" 表示从标准输入读取\n");
+    printf("                每行一个链接，后面可以跟保存路径；空行和 # 开头的行会被忽略\n");
+    printf("  --metrics-json <文件> 结束后把每个下载的分阶段耗时、字节数、速度、重试次数和错误类型\n");
+    printf("                写成 JSON，批量模式下附带耗时和速度的直方图；\"-\" 表示标准输出\n");
+    printf("  --metrics-prom <文件> 同样的指标写成 Prometheus 文本格式，\n");
+    printf("                供 node_exporter 的 textfile collector 采集 (文件名以 .prom 结尾)\n");
+    printf("\n");
+    printf("示例:\n");
+    printf("  %s https://httpbin.org/json\n", program_name);
+    printf("  %s https://httpbin.org/json ./data.json\n", program_name);
+    printf("  %s -o myfile.json https://httpbin.org/json\n", program_name);
+    printf("  %s -j 4 https://example.com/large.iso\n", program_name);
+    printf("  %s -c -o large.iso https://example.com/large.iso\n", program_name);
+    printf("  %s --sha256 <64 位十六进制值> https://example.com/large.iso\n", program_name);
+    printf("  %s -i urls.txt -j 8\n", program_name);
+    printf("  %s -i urls.txt --metrics-prom /var/lib/node_exporter/download.prom\n", program_name);
+    printf("  cat urls.txt | %s -i -\n", program_name);
+    printf("  %s -v https://raw.githubusercontent.com/curl/curl/master/README.md\n", program_name);
+}
+
+char* extract_filename_from_url(const char* url)
+{
+    // 查找最后一个 '/' 后的内容作为文件名
+    const char* last_slash = strrchr(url, '/');
+    if (!last_slash) {
+        return strdup("downloaded_file");
+    }
+    
+    const char* filename = last_slash + 1;
+    
+    // 如果文件名为空或只有查询参数，使用默认名称
+    if (!filename[0] || filename[0] == '?') {
+        return strdup("downloaded_file");
+    }
+    
+    // 移除查询参数
+    char* result = strdup(filename);
+    char* query = strchr(result, '?');
+    if (query) {
+        *query = '\0';
+    }
+    
+    // 如果结果为空，使用默认名称
+    if (!result[0]) {
+        free(result);
+        return strdup("downloaded_file");
+    }
+    
+    return result;
+}
+
+int file_exists(const char* filename)
+{
+    return (access(filename, F_OK) == 0);
+}
+
+// 以 O_EXCL 创建空文件来占用文件名，检查和创建是一个原子操作，
+// 多个线程或进程同时选名字时不会选到同一个文件
+static int reserve_filename(const char* filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        return errno == EEXIST ? 0 : -1;
+    }
+    close(fd);
+    return 1;
+}
+
+char* get_unique_filename(const char* original_filename)
+{
+    int ret = reserve_filename(original_filename);
+    if (ret != 0) {
+        // 占用成功；无法创建时交给下载过程报告错误
+        return strdup(original_filename);
+    }
+    
+    // 文件已存在，生成唯一的文件名
+    char* base_name = strdup(original_filename);
+    char* extension = strrchr(base_name, '.');
+    
+    // 目录名中的 '.' 不是扩展名
+    if (extension && strchr(extension, '/')) {
+        extension = NULL;
+    }
+    if (extension) {
+        *extension = '\0';
+        extension++; // 跳过 '.'
+    }
+    
+    for (int i = 1; i < 1000; i++) {
+        char* new_filename = NULL;
+        if (extension) {
+            ret = asprintf(&new_filename, "%s_%d.%s", base_name, i, extension);
+        } else {
+            ret = asprintf(&new_filename, "%s_%d", base_name, i);
+        }
+        
+        if (ret == -1) {
+            free(base_name);
+            return strdup("downloaded_file_unique");
+        }
+        
+        if (reserve_filename(new_filename) != 0) {
+            free(base_name);
+            return new_filename;
+        }
+        
+        free(new_filename);
+    }
+    
+    free(base_name);
+    return strdup("downloaded_file_unique");
+}
+
+long get_file_size(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return -1;
+    
+    fseek(fp, 0L, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    
+    return size;
+}
+
+void format_file_size(long bytes, char* buffer, size_t buffer_size)
+{
+    const char* units[] = {"B", "KB", "MB", "GB"};
+    int unit_index = 0;
+    double size = (double)bytes;
+    
+    while (size >= 1024.0 && unit_index < 3) {
+        size /= 1024.0;
+        unit_index++;
+    }
+    
+    if (unit_index == 0) {
+        snprintf(buffer, buffer_size, "%ld %s", bytes, units[unit_index]);
+    } else {
+        snprintf(buffer, buffer_size, "%.2f %s", size, units[unit_index]);
+    }
+}
+
+// 确定输出文件名；续传时必须写回同一个文件，不能另起新名字
+char* choose_output_file(const char* url, const char* output_file, int resume)
+{
+    if (output_file) {
+        return resume ? strdup(output_file) : get_unique_filename(output_file);
+    }
+    
+    char* extracted_name = extract_filename_from_url(url);
+    char* result = resume ? strdup(extracted_name) : get_unique_filename(extracted_name);
+    free(extracted_name);
+    return result;
+}
+
+// 批量模式中的一个下载任务
+typedef struct {
+    char* url;
+    char* output_file;          // 列表中指定的保存路径，NULL 表示从 URL 中取文件名
+    char* saved_as;             // 实际保存的路径
+    int line;                   // 在列表中的行号
+    int result;
+    long size;
+    uint64_t elapsed_ms;
+    https_transfer_stats_t stats;
+} batch_job_t;
+
+typedef struct {
+    batch_job_t* jobs;
+    int count;
+    int next;                   // 下一个待领取的任务
+    int done;
+    https_client_t* client;     // 所有任务共用的客户端
+    https_download_opts_t opts; // 每个任务的下载选项
+    int verbose;
+    pthread_mutex_t lock;
+} batch_t;
+
+// 读取链接列表：每行 "<链接> [保存路径]"，保存路径可以包含空格
+static int batch_load(batch_t* batch, FILE* fp)
+{
+    char* line = NULL;
+    size_t line_cap = 0;
+    int capacity = 0, line_no = 0;
+    
+    while (getline(&line, &line_cap, fp) != -1) {
+        char* p = line;
+        char* end;
+        
+        line_no++;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        end = p + strlen(p);
+        while (end > p && isspace((unsigned char)end[-1])) {
+            *--end = '\0';
+        }
+        if (!*p || *p == '#') {
+            continue;
+        }
+        
+        if (batch->count == capacity) {
+            int new_capacity = capacity ? capacity * 2 : 64;
+            batch_job_t* jobs = (batch_job_t*)realloc(batch->jobs, new_capacity * sizeof(batch_job_t));
+            if (!jobs) {
+                free(line);
+                return -1;
+            }
+            batch->jobs = jobs;
+            capacity = new_capacity;
+        }
+        
+        batch_job_t* job = &batch->jobs[batch->count++];
+        memset(job, 0, sizeof(*job));
+        job->line = line_no;
+        
+        char* path = p;
+        while (*path && !isspace((unsigned char)*path)) {
+            path++;
+        }
+        if (*path) {
+            *path++ = '\0';
+            while (isspace((unsigned char)*path)) {
+                path++;
+            }
+            job->output_file = strdup(path);
+        }
+        job->url = strdup(p);
+    }
+    
+    free(line);
+    return 0;
+}
+
+static void batch_run_job(batch_t* batch, batch_job_t* job)
+{
+    uint64_t start = sys_get_time_ms();
+    https_download_opts_t opts = batch->opts;
+    
+    opts.stats = &job->stats;
+    job->result = -1;
+    if (strncmp(job->url, "https://", 8) != 0) {
+        fprintf(stderr, "错误: 第 %d 行不是 HTTPS 链接: %s\n", job->line, job->url);
+        return;
+    }
+    
+    job->saved_as = choose_output_file(job->url, job->output_file, batch->opts.resume);
+    if (batch->verbose) {
+        printf("开始下载 %s -> %s\n", job->url, job->saved_as);
+    }
+    
+    job->result = https_client_download_ex(batch->client, job->url, job->saved_as, &opts);
+    job->elapsed_ms = sys_get_time_ms() - start;
+    
+    if (job->result == 0) {
+        job->size = get_file_size(job->saved_as);
+    } else if (!batch->opts.resume && file_exists(job->saved_as) && get_file_size(job->saved_as) == 0) {
+        // 清理可能创建的空文件
+        unlink(job->saved_as);
+    }
+}
+
+static void* batch_worker(void* arg)
+{
+    batch_t* batch = (batch_t*)arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int index = batch->next < batch->count ? batch->next++ : -1;
+        pthread_mutex_unlock(&batch->lock);
+        if (index < 0) {
+            break;
+        }
+        
+        batch_job_t* job = &batch->jobs[index];
+        batch_run_job(batch, job);
+        
+        pthread_mutex_lock(&batch->lock);
+        int done = ++batch->done;
+        pthread_mutex_unlock(&batch->lock);
+        sys_log_flush();
+        printf("[%d/%d] %s %s\n", done, batch->count, job->result == 0 ? "✓" : "✗", job->url);
+    }
+    return NULL;
+}
+
+static void batch_print_report(const batch_t* batch, uint64_t elapsed_ms)
+{
+    long long total_bytes = 0;
+    int failures = 0;
+    char size_str[64];
+    
+    printf("\n下载结果:\n");
+    for (int i = 0; i < batch->count; i++) {
+        const batch_job_t* job = &batch->jobs[i];
+        if (job->result == 0) {
+            double seconds = job->elapsed_ms / 1000.0;
+            format_file_size(job->size, size_str, sizeof(size_str));
+            printf("  ✓ %-12s %7.2fs %8.2f MB/s  %s <- %s\n", size_str, seconds,
+                   seconds > 0 ? job->size / seconds / (1024.0 * 1024.0) : 0.0, job->saved_as, job->url);
+            total_bytes += job->size;
+        } else {
+            printf("  ✗ 失败 (错误代码: %d)  %s <- %s\n", job->result,
+                   job->saved_as ? job->saved_as : "-", job->url);
+            failures++;
+        }
+    }
+    
+    double seconds = elapsed_ms / 1000.0;
+    format_file_size((long)total_bytes, size_str, sizeof(size_str));
+    printf("\n汇总: %d 个文件，成功 %d，失败 %d，共 %s，用时 %.2fs，总速度 %.2f MB/s\n",
+           batch->count, batch->count - failures, failures, size_str, seconds,
+           seconds > 0 ? total_bytes / seconds / (1024.0 * 1024.0) : 0.0);
+}
+
+// 打印一个阶段的耗时：从上一个发生过的阶段结束到本阶段结束
+static void print_phase(const char* name, uint64_t end_us, uint64_t* prev_us)
+{
+    if (end_us == 0) {
+        printf("  %8s    %s\n", "-", name);
+        return;
+    }
+    printf("  %8.2f ms %s\n", (end_us - *prev_us) / 1000.0, name);
+    *prev_us = end_us;
+}
+
+// -v 时显示的分阶段耗时和传输统计
+static void print_transfer_stats(const https_transfer_stats_t* ts)
+{
+    uint64_t prev = ts->start_us;
+    char body[64], wire_in[64], wire_out[64];
+    
+    printf("分阶段耗时:\n");
+    print_phase("DNS 解析", ts->dns_us, &prev);
+    print_phase("TCP 连接", ts->connect_us, &prev);
+    print_phase("TLS 握手", ts->handshake_us, &prev);
+    print_phase("发送请求", ts->request_us, &prev);
+    print_phase("等待首字节", ts->first_byte_us, &prev);
+    print_phase("接收数据", ts->end_us, &prev);
+    printf("  %8.2f ms %s\n", (ts->end_us - ts->start_us) / 1000.0, "总计");
+    
+    format_file_size((long)ts->body_bytes, body, sizeof(body));
+    format_file_size((long)ts->wire_bytes_in, wire_in, sizeof(wire_in));
+    format_file_size((long)ts->wire_bytes_out, wire_out, sizeof(wire_out));
+    printf("传输: 响应体 %s，网络接收 %s / 发送 %s，mbedtls_ssl_read 调用 %llu 次\n",
+           body, wire_in, wire_out, (unsigned long long)ts->ssl_reads);
+    printf("请求: %u 次，重试 %u 次，握手重试 %u 次%s\n", ts->requests, ts->retries, ts->handshake_retries,
+           ts->reused_connection ? "，复用了已有连接" : "");
+    if (ts->redirects) {
+        printf("重定向: %u 次，用时 %.2f ms\n", ts->redirects, ts->redirect_us / 1000.0);
+    }
+    if (ts->remote_addr[0]) {
+        printf("连接: %s，尝试 %u 个地址\n", ts->remote_addr, ts->connect_attempts);
+    }
+    printf("等待: 套接字就绪 %.2f ms，重试退避 %.2f ms\n", ts->io_wait_us / 1000.0, ts->backoff_us / 1000.0);
+    if (ts->ciphersuite[0]) {
+        printf("TLS: %s %s%s\n", ts->tls_version, ts->ciphersuite, ts->session_resumed ? " (会话恢复)" : "");
+    }
+    printf("速度: 平均 %.2f MB/s，峰值 %.2f MB/s\n", ts->avg_bytes_per_sec / (1024.0 * 1024.0),
+           ts->peak_bytes_per_sec / (1024.0 * 1024.0));
+}
+
+// -v 时显示的内存分配次数，整个进程的累计值
+static void print_memory_stats(void)
+{
+    sys_mem_stats_t ms;
+    
+    sys_mem_get_stats(&ms);
+    printf("内存: 分配 %llu 次，其中 %llu 次复用缓存块，%llu 次来自系统堆\n", (unsigned long long)ms.allocs,
+           (unsigned long long)ms.pool_hits, (unsigned long long)ms.heap_allocs);
+}
+
+// 指标输出的目标文件，NULL 表示不输出
+typedef struct {
+    const char* json_path;
+    const char* prom_path;
+} tool_metrics_t;
+
+// 按 --metrics-json / --metrics-prom 写出指标，失败返回 -1
+static int write_metrics(const tool_metrics_t* metrics, const metrics_run_t* run)
+{
+    int ret = 0;
+    
+    if (metrics->json_path && metrics_write_json(run, metrics->json_path) != 0) {
+        fprintf(stderr, "错误: 无法写入指标文件 %s\n", metrics->json_path);
+        ret = -1;
+    }
+    if (metrics->prom_path && metrics_write_prometheus(run, metrics->prom_path) != 0) {
+        fprintf(stderr, "错误: 无法写入指标文件 %s\n", metrics->prom_path);
+        ret = -1;
+    }
+    return ret;
+}
+
+// 单个下载时由 Ctrl-C 置位，进度回调据此取消下载
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    interrupted = 1;
+}
+
+// 进度回调的状态；draw 为 0 时只负责响应 Ctrl-C
+typedef struct {
+    int draw;
+    int drawn;      // 当前行上有一条进度
+} tool_progress_t;
+
+static void format_eta(double seconds, char* buffer, size_t buffer_size)
+{
+    long s = (long)(seconds + 0.5);
+    
+    if (seconds < 0) {
+        snprintf(buffer, buffer_size, "--:--");
+    } else if (s >= 3600) {
+        snprintf(buffer, buffer_size, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+    } else {
+        snprintf(buffer, buffer_size, "%02ld:%02ld", s / 60, s % 60);
+    }
+}
+
+// 在同一行上刷新进度，结束时换行
+static int on_progress(void* ctx, const https_progress_t* p)
+{
+    tool_progress_t* tp = (tool_progress_t*)ctx;
+    char done_str[32], total_str[32], eta_str[32];
+    
+    if (tp->draw && (p->bytes > 0 || tp->drawn)) {
+        // 先让排队的日志输出，免得和进度挤在一行
+        sys_log_flush();
+        format_file_size((long)p->bytes, done_str, sizeof(done_str));
+        if (p->total > 0) {
+            format_file_size((long)p->total, total_str, sizeof(total_str));
+            format_eta(p->eta_seconds, eta_str, sizeof(eta_str));
+            printf("\r\033[K%5.1f%%  %s / %s  %.2f MB/s  剩余 %s", p->bytes * 100.0 / (double)p->total,
+                   done_str, total_str, p->smoothed_rate / (1024.0 * 1024.0), eta_str);
+        } else {
+            printf("\r\033[K%s  %.2f MB/s", done_str, p->smoothed_rate / (1024.0 * 1024.0));
+        }
+        tp->drawn = 1;
+        if (p->done) {
+            printf("\n");
+            tp->drawn = 0;
+        }
+        fflush(stdout);
+    }
+    return interrupted ? 1 : 0;
+}
+
+// -v 时逐跳显示重定向链
+static int on_redirect(void* ctx, const https_redirect_t* r)
+{
+    (void)ctx;
+    sys_log_flush();
+    printf("重定向 #%u: %u %s -> %s (%.2f ms%s)\n", r->hop, r->status_code, r->from, r->to,
+           r->elapsed_us / 1000.0, r->same_connection ? "，复用连接" : "");
+    return 0;
+}
+
+// 创建按 --tls 配置的客户端
+static https_client_t* tool_client_create(int tls_profile)
+{
+    https_client_config_t config;
+    
+    https_client_config_init(&config);
+    config.tls_profile = tls_profile;
+    https_client_t* client = https_client_create(&config);
+    if (!client) {
+        fprintf(stderr, "错误: 初始化 TLS 客户端失败\n");
+    }
+    return client;
+}
+
+// 取出 URL 中的主机名，失败时返回 0
+static int url_host(const char* url, char* host, size_t host_size)
+{
+    size_t len;
+    
+    if (strncmp(url, "https://", 8) != 0) {
+        return 0;
+    }
+    url += 8;
+    len = strcspn(url, ":/?#");
+    if (len == 0 || len >= host_size) {
+        return 0;
+    }
+    memcpy(host, url, len);
+    host[len] = '\0';
+    return 1;
+}
+
+// 工作线程开始前把列表中每个主机解析一次放进客户端的 DNS 缓存，
+// 免得开头的几个任务同时去查同一个主机
+static void batch_prewarm_dns(const batch_t* batch)
+{
+    char host[256], prev[256];
+    
+    for (int i = 0; i < batch->count; i++) {
+        if (!url_host(batch->jobs[i].url, host, sizeof(host))) {
+            continue;
+        }
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = url_host(batch->jobs[j].url, prev, sizeof(prev)) && strcmp(prev, host) == 0;
+        }
+        if (!seen) {
+            https_client_resolve(batch->client, host);
+        }
+    }
+}
+
+// -v 时显示的 DNS 缓存命中情况
+static void print_dns_stats(https_client_t* client)
+{
+    https_client_stats_t cs;
+    
+    https_client_get_stats(client, &cs);
+    printf("DNS: 缓存命中 %llu 次，未命中 %llu 次，解析 %llu 次共 %.2f ms\n",
+           (unsigned long long)(cs.dns_cache_hits + cs.dns_negative_hits), (unsigned long long)cs.dns_cache_misses,
+           (unsigned long long)cs.dns_resolves, cs.dns_resolve_us / 1000.0);
+}
+
+// 批量模式：-j 个工作线程从列表中领取任务。所有线程共用同一个客户端，
+// TLS 初始化只做一次，同一服务器的连接和会话在任务之间复用
+int run_batch(const char* list_path, int workers, https_client_t* client, const https_download_opts_t* opts,
+              int verbose, const tool_metrics_t* metrics)
+{
+    batch_t batch;
+    FILE* fp = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    pthread_t threads[BATCH_MAX_WORKERS];
+    int started = 0;
+    
+    if (!fp) {
+        fprintf(stderr, "错误: 无法打开链接列表 %s\n", list_path);
+        return 1;
+    }
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.client = client;
+    batch.opts = *opts;
+    batch.verbose = verbose;
+    int ret = batch_load(&batch, fp);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "错误: 读取链接列表失败\n");
+        return 1;
+    }
+    if (batch.count == 0) {
+        fprintf(stderr, "错误: 链接列表为空\n");
+        free(batch.jobs);
+        return 1;
+    }
+    
+    if (workers > batch.count) {
+        workers = batch.count;
+    }
+    printf("正在下载 %d 个文件 (%d 个并发)...\n", batch.count, workers);
+    
+    pthread_mutex_init(&batch.lock, NULL);
+    uint64_t start = sys_get_time_ms();
+    uint64_t start_us = sys_get_time_us();
+    batch_prewarm_dns(&batch);
+    for (int i = 0; i < workers - 1; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+            break;
+        }
+        started++;
+    }
+    // 当前线程也是一个工作线程
+    batch_worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed_ms = sys_get_time_ms() - start;
+    pthread_mutex_destroy(&batch.lock);
+    
+    batch_print_report(&batch, elapsed_ms);
+    if (verbose) {
+        print_dns_stats(client);
+        print_memory_stats();
+    }
+    
+    int failures = 0;
+    if (metrics->json_path || metrics->prom_path) {
+        metrics_download_t* downloads = (metrics_download_t*)calloc(batch.count, sizeof(metrics_download_t));
+        if (downloads) {
+            for (int i = 0; i < batch.count; i++) {
+                downloads[i].url = batch.jobs[i].url;
+                downloads[i].path = batch.jobs[i].saved_as;
+                downloads[i].result = batch.jobs[i].result;
+                downloads[i].stats = batch.jobs[i].stats;
+            }
+            metrics_run_t run = { downloads, batch.count, 1, sys_get_time_us() - start_us };
+            failures += write_metrics(metrics, &run) != 0;
+            free(downloads);
+        } else {
+            fprintf(stderr, "错误: 内存不足，无法输出指标\n");
+            failures++;
+        }
+    }
+    for (int i = 0; i < batch.count; i++) {
+        failures += batch.jobs[i].result != 0;
+        free(batch.jobs[i].url);
+        free(batch.jobs[i].output_file);
+        free(batch.jobs[i].saved_as);
+    }
+    free(batch.jobs);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    char* url = NULL;
+    char* output_file = NULL;
+    int verbose = 0;
+    int show_help = 0;
+    int connections = -1;  // 未指定
+    int resume = 0;
+    int write_buffers = 0;
+    int file_backend = SYS_FILE_BACKEND_STDIO;
+    const char* sha256 = NULL;
+    const char* list_path = NULL;
+    int tls_profile = HTTPS_TLS_PROFILE_COMPAT;
+    tool_metrics_t metrics = { NULL, NULL };
+    log_level_t log_level = LOG_LEVEL_INFO;
+    
+    // 解析命令行参数
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            show_help = 1;
+            break;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            if (i + 1 < argc) {
+                output_file = argv[++i];
+            } else {
+                fprintf(stderr, "错误: -o 选项需要一个文件名参数\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--continue") == 0) {
+            resume = 1;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc) {
+                connections = atoi(argv[++i]);
+            } else {
+                fprintf(stderr, "错误: -j 选项需要一个连接数参数\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--write-behind") == 0) {
+            write_buffers = 4;
+        } else if (strcmp(argv[i], "--sha256") == 0) {
+            if (i + 1 < argc) {
+                sha256 = argv[++i];
+            } else {
+                fprintf(stderr, "错误: --sha256 选项需要一个校验值参数\n");
+                return 1;
+            }
+            if (strlen(sha256) != 64 || strspn(sha256, "0123456789abcdefABCDEF") != 64) {
+                fprintf(stderr, "错误: SHA-256 校验值必须是 64 位十六进制数\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--io") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(name, "stdio") == 0) {
+                file_backend = SYS_FILE_BACKEND_STDIO;
+            } else if (strcmp(name, "write") == 0) {
+                file_backend = SYS_FILE_BACKEND_WRITE;
+            } else if (strcmp(name, "direct") == 0) {
+                file_backend = SYS_FILE_BACKEND_DIRECT;
+            } else if (strcmp(name, "uring") == 0) {
+                file_backend = SYS_FILE_BACKEND_URING;
+            } else if (strcmp(name, "mmap") == 0) {
+                file_backend = SYS_FILE_BACKEND_MMAP;
+            } else {
+                fprintf(stderr, "错误: --io 需要 stdio、write、direct、uring 或 mmap\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--tls") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(name, "compat") == 0) {
+                tls_profile = HTTPS_TLS_PROFILE_COMPAT;
+            } else if (strcmp(name, "fast") == 0) {
+                tls_profile = HTTPS_TLS_PROFILE_FAST;
+            } else {
+                fprintf(stderr, "错误: --tls 需要 compat 或 fast\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(name, "error") == 0) {
+                log_level = LOG_LEVEL_ERROR;
+            } else if (strcmp(name, "info") == 0) {
+                log_level = LOG_LEVEL_INFO;
+            } else if (strcmp(name, "debug") == 0) {
+                log_level = LOG_LEVEL_DEBUG;
+            } else {
+                fprintf(stderr, "错误: --log 需要 error、info 或 debug\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics-json") == 0 || strcmp(argv[i], "--metrics-prom") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "错误: %s 选项需要一个文件名参数\n", argv[i]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--metrics-json") == 0) {
+                metrics.json_path = argv[++i];
+            } else {
+                metrics.prom_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-i") == 0) {
+            if (i + 1 < argc) {
+                list_path = argv[++i];
+            } else {
+                fprintf(stderr, "错误: -i 选项需要一个文件名参数\n");
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "错误: 未知选项 %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else if (!url) {
+            url = argv[i];
+        } else if (!output_file) {
+            output_file = argv[i];
+        } else {
+            fprintf(stderr, "错误: 参数过多\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (show_help) {
+        print_usage(argv[0]);
+        return 0;
+    }
+    sys_log_set_level(log_level);
+    
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.resume = resume;
+    opts.write_buffers = write_buffers;
+    opts.file_backend = file_backend;
+    
+    if (list_path) {
+        if (url || output_file) {
+            fprintf(stderr, "错误: 批量模式 (-i) 下保存路径写在链接列表中，不能再指定链接或 -o\n");
+            return 1;
+        }
+        if (sha256) {
+            fprintf(stderr, "错误: --sha256 只能用于单个文件的下载\n");
+            return 1;
+        }
+        if (connections == -1) {
+            connections = 4;
+        }
+        if (connections < 1 || connections > BATCH_MAX_WORKERS) {
+            fprintf(stderr, "错误: 批量模式下 -j 必须在 1 到 %d 之间\n", BATCH_MAX_WORKERS);
+            return 1;
+        }
+        https_client_t* client = tool_client_create(tls_profile);
+        if (!client) {
+            return 1;
+        }
+        int ret = run_batch(list_path, connections, client, &opts, verbose, &metrics);
+        https_client_destroy(client);
+        return ret;
+    }
+    
+    if (connections == -1) {
+        connections = 1;
+    }
+    if (connections < 1 || connections > 16) {
+        fprintf(stderr, "错误: -j 连接数必须在 1 到 16 之间\n");
+        return 1;
+    }
+    
+    if (!url) {
+        fprintf(stderr, "错误: 请提供下载链接\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    // 检查是否为 HTTPS URL
+    if (strncmp(url, "https://", 8) != 0) {
+        fprintf(stderr, "错误: 只支持 HTTPS 协议的 URL\n");
+        return 1;
+    }
+    
+    // 确定输出文件名
+    char* final_output_file = choose_output_file(url, output_file, resume);
+    
+    if (verbose) {
+        printf("下载 URL: %s\n", url);
+        printf("保存到: %s\n", final_output_file);
+        if (connections > 1) {
+            printf("并行连接数: %d\n", connections);
+        }
+        if (resume) {
+            printf("断点续传: 开启\n");
+        }
+        if (sha256) {
+            printf("SHA-256 校验: %s\n", sha256);
+        }
+        printf("TLS 配置: %s\n", tls_profile == HTTPS_TLS_PROFILE_FAST ? "fast" : "compat");
+        printf("开始下载...\n");
+    } else {
+        printf("正在下载 %s ...\n", url);
+    }
+    
+    // 执行下载
+    opts.connections = connections;
+    opts.sha256 = sha256;
+    metrics_download_t download = { url, final_output_file, -1, { 0 } };
+    opts.stats = &download.stats;
+    // 终端上显示一行进度；Ctrl-C 取消下载，再按一次直接退出
+    tool_progress_t progress = { isatty(STDOUT_FILENO), 0 };
+    opts.progress = on_progress;
+    opts.progress_ctx = &progress;
+    if (verbose) {
+        opts.redirect = on_redirect;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_interrupt;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    https_client_t* client = tool_client_create(tls_profile);
+    if (!client) {
+        free(final_output_file);
+        return 1;
+    }
+    int result = https_client_download_ex(client, url, final_output_file, &opts);
+    https_client_destroy(client);
+    signal(SIGINT, SIG_DFL);
+    download.result = result;
+    // 库的日志由后台线程输出，先写完再打印结果
+    sys_log_flush();
+    
+    if (verbose) {
+        print_transfer_stats(&download.stats);
+        print_memory_stats();
+    }
+    
+    if (result == 0) {
+        long file_size = get_file_size(final_output_file);
+        char size_str[64];
+        format_file_size(file_size, size_str, sizeof(size_str));
+        
+        printf("✓ 下载完成!\n");
+        printf("文件保存为: %s\n", final_output_file);
+        printf("文件大小: %s\n", size_str);
+        if (sha256) {
+            printf("✓ SHA-256 校验通过\n");
+        }
+        
+        if (verbose) {
+            printf("下载状态: 成功\n");
+        }
+    } else if (result == HTTPS_ERR_CHECKSUM) {
+        fprintf(stderr, "✗ SHA-256 校验失败，文件内容与给定的校验值不一致，已删除 %s\n", final_output_file);
+    } else if (result == HTTPS_ERR_CANCELLED) {
+        fprintf(stderr, "✗ 下载已取消\n");
+        if (resume) {
+            fprintf(stderr, "已下载的部分已保留，使用相同参数加 -c 重新运行即可继续\n");
+        }
+    } else {
+        fprintf(stderr, "✗ 下载失败 (错误代码: %d)\n", result);
+        fprintf(stderr, "请检查:\n");
+        fprintf(stderr, "  - 网络连接是否正常\n");
+        fprintf(stderr, "  - URL 是否正确\n");
+        fprintf(stderr, "  - 是否有写入文件的权限\n");
+        
+        if (resume) {
+            fprintf(stderr, "已下载的部分已保留，使用相同参数加 -c 重新运行即可继续\n");
+        }
+        
+        // 清理可能创建的空文件
+        if (!resume && file_exists(final_output_file) && get_file_size(final_output_file) == 0) {
+            unlink(final_output_file);
+        }
+    }
+    
+    if (metrics.json_path || metrics.prom_path) {
+        metrics_run_t run = { &download, 1, 0, download.stats.end_us - download.stats.start_us };
+        if (write_metrics(&metrics, &run) != 0 && result == 0) {
+            result = 1;
+        }
+    }
+    
+    free(final_output_file);
+    return result;
+}
@@ -1,61 +1,255 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "mbedtls/net_sockets.h"
 #include "mbedtls/ssl.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
 #include "mbedtls/platform.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ssl_ciphersuites.h"
+#include "mbedtls/version.h"
+#if defined(MBEDTLS_AESNI_C)
+#include "mbedtls/aesni.h"
+#endif
+// Written against the mbedTLS 2.28 API: 3.x renamed the SHA-256 calls, made
+// the session master secret private and has its own version setters
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#error "mbedTLS 3.x is not supported, build against mbedTLS 2.28"
+#endif
 #include "system_abstraction.h"
+#include "https_download.h"
+#include "https_parser.h"
+#include "https_writer.h"
 
-#define HTTPS_DOWNLOAD_BUF_SIZE    512
-#define HTTPS_HEADER_BAK_LEN       32
+#define HTTPS_DOWNLOAD_BUF_SIZE    (16 * 1024)    // One full TLS record
+#define HTTPS_DOWNLOAD_BUF_MAX     (64 * 1024)
+#define HTTPS_DOWNLOAD_BUF_MIN     256
+#define HTTPS_BUF_GROW_AFTER       4              // Full reads in a row before growing
+#define HTTPS_PROGRESS_INTERVAL_MS 250            // Default of https_download_opts_t.progress_interval_ms
+#define HTTPS_PROGRESS_SMOOTHING_S 3.0            // Time constant of https_progress_t.smoothed_rate
+#define HTTPS_RATE_WINDOW_US       (100 * 1000)   // Window of https_transfer_stats_t.peak_bytes_per_sec
 #define HTTPS_MAX_HOST_LEN         256
 #define HTTPS_MAX_RESOURCE_LEN     2048
+#define HTTPS_MAX_URL_LEN          (HTTPS_MAX_HOST_LEN + HTTPS_MAX_RESOURCE_LEN + 16)
+#define HTTPS_MAX_REDIRECTS        10
+#define HTTPS_REDIRECT_MAX_BODY    (64 * 1024)    // Longer redirect bodies aren't drained to keep the connection
+#define HTTPS_REQUEST_ARENA_SIZE   (16 * 1024)    // Parser and request line of one request
+#define HTTPS_READ_TIMEOUT_MS      30000
+#define HTTPS_READ_TIMED_OUT       (-3)           // https_read_record() waited the whole read timeout
+#define HTTPS_CONNECT_TIMEOUT_MS   15000          // All connect attempts to a host together
+#define HTTPS_ATTEMPT_TIMEOUT_MS   5000           // One connect attempt
+#define HTTPS_ATTEMPT_DELAY_MS     250            // RFC 8305 Connection Attempt Delay
+#define HTTPS_CONNECT_MAX_ADDRS    16             // Addresses of a host that are tried
+#define HTTPS_HANDSHAKE_RETRIES    3
+#define HTTPS_BACKOFF_BASE_MS      200            // Defaults of the retry backoff policy
+#define HTTPS_BACKOFF_MAX_MS       5000
+#define HTTPS_BACKOFF_JITTER       50
+#define HTTPS_POOL_MAX_IDLE        16
+#define HTTPS_POOL_IDLE_TIMEOUT_MS 30000
+#define HTTPS_SESSION_CACHE_SIZE   64
+#define HTTPS_SESSION_LIFETIME_MS  3600000
+#define HTTPS_DNS_CACHE_SIZE       64
+#define HTTPS_DNS_CACHE_TTL_MS     60000
+#define HTTPS_DNS_NEGATIVE_TTL_MS  5000
+#define HTTPS_PARALLEL_MAX_CONN    16
+#define HTTPS_PARALLEL_MIN_SPLIT   (1024 * 1024)  // Smallest range handed to another connection
+#define HTTPS_PARALLEL_SPLITS_PER_CONN 32
+#define HTTPS_PARALLEL_RETRIES     2              // Extra attempts per range that make no progress
+#define HTTPS_MAX_PATH_LEN         4096
+#define HTTPS_RESUME_SUFFIX        ".resume"      // Progress sidecar next to the download
+#define HTTPS_RESUME_MAGIC         "HTTPS-RESUME 1"
+#define HTTPS_RESUME_SAVE_STEP     (4 * 1024 * 1024)  // Bytes between sidecar saves
+#define HTTPS_RESUME_MAX_RANGES    4096
+#define HTTPS_RESUME_MAX_SIDECAR   (256 * 1024)
+#define HTTPS_ENGINE_MAX_ACTIVE    256            // Default limit of transfers in flight
+#define HTTPS_ENGINE_MAX_EVENTS    64
+#define HTTPS_ENGINE_READ_BUDGET   8              // Reads per wakeup before the next transfer's turn
+#define HTTPS_SHA256_LEN           32
+#define HTTPS_VERIFY_CHUNK         (1024 * 1024)  // Read size when a finished file is hashed
+#define HTTPS_MAX_CIPHERSUITES     64             // Suites in https_client_config_t.ciphersuites
 
+// Target of the redirect being followed, taken from the request arena on
+// the first hop. The URL buffers alternate so the last one stays valid.
 typedef struct {
-    uint32_t status_code;
-    uint32_t header_len;
-    uint8_t *body;
-    uint32_t body_len;
-    uint8_t *header_bak;
-    uint32_t parse_status;
-} https_response_result_t;
+    char urls[2][HTTPS_MAX_URL_LEN];
+    char host[HTTPS_MAX_HOST_LEN];
+    uint16_t port;
+    char resource[HTTPS_MAX_RESOURCE_LEN];
+} https_redirect_info_t;
+
+// Per-thread random generator, linked into its owning client
+typedef struct https_drbg {
+    mbedtls_ctr_drbg_context ctr_drbg;
+    struct https_client *owner;
+    struct https_drbg *next;
+} https_drbg_t;
+
+// One TLS connection over a non-blocking socket; idle ones are parked in the
+// client's pool
+typedef struct https_conn {
+    mbedtls_net_context server_fd;
+    mbedtls_ssl_context ssl;
+    char host[HTTPS_MAX_HOST_LEN];
+    uint16_t port;
+    uint64_t idle_since_ms;
+    int resumed;                    // The handshake resumed a cached session
+    uint64_t wire_in;               // Socket bytes since opened or taken from the pool
+    uint64_t wire_out;
+    uint64_t ssl_reads;
+    uint64_t io_wait_us;            // Time in https_conn_wait()
+    struct https_conn *next;
+} https_conn_t;
 
+// A resolved address, IPv4 or IPv6
+typedef union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+} https_sockaddr_t;
+
+// Addresses of a host in the order they are tried
 typedef struct {
-    char *redirect;
-    int redirect_len;
-    uint16_t redirect_server_port;
-    char *redirect_server_host;
-    char *redirect_resource;
-} https_redirect_info_t;
+    int count;
+    https_sockaddr_t addrs[HTTPS_CONNECT_MAX_ADDRS];
+} https_addr_list_t;
+
+// A Happy Eyeballs connect race in progress, see https_race_step()
+typedef struct {
+    const https_client_config_t *config;
+    const https_addr_list_t *addrs;
+    struct pollfd pfds[HTTPS_CONNECT_MAX_ADDRS];  // One per attempt started, fd -1 once it is over
+    uint64_t deadlines[HTTPS_CONNECT_MAX_ADDRS];  // sys_get_time_us() when an attempt gives up, 0 = never
+    uint64_t total_deadline;        // When the whole race gives up, 0 = never
+    uint64_t next_start;            // When the next attempt is due
+    int next;                       // Attempts started, index of the next address
+    int active;                     // Attempts in flight
+} https_race_t;
+
+// Resolver answer for a host, count 0 remembers that it did not resolve
+typedef struct https_dns_entry {
+    char host[HTTPS_MAX_HOST_LEN];
+    https_addr_list_t list;         // Ports are left 0, the connect fills them in
+    uint64_t expires_ms;
+    struct https_dns_entry *next;
+} https_dns_entry_t;
+
+// Peak throughput over fixed windows
+typedef struct {
+    uint64_t window_start_us;
+    uint64_t window_bytes;
+    double peak;                    // Bytes per second
+} https_rate_meter_t;
+
+// Negotiated TLS session of a host, offered again on the next handshake
+typedef struct https_session_entry {
+    char host[HTTPS_MAX_HOST_LEN];  // Server name (SNI), key together with the port
+    uint16_t port;
+    mbedtls_ssl_session session;
+    uint64_t stored_ms;
+    struct https_session_entry *next;
+} https_session_entry_t;
+
+struct https_client {
+    https_client_config_t config;
+    mbedtls_ssl_config conf;
+    pthread_key_t drbg_key;
+    pthread_mutex_t lock;           // Protects drbg_list, the pool, the session and DNS caches and stats
+    https_drbg_t *drbg_list;
+    https_conn_t *idle_conns;       // Most recently released first
+    int idle_count;
+    https_session_entry_t *sessions;    // Most recently stored first
+    int session_count;
+    https_dns_entry_t *dns;         // Most recently used first
+    int dns_count;
+    https_client_stats_t stats;
+    int *ciphersuites;              // Parsed config.ciphersuites, NULL = the profile's list
+};
+
+// HTTPS_TLS_PROFILE_COMPAT: RSA key exchange with CBC, for old servers
+static const int https_ciphersuites_compat[] = {
+    MBEDTLS_TLS_RSA_WITH_AES_256_CBC_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_256_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_3DES_EDE_CBC_SHA,
+    0
+};
+
+// HTTPS_TLS_PROFILE_FAST: ECDHE and AEAD only. AES-GCM leads where the CPU
+// has AES instructions, ChaCha20-Poly1305 is faster in software.
+static const int https_ciphersuites_fast[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+static const int https_ciphersuites_fast_soft[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+#if defined(MBEDTLS_ECP_C)
+// X25519 first, it is the cheapest key exchange
+static const mbedtls_ecp_group_id https_fast_curves[] = {
+#if defined(MBEDTLS_ECP_DP_CURVE25519_ENABLED)
+    MBEDTLS_ECP_DP_CURVE25519,
+#endif
+#if defined(MBEDTLS_ECP_DP_SECP256R1_ENABLED)
+    MBEDTLS_ECP_DP_SECP256R1,
+#endif
+#if defined(MBEDTLS_ECP_DP_SECP384R1_ENABLED)
+    MBEDTLS_ECP_DP_SECP384R1,
+#endif
+    MBEDTLS_ECP_DP_NONE
+};
+#endif
+
+static pthread_once_t https_default_client_once = PTHREAD_ONCE_INIT;
+static https_client_t *https_default_client = NULL;
+static pthread_once_t https_platform_once = PTHREAD_ONCE_INIT;
 
 /////////////////////////////////////////////////////////////////////////
 ///////////////////////// HTTPS Download Functions /////////////////////
 /////////////////////////////////////////////////////////////////////////
 
-static char *https_itoa(int value)
+// mbedTLS allocates through the sys_malloc pools too, so the SSL contexts and
+// handshake state of a new connection reuse the blocks of a closed one. Set
+// once before the first mbedTLS allocation: a block from the libc calloc must
+// never reach sys_free.
+static void https_platform_setup(void)
 {
-    char *val_str;
-    int tmp = value, len = 1;
-
-    while((tmp /= 10) > 0)
-        len++;
-
-    val_str = (char *) sys_malloc(len + 1);
-    if (val_str) {
-        sprintf(val_str, "%d", value);
-    }
-
-    return val_str;
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+    mbedtls_platform_set_calloc_free(sys_calloc, sys_free);
+#endif
 }
 
-static int https_parse_url(char *url, char *host, uint16_t *port, char *resource)
+static int https_parse_url(const char *url, char *host, uint16_t *port, char *resource)
 {
     if(url){
-        char *https = NULL, *pos = NULL;
+        const char *https = NULL, *pos = NULL, *slash;
         size_t len;
 
         https = strstr(url, "https://");
@@ -63,7 +257,11 @@ static int https_parse_url(char *url, char *host, uint16_t *port, char *resource
             url += strlen("https://");
         memset(host, 0, HTTPS_MAX_HOST_LEN);
 
-        pos = strstr(url, ":");    // get port
+        // get port; a ':' after the first '/' is part of the path
+        pos = strchr(url, ':');
+        slash = strchr(url, '/');
+        if(pos && slash && slash < pos)
+            pos = NULL;
         if(pos){
             len = (size_t)(pos - url);
             if(len >= HTTPS_MAX_HOST_LEN) {
@@ -86,8 +284,6 @@ static int https_parse_url(char *url, char *host, uint16_t *port, char *resource
             }
             *port = 443;  // HTTPS default port
         }
-        printf("HTTPS server: %s\n", host);
-        printf("HTTPS port: %d\n", *port);
 
         memset(resource, 0, HTTPS_MAX_RESOURCE_LEN);
         pos = strstr(url, "/");
@@ -99,147 +295,15 @@ static int https_parse_url(char *url, char *host, uint16_t *port, char *resource
             }
             memcpy(resource, pos + 1, len);
         }
-        // Only print first 100 chars of resource to avoid clutter
-        if(strlen(resource) > 100) {
-            printf("HTTPS resource: %.100s... (%zu bytes)\n", resource, strlen(resource));
-        } else {
-            printf("HTTPS resource: %s\n", resource);
-        }
+        // Only the first 100 chars of the resource, to avoid clutter
+        SYS_LOG_DEBUG("[HTTPS] Server %s port %d resource %.100s%s", host, *port, resource,
+                strlen(resource) > 100 ? "..." : "");
 
         return 0;
     }
     return -1;
 }
 
-static int https_parse_response(unsigned char *response, unsigned int response_len, https_response_result_t *result) 
-{
-    uint32_t i, p, q, m;
-    uint32_t header_end = 0;
-
-    //Get status code
-    if(0 == result->parse_status){//didn't get the http response
-        uint8_t status[4] = {0};
-        i = p = q = m = 0;
-        for (; i < response_len; ++i) {
-            if (' ' == response[i]) {
-                ++m;
-                if (1 == m) {//after HTTP/1.1
-                    p = i;
-                } 
-                else if (2 == m) {//after status code
-                    q = i;
-                    break;
-                }
-            }
-        }
-        if (!p || !q || q-p != 4) {//Didn't get the status code
-            return -1;
-        }
-        memcpy(status, response+p+1, 3);//get the status code
-        result->status_code = atoi((char const *)status);
-        if(result->status_code == 200)
-            result->parse_status = 1;
-        else if(result->status_code == 302)
-        {
-            char *tmp=NULL; 
-            const char *location1 = "LOCATION";
-            const char *location2 = "Location";
-            printf("HTTPS response 302:%s \n", response);
-
-            if((tmp =strstr((char *)response, location1)) ||(tmp=strstr((char *)response, location2)))
-            {
-                // Handle redirect if needed
-                printf("HTTPS redirect detected\n");
-                return -1;
-            }
-            return -1;
-        }
-        else{
-            SYS_LOG_ERROR("The HTTPS response status code is %d", result->status_code);
-            return -1;
-        }
-    }
-
-    //if didn't receive the full http header
-    if(3 == result->parse_status){//didn't get the http response
-        p = q = 0;
-        for (i = 0; i < response_len; ++i) {
-            if (response[i] == '\r' && response[i+1] == '\n' &&
-                    response[i+2] == '\r' && response[i+3] == '\n') {//the end of header
-                header_end = i+4;
-                result->parse_status = 4;
-                result->header_len = header_end;
-                result->body = response + header_end;
-                break;
-            }
-        }
-        if (3 == result->parse_status) {//Still didn't receive the full header    
-            result->header_bak = sys_malloc(HTTPS_HEADER_BAK_LEN + 1);
-            if (result->header_bak) {
-                memset(result->header_bak, 0, HTTPS_HEADER_BAK_LEN + 1);
-                memcpy(result->header_bak, response + response_len - HTTPS_HEADER_BAK_LEN, HTTPS_HEADER_BAK_LEN);
-            }
-        }
-    }
-
-    //Get Content-Length
-    if(1 == result->parse_status){//didn't get the content length
-        const char *content_length_buf1 = "CONTENT-LENGTH";
-        const char *content_length_buf2 = "Content-Length";
-        const uint32_t content_length_buf_len = strlen((const char*)content_length_buf1);
-        p = q = 0;
-
-        for (i = 0; i < response_len; ++i) {
-            if (response[i] == '\r' && response[i+1] == '\n') {
-                q = i;//the end of the line
-                if (!memcmp(response+p, content_length_buf1, content_length_buf_len) ||
-                        !memcmp(response+p, content_length_buf2, content_length_buf_len)) {//get the content length
-                    unsigned int j1 = p+content_length_buf_len, j2 = q-1;
-                    while ( j1 < q && (*(response+j1) == ':' || *(response+j1) == ' ') ) ++j1;
-                    while ( j2 > j1 && *(response+j2) == ' ') --j2;
-                    uint8_t len_buf[12] = {0};
-                    memcpy(len_buf, response+j1, j2-j1+1);
-                    result->body_len = atoi((char const *)len_buf);
-                    result->parse_status = 2;
-                }
-                p = i+2;
-            }
-            if (response[i] == '\r' && response[i+1] == '\n' &&
-                    response[i+2] == '\r' && response[i+3] == '\n') {//Get the end of header
-                header_end = i+4;//p is the start of the body
-                if(result->parse_status == 2){//get the full header and the content length
-                    result->parse_status = 4;
-                    result->header_len = header_end;
-                    result->body = response + header_end;
-                }
-                else {//there are no content length in header    
-                    SYS_LOG_ERROR("No Content-Length in header");
-                    return -1;
-                }
-                break;
-            }    
-        }
-
-        if (1 == result->parse_status) {//didn't get the content length and the full header
-            result->header_bak = sys_malloc(HTTPS_HEADER_BAK_LEN + 1);
-            if (result->header_bak) {
-                memset(result->header_bak, 0, HTTPS_HEADER_BAK_LEN + 1);
-                memcpy(result->header_bak, response + response_len - HTTPS_HEADER_BAK_LEN, HTTPS_HEADER_BAK_LEN);
-            }
-        }
-        else if (2 == result->parse_status) {//didn't get the full header but get the content length
-            result->parse_status = 3;
-            result->header_bak = sys_malloc(HTTPS_HEADER_BAK_LEN + 1);
-            if (result->header_bak) {
-                memset(result->header_bak, 0, HTTPS_HEADER_BAK_LEN + 1);
-                memcpy(result->header_bak, response + response_len - HTTPS_HEADER_BAK_LEN, HTTPS_HEADER_BAK_LEN);
-            }
-        }
-    }
-
-    return result->parse_status;
-}
-
 static const char* https_get_ssl_error_string(int error_code)
 {
     switch(error_code) {
@@ -257,27 +321,120 @@ static const char* https_get_ssl_error_string(int error_code)
     }
 }
 
-static int https_read_socket(mbedtls_ssl_context *ssl, uint8_t *receive_buf, int buf_len)
+// Sockets are non-blocking from the connect on: when mbedTLS wants to read
+// or write, wait for the socket to get ready instead of sleeping. Returns 0
+// when it is ready, MBEDTLS_ERR_SSL_TIMEOUT when nothing happened for
+// timeout_ms (0 = wait forever).
+static int https_conn_wait(https_conn_t *conn, int want, uint32_t timeout_ms)
 {
-    int bytes_rcvd = -1; 
-    int retry_count = 0;
-    const int max_retries = 3;
+    struct pollfd pfd;
+    uint64_t start = sys_get_time_us();
+    uint64_t deadline = timeout_ms ? start + (uint64_t)timeout_ms * 1000 : 0;
+    int ret;
 
-    memset(receive_buf, 0, buf_len);  
+    pfd.fd = conn->server_fd.fd;
+    pfd.events = want == MBEDTLS_ERR_SSL_WANT_WRITE ? POLLOUT : POLLIN;
+    for(;;) {
+        uint64_t now = sys_get_time_us();
+        int wait_ms = -1;
 
-    do {
-        bytes_rcvd = mbedtls_ssl_read(ssl, receive_buf, buf_len);
+        if(deadline) {
+            if(now >= deadline) {
+                ret = MBEDTLS_ERR_SSL_TIMEOUT;
+                break;
+            }
+            wait_ms = (int)((deadline - now + 999) / 1000);
+        }
+        ret = poll(&pfd, 1, wait_ms);
+        if(ret > 0) {
+            // errors and hangups are picked up by the next read or write
+            ret = 0;
+            break;
+        }
+        if(ret < 0 && errno != EINTR) {
+            ret = MBEDTLS_ERR_NET_POLL_FAILED;
+            break;
+        }
+    }
+    conn->io_wait_us += sys_get_time_us() - start;
+    return ret;
+}
+
+// Send all of buf, waiting for the socket as needed
+static int https_conn_write(https_conn_t *conn, const unsigned char *buf, size_t len, uint32_t timeout_ms)
+{
+    int ret;
+
+    while(len > 0) {
+        ret = mbedtls_ssl_write(&conn->ssl, buf, len);
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            if((ret = https_conn_wait(conn, ret, timeout_ms)) != 0)
+                return ret;
+            continue;
+        }
+        if(ret < 0)
+            return ret;
+        buf += ret;
+        len -= (size_t)ret;
+    }
+    return 0;
+}
+
+// Delay before retry number attempt (1 = the first) of a failed operation:
+// exponential from backoff_base_ms up to backoff_max_ms, with backoff_jitter
+// percent of the delay random so that many clients failing together don't
+// come back together
+static uint64_t https_backoff_delay(const https_client_config_t *config, int attempt)
+{
+    uint64_t delay = config->backoff_base_ms;
+    uint32_t jitter = config->backoff_jitter > 100 ? 100 : config->backoff_jitter;
+    uint32_t rnd = 0;
+
+    while(--attempt > 0 && delay < config->backoff_max_ms)
+        delay *= 2;
+    if(delay > config->backoff_max_ms)
+        delay = config->backoff_max_ms;
+    if(jitter && delay && sys_get_random_bytes((unsigned char *)&rnd, sizeof(rnd)) == 0)
+        delay -= delay * jitter / 100 * rnd / UINT32_MAX;
+    return delay;
+}
+
+// Sleep through the backoff before retry number attempt
+static void https_backoff(const https_client_config_t *config, int attempt, https_transfer_stats_t *stats)
+{
+    uint64_t delay = https_backoff_delay(config, attempt);
+    uint64_t start;
+
+    if(delay == 0)
+        return;
+
+    SYS_LOG_DEBUG("[HTTPS] Retrying in %llu ms", (unsigned long long)delay);
+    start = sys_get_time_us();
+    sys_delay_ms((uint32_t)delay);
+    if(stats)
+        stats->backoff_us += sys_get_time_us() - start;
+}
+
+// Wait up to timeout_ms for the next decrypted data. Returns the bytes read,
+// 0 at the end of the stream, negative on errors; the caller decides about
+// retrying.
+static int https_read_record(https_conn_t *conn, uint8_t *receive_buf, int buf_len, uint32_t timeout_ms)
+{
+    int bytes_rcvd;
+
+    for(;;) {
+        bytes_rcvd = mbedtls_ssl_read(&conn->ssl, receive_buf, buf_len);
+        conn->ssl_reads++;
         
         if(bytes_rcvd > 0) {
             return bytes_rcvd; // Success
         }
         
-        // Handle specific SSL errors
         if(bytes_rcvd == MBEDTLS_ERR_SSL_WANT_READ || bytes_rcvd == MBEDTLS_ERR_SSL_WANT_WRITE) {
-            // Non-blocking operation would block, wait and retry
-            sys_delay_ms(10); // Wait 10ms
-            retry_count++;
-            continue;
+            if((bytes_rcvd = https_conn_wait(conn, bytes_rcvd, timeout_ms)) == 0)
+                continue;
+            SYS_LOG_ERROR("SSL read timed out after %u ms", timeout_ms);
+            return HTTPS_READ_TIMED_OUT;
         }
         
         if(bytes_rcvd == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
@@ -286,317 +443,3679 @@ static int https_read_socket(mbedtls_ssl_context *ssl, uint8_t *receive_buf, int
             return 0; // End of data
         }
         
-        if(bytes_rcvd == MBEDTLS_ERR_SSL_CONN_EOF) {
-            // Connection closed by peer
+        if(bytes_rcvd == 0 || bytes_rcvd == MBEDTLS_ERR_SSL_CONN_EOF) {
+            // Connection closed by peer, without close_notify for a 0 return
             SYS_LOG_INFO("SSL connection closed by peer");
             return 0; // End of data
         }
         
-        // For other errors, retry a few times
-        retry_count++;
-        if(retry_count < max_retries) {
-            SYS_LOG_ERROR("SSL read failed [%d]: %s, retrying (%d/%d)", 
-                   bytes_rcvd, https_get_ssl_error_string(bytes_rcvd), retry_count, max_retries);
-            sys_delay_ms(100); // Wait 100ms before retry
-        }
-        
-    } while(retry_count < max_retries);
-
-    SYS_LOG_ERROR("SSL read failed after %d retries [%d]: %s",  
-           max_retries, bytes_rcvd, https_get_ssl_error_string(bytes_rcvd));
-    return -2;
+        SYS_LOG_ERROR("SSL read failed [%d]: %s", bytes_rcvd, https_get_ssl_error_string(bytes_rcvd));
+        return -2;
+    }
 }
 
-int https_download(char *url, const char *save_path)
+// Wait for the next decrypted data, then keep filling receive_buf with
+// whatever can be had without waiting again: the rest of the current
+// record, records mbedTLS already buffered, and records on the socket
+static int https_read_socket(https_conn_t *conn, uint8_t *receive_buf, int buf_len, uint32_t timeout_ms)
 {
-    int ret = -1;
-    char host[HTTPS_MAX_HOST_LEN] = {0};
-    char resource[HTTPS_MAX_RESOURCE_LEN] = {0};
-    uint16_t port = 443;
+    mbedtls_ssl_context *ssl = &conn->ssl;
+    int bytes_rcvd, ret;
 
-    unsigned char *alloc = NULL;
-    unsigned char *request = NULL;
-    int alloc_buf_size = HTTPS_DOWNLOAD_BUF_SIZE;
-    int read_bytes = 0;
-    uint32_t writelen = 0;
-    https_response_result_t rsp_result = {0};
-    uint32_t idx = 0;
+    bytes_rcvd = https_read_record(conn, receive_buf, buf_len, timeout_ms);
+    if(bytes_rcvd <= 0)
+        return bytes_rcvd;
 
-    mbedtls_net_context server_fd;
-    mbedtls_ssl_context ssl;
-    mbedtls_ssl_config conf;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    char *port_str = NULL;
+    while(bytes_rcvd < buf_len) {
+        // the socket is non-blocking: WANT_READ means nothing more for now,
+        // errors and end of stream are reported by the next call
+        ret = mbedtls_ssl_read(ssl, receive_buf + bytes_rcvd, buf_len - bytes_rcvd);
+        conn->ssl_reads++;
+        if(ret <= 0)
+            break;
+        bytes_rcvd += ret;
+    }
 
-    sys_file_t save_file = {0};
-    uint32_t nwrites = 0;
-    uint32_t total_written = 0;
+    return bytes_rcvd;
+}
 
-    SYS_LOG_INFO("[HTTPS] Starting download from: %s", url);
+/////////////////////////////////////////////////////////////////////////
+////////////////////////// HTTPS Client Functions ///////////////////////
+/////////////////////////////////////////////////////////////////////////
 
-    if(https_parse_url(url, host, &port, resource) != 0) {
-        SYS_LOG_ERROR("[HTTPS] Failed to parse URL");
-        goto https_download_exit;
-    }
+static int https_entropy_func(void *data, unsigned char *output, size_t len)
+{
+    (void)data;
+    return sys_get_random_bytes(output, len) == 0 ? 0 : MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
+}
 
-    alloc = (unsigned char *)sys_malloc(alloc_buf_size);
-    if(!alloc){
-        SYS_LOG_ERROR("[HTTPS] Alloc buffer failed");
-        goto https_download_exit;
+static void https_drbg_thread_exit(void *arg)
+{
+    https_drbg_t *drbg = (https_drbg_t *)arg;
+    https_client_t *client = drbg->owner;
+    https_drbg_t **it;
+
+    pthread_mutex_lock(&client->lock);
+    for(it = &client->drbg_list; *it; it = &(*it)->next) {
+        if(*it == drbg) {
+            *it = drbg->next;
+            break;
+        }
     }
+    pthread_mutex_unlock(&client->lock);
 
-    // Initialize mbedTLS structures
-    mbedtls_net_init(&server_fd);
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_config_init(&conf);
-    mbedtls_entropy_init(&entropy);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_ctr_drbg_free(&drbg->ctr_drbg);
+    sys_free(drbg);
+}
 
-    // Seed the random number generator
+// Return the calling thread's DRBG, seeding it on first use
+static mbedtls_ctr_drbg_context *https_client_get_drbg(https_client_t *client)
+{
+    https_drbg_t *drbg = (https_drbg_t *)pthread_getspecific(client->drbg_key);
     const char *pers = "https_download";
-    if((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+    int ret;
+
+    if(drbg)
+        return &drbg->ctr_drbg;
+
+    drbg = (https_drbg_t *)sys_calloc(1, sizeof(https_drbg_t));
+    if(!drbg)
+        return NULL;
+
+    mbedtls_ctr_drbg_init(&drbg->ctr_drbg);
+    if((ret = mbedtls_ctr_drbg_seed(&drbg->ctr_drbg, https_entropy_func, NULL,
                                    (const unsigned char *) pers, strlen(pers))) != 0) {
         SYS_LOG_ERROR("[HTTPS] mbedtls_ctr_drbg_seed failed: -0x%x", -ret);
-        goto https_download_exit;
+        mbedtls_ctr_drbg_free(&drbg->ctr_drbg);
+        sys_free(drbg);
+        return NULL;
     }
+    drbg->owner = client;
 
-    port_str = https_itoa(port);
-    if((ret = mbedtls_net_connect(&server_fd, host, port_str, MBEDTLS_NET_PROTO_TCP)) != 0) {
-        SYS_LOG_ERROR("[HTTPS] mbedtls_net_connect ret(%d)", ret);
-        goto https_download_exit;
-    }
+    pthread_mutex_lock(&client->lock);
+    drbg->next = client->drbg_list;
+    client->drbg_list = drbg;
+    pthread_mutex_unlock(&client->lock);
 
-    mbedtls_ssl_set_bio(&ssl, &server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
-    if((ret = mbedtls_ssl_config_defaults(&conf,
-                    MBEDTLS_SSL_IS_CLIENT,
-                    MBEDTLS_SSL_TRANSPORT_STREAM,
-                    MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+    pthread_setspecific(client->drbg_key, drbg);
+    return &drbg->ctr_drbg;
+}
 
-        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_config_defaults ret(%d)", ret);
-        goto https_download_exit;
-    }
+static int https_client_rng(void *p_rng, unsigned char *output, size_t output_len)
+{
+    mbedtls_ctr_drbg_context *ctr_drbg = https_client_get_drbg((https_client_t *)p_rng);
 
-    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_NONE);
-    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    
-    // Force TLS 1.2 only (MAJOR_VERSION_3 + MINOR_VERSION_3 = TLS 1.2)
-    mbedtls_ssl_conf_min_version(&conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
-    mbedtls_ssl_conf_max_version(&conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
-    
-    // Set read timeout to handle slow connections
-    mbedtls_ssl_conf_read_timeout(&conf, 30000); // 30 seconds timeout
-    
-    // Enable more cipher suites for better compatibility
-    static const int ciphersuites[] = {
-        MBEDTLS_TLS_RSA_WITH_AES_256_CBC_SHA256,
-        MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
-        MBEDTLS_TLS_RSA_WITH_AES_256_CBC_SHA,
-        MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
-        MBEDTLS_TLS_RSA_WITH_3DES_EDE_CBC_SHA,
-        0
-    };
-    mbedtls_ssl_conf_ciphersuites(&conf, ciphersuites);
+    if(!ctr_drbg)
+        return MBEDTLS_ERR_CTR_DRBG_ENTROPY_SOURCE_FAILED;
 
-    if((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
-        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_setup ret(%d)", ret);
-        goto https_download_exit;
+    return mbedtls_ctr_drbg_random(ctr_drbg, output, output_len);
+}
+
+/////////////////////////////////////////////////////////////////////////
+////////////////////////// TLS Session Cache ////////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+static void https_session_entry_free(https_session_entry_t *entry)
+{
+    mbedtls_ssl_session_free(&entry->session);
+    sys_free(entry);
+}
+
+// Offer the cached session for host:port; returns 1 and the session's
+// master secret when one was set, so the caller can tell a resumption
+static int https_session_load(https_client_t *client, mbedtls_ssl_context *ssl,
+                              const char *host, uint16_t port, unsigned char master[48])
+{
+    https_session_entry_t **it;
+    https_session_entry_t *expired = NULL;
+    uint64_t now_ms = sys_get_time_ms();
+    int offered = 0;
+
+    if(client->config.session_cache_size <= 0)
+        return 0;
+
+    pthread_mutex_lock(&client->lock);
+    for(it = &client->sessions; *it; it = &(*it)->next) {
+        https_session_entry_t *entry = *it;
+        if(entry->port != port || strcmp(entry->host, host) != 0)
+            continue;
+
+        if(now_ms - entry->stored_ms >= client->config.session_lifetime_ms) {
+            *it = entry->next;
+            client->session_count--;
+            expired = entry;
+        } else if(mbedtls_ssl_set_session(ssl, &entry->session) == 0) {
+            memcpy(master, entry->session.master, sizeof(entry->session.master));
+            offered = 1;
+        }
+        break;
     }
+    pthread_mutex_unlock(&client->lock);
 
-    // Set hostname for SNI (Server Name Indication)
-    if((ret = mbedtls_ssl_set_hostname(&ssl, host)) != 0) {
-        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_set_hostname ret(%d)", ret);
-        goto https_download_exit;
+    if(expired)
+        https_session_entry_free(expired);
+
+    return offered;
+}
+
+// Remember the session negotiated on ssl, replacing any older one of the host
+static void https_session_store(https_client_t *client, const mbedtls_ssl_context *ssl,
+                                const char *host, uint16_t port)
+{
+    https_session_entry_t *entry, *victim = NULL;
+    https_session_entry_t **it;
+
+    if(client->config.session_cache_size <= 0)
+        return;
+
+    entry = (https_session_entry_t *)sys_calloc(1, sizeof(https_session_entry_t));
+    if(!entry)
+        return;
+
+    mbedtls_ssl_session_init(&entry->session);
+    if(mbedtls_ssl_get_session(ssl, &entry->session) != 0) {
+        https_session_entry_free(entry);
+        return;
     }
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->port = port;
+    entry->stored_ms = sys_get_time_ms();
 
-    // SSL handshake with retry mechanism
-    int handshake_retry = 0;
-    const int max_handshake_retries = 3;
-    
-    do {
-        ret = mbedtls_ssl_handshake(&ssl);
-        if(ret == 0) {
-            break; // Success
-        }
-        
-        handshake_retry++;
-        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_handshake attempt %d failed ret(-0x%x): %s", handshake_retry, -ret, https_get_ssl_error_string(ret));
-        
-        // Provide more detailed error information
-        if(ret == -0x7780) {
-            SYS_LOG_ERROR("[HTTPS] Possible causes: cipher suite mismatch, certificate issues, or SNI problems");
+    pthread_mutex_lock(&client->lock);
+    for(it = &client->sessions; *it; it = &(*it)->next) {
+        if((*it)->port == port && strcmp((*it)->host, host) == 0) {
+            victim = *it;
+            *it = victim->next;
+            client->session_count--;
+            break;
         }
-        
-        if(handshake_retry < max_handshake_retries) {
-            SYS_LOG_INFO("[HTTPS] Retrying SSL handshake in 1 second...");
-            sys_delay_ms(1000); // Wait 1 second before retry
-            
-            // Reset SSL context for retry
-            mbedtls_ssl_session_reset(&ssl);
-        }
-    } while(handshake_retry < max_handshake_retries);
-    
-    if(ret != 0) {
-        SYS_LOG_ERROR("[HTTPS] SSL handshake failed after %d attempts", max_handshake_retries);
-        goto https_download_exit;
     }
+    if(!victim && client->session_count >= client->config.session_cache_size) {
+        // Full: drop the oldest entry, which is the last one
+        for(it = &client->sessions; (*it)->next; it = &(*it)->next)
+            ;
+        victim = *it;
+        *it = NULL;
+        client->session_count--;
+    }
+    entry->next = client->sessions;
+    client->sessions = entry;
+    client->session_count++;
+    pthread_mutex_unlock(&client->lock);
 
-    SYS_LOG_INFO("[HTTPS] SSL ciphersuite %s", mbedtls_ssl_get_ciphersuite(&ssl));
+    if(victim)
+        https_session_entry_free(victim);
+}
 
-    // send https request
-    idx = 0;
-    request = (unsigned char *) sys_malloc(strlen("GET /") + strlen(resource) + strlen(" HTTP/1.1\r\nHost: ") 
-            + strlen(host) + strlen("\r\n\r\n") + 1);
-    if (!request) {
-        SYS_LOG_ERROR("[HTTPS] Failed to allocate request buffer");
-        goto https_download_exit;
+/////////////////////////////////////////////////////////////////////////
+/////////////////////////// DNS Resolver Cache //////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// The order RFC 8305 wants addresses tried in: the resolver's preference
+// first, then alternating between IPv6 and IPv4 so that a broken family
+// only ever delays a connect by one attempt
+static void https_addrs_from_addrinfo(const struct addrinfo *addrs, https_addr_list_t *list)
+{
+    const struct addrinfo *first[HTTPS_CONNECT_MAX_ADDRS], *other[HTTPS_CONNECT_MAX_ADDRS];
+    const struct addrinfo *cur;
+    int nfirst = 0, nother = 0, i;
+
+    list->count = 0;
+    for(cur = addrs; cur; cur = cur->ai_next) {
+        if((cur->ai_family != AF_INET && cur->ai_family != AF_INET6) ||
+                cur->ai_addrlen > sizeof(https_sockaddr_t))
+            continue;
+        if(cur->ai_family == addrs->ai_family && nfirst < HTTPS_CONNECT_MAX_ADDRS)
+            first[nfirst++] = cur;
+        else if(cur->ai_family != addrs->ai_family && nother < HTTPS_CONNECT_MAX_ADDRS)
+            other[nother++] = cur;
     }
-    sprintf((char*)request, "GET /%s HTTP/1.1\r\nHost: %s\r\n\r\n", resource, host);        
-    ret = mbedtls_ssl_write(&ssl, request, strlen((char*)request));
-    if(ret < 0){
-        SYS_LOG_ERROR("[HTTPS] Send HTTPS request failed");
-        goto https_download_exit;
+    for(i = 0; list->count < HTTPS_CONNECT_MAX_ADDRS && (i < nfirst || i < nother); i++) {
+        if(i < nfirst)
+            memcpy(&list->addrs[list->count++], first[i]->ai_addr, first[i]->ai_addrlen);
+        if(i < nother && list->count < HTTPS_CONNECT_MAX_ADDRS)
+            memcpy(&list->addrs[list->count++], other[i]->ai_addr, other[i]->ai_addrlen);
     }
+}
 
-    // parse https response
-    while (3 >= rsp_result.parse_status){//still read header
-        if(0 == rsp_result.parse_status){//didn't get the http response
-            memset(alloc, 0, alloc_buf_size);
-            read_bytes = mbedtls_ssl_read(&ssl, alloc, alloc_buf_size);
-            if(read_bytes <= 0){
-                SYS_LOG_ERROR("[HTTPS] Read socket failed");
-                goto https_download_exit;
-            }
-            idx = read_bytes;
-            memset(&rsp_result, 0, sizeof(rsp_result));
-            if(https_parse_response(alloc, idx, &rsp_result) == -1){
-                goto https_download_exit;
-            }
-        } else if ((1 == rsp_result.parse_status) || (3 == rsp_result.parse_status)){//just get the status code
-            memset(alloc, 0, alloc_buf_size);
-            if (rsp_result.header_bak) {
-                memcpy(alloc, rsp_result.header_bak, HTTPS_HEADER_BAK_LEN);
-                sys_free(rsp_result.header_bak);
-                rsp_result.header_bak = NULL;
-            }
-            read_bytes = mbedtls_ssl_read(&ssl, alloc + HTTPS_HEADER_BAK_LEN, (alloc_buf_size - HTTPS_HEADER_BAK_LEN));
-            if(read_bytes <= 0){
-                SYS_LOG_ERROR("[HTTPS] Read socket failed");
-                goto https_download_exit;
-            }
-            idx = read_bytes + HTTPS_HEADER_BAK_LEN;
-            if (https_parse_response(alloc, read_bytes + HTTPS_HEADER_BAK_LEN, &rsp_result) == -1){
-                goto https_download_exit;
-            }
+static socklen_t https_sockaddr_len(const https_sockaddr_t *addr)
+{
+    return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+}
+
+// Take the entry of host out of the cache, NULL when there is none
+static https_dns_entry_t *https_dns_unlink(https_client_t *client, const char *host)
+{
+    https_dns_entry_t **it;
+
+    for(it = &client->dns; *it; it = &(*it)->next) {
+        https_dns_entry_t *entry = *it;
+        if(strcmp(entry->host, host) == 0) {
+            *it = entry->next;
+            client->dns_count--;
+            return entry;
         }
     }
+    return NULL;
+}
 
-    if (0 == rsp_result.body_len) {
-        SYS_LOG_ERROR("[HTTPS] File size = 0 !");
-        goto https_download_exit;
-    } else {
-        SYS_LOG_INFO("[HTTPS] Download file begin, total size : %d", rsp_result.body_len);
-    }    
+// Remember the answer for host, list NULL when it did not resolve
+static void https_dns_store(https_client_t *client, const char *host, const https_addr_list_t *list)
+{
+    https_dns_entry_t *entry, *victim;
+    https_dns_entry_t **it;
+    uint32_t ttl_ms = list ? client->config.dns_cache_ttl_ms : client->config.dns_negative_ttl_ms;
 
-    // open save file
-    if (sys_file_open(&save_file, save_path, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE) != SYS_FILE_OK) {
-        SYS_LOG_ERROR("[HTTPS] Cannot create file: %s", save_path);
-        goto https_download_exit;
+    if(client->config.dns_cache_size <= 0 || ttl_ms == 0)
+        return;
+
+    entry = (https_dns_entry_t *)sys_calloc(1, sizeof(https_dns_entry_t));
+    if(!entry)
+        return;
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    if(list)
+        entry->list = *list;
+    entry->expires_ms = sys_get_time_ms() + ttl_ms;
+
+    pthread_mutex_lock(&client->lock);
+    victim = https_dns_unlink(client, host);
+    if(!victim && client->dns_count >= client->config.dns_cache_size) {
+        // Full: drop the least recently used entry, which is the last one
+        for(it = &client->dns; (*it)->next; it = &(*it)->next)
+            ;
+        victim = *it;
+        *it = NULL;
+        client->dns_count--;
     }
+    entry->next = client->dns;
+    client->dns = entry;
+    client->dns_count++;
+    pthread_mutex_unlock(&client->lock);
 
-    writelen = idx - rsp_result.header_len;
-    // remove https header_len from alloc
-    memmove(alloc, alloc + rsp_result.header_len, writelen);
-    memset(alloc + writelen, 0, rsp_result.header_len);
+    sys_free(victim);
+}
 
-    // write received data
-    if(writelen > 0) {
-        if (sys_file_write(&save_file, alloc, writelen, &nwrites) != SYS_FILE_OK || nwrites != writelen) {
-            SYS_LOG_ERROR("[HTTPS] Write file failed");
-            goto https_download_exit;
-        }
-        total_written += nwrites;
+// The cached answer for host: 1 with list filled, 0 when there is none,
+// negative when host is remembered as not resolving
+static int https_dns_lookup(https_client_t *client, const char *host, https_addr_list_t *list)
+{
+    https_dns_entry_t *entry, *expired = NULL;
+    int found = 0;
+
+    list->count = 0;
+    if(client->config.dns_cache_size <= 0)
+        return 0;
+
+    pthread_mutex_lock(&client->lock);
+    entry = https_dns_unlink(client, host);
+    if(entry && sys_get_time_ms() >= entry->expires_ms) {
+        expired = entry;
+    } else if(entry) {
+        // hits move to the front, the tail is what gets evicted
+        entry->next = client->dns;
+        client->dns = entry;
+        client->dns_count++;
+        *list = entry->list;
+        found = 1;
+        if(list->count)
+            client->stats.dns_cache_hits++;
+        else
+            client->stats.dns_negative_hits++;
     }
+    if(!found)
+        client->stats.dns_cache_misses++;
+    pthread_mutex_unlock(&client->lock);
+    sys_free(expired);
 
-    // continue download remaining data
-    int consecutive_failures = 0;
-    const int max_consecutive_failures = 5;
-    
-    while(total_written < rsp_result.body_len) {
-        read_bytes = https_read_socket(&ssl, alloc, HTTPS_DOWNLOAD_BUF_SIZE);
-        
-        if(read_bytes < 0) {
-            consecutive_failures++;
-            SYS_LOG_ERROR("[HTTPS] Read data failed (attempt %d/%d)", consecutive_failures, max_consecutive_failures);
-            
-            if(consecutive_failures >= max_consecutive_failures) {
-                SYS_LOG_ERROR("[HTTPS] Too many consecutive read failures, aborting download");
-                break;
-            }
-            
-            // Wait before next attempt
-            sys_delay_ms(500);
-            continue;
-        }
-        
-        if(read_bytes == 0) {
-            // Connection closed by peer, check if we got all data
-            if(total_written >= rsp_result.body_len) {
-                SYS_LOG_INFO("[HTTPS] Download completed, connection closed by peer");
-                break;
-            } else {
-                SYS_LOG_ERROR("[HTTPS] Unexpected connection close: %d/%d bytes received", 
-                             total_written, rsp_result.body_len);
-                break;
-            }
-        }
-        
-        // Reset failure counter on successful read
-        consecutive_failures = 0;
+    if(found && !list->count) {
+        SYS_LOG_DEBUG("[HTTPS] %s did not resolve a moment ago, not trying again yet", host);
+        return -1;
+    }
+    return found;
+}
 
-        // ensure not exceed file size
-        if(total_written + (uint32_t)read_bytes > rsp_result.body_len) {
-            read_bytes = (int)(rsp_result.body_len - total_written);
-        }
+// Ask getaddrinfo() and cache the answer. Returns 0 and fills list with the
+// ports left 0, MBEDTLS_ERR_NET_UNKNOWN_HOST when the host does not resolve.
+static int https_dns_query(https_client_t *client, const char *host, https_addr_list_t *list)
+{
+    struct addrinfo hints, *addrs = NULL;
+    uint64_t start_us;
+    int ret;
 
-        if (sys_file_write(&save_file, alloc, (uint32_t)read_bytes, &nwrites) != SYS_FILE_OK || nwrites != (uint32_t)read_bytes) {
-            SYS_LOG_ERROR("[HTTPS] Write file failed: wrote %u/%d bytes", nwrites, read_bytes);
-            break;
-        }
-        total_written += nwrites;
+    // AF_UNSPEC asks for the A and AAAA records together
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    list->count = 0;
+    start_us = sys_get_time_us();
+    ret = getaddrinfo(host, NULL, &hints, &addrs);
+    pthread_mutex_lock(&client->lock);
+    client->stats.dns_resolves++;
+    client->stats.dns_resolve_us += sys_get_time_us() - start_us;
+    pthread_mutex_unlock(&client->lock);
 
-        // show progress more frequently for better user feedback
-        if(total_written % (HTTPS_DOWNLOAD_BUF_SIZE * 5) == 0 || total_written == rsp_result.body_len) {
-            SYS_LOG_INFO("[HTTPS] Downloaded: %d/%d (%d%%)", 
-                    total_written, rsp_result.body_len, 
-                    (total_written * 100) / rsp_result.body_len);
-        }
+    if(ret == 0) {
+        https_addrs_from_addrinfo(addrs, list);
+        freeaddrinfo(addrs);
+    }
+    if(list->count) {
+        https_dns_store(client, host, list);
+        return 0;
     }
 
-    if(total_written == rsp_result.body_len) {
-        SYS_LOG_INFO("[HTTPS] Download completed successfully: %d bytes", total_written);
-        ret = 0;
-    } else {
-        SYS_LOG_ERROR("[HTTPS] Download incomplete: %d/%d bytes", total_written, rsp_result.body_len);
+    SYS_LOG_ERROR("[HTTPS] Cannot resolve %s: %s", host, ret ? gai_strerror(ret) : "no usable address");
+    // Only a definite "no such name" is remembered, a resolver
+    // that could not be reached may well answer the next time
+    if(ret == EAI_NONAME
+#ifdef EAI_NODATA
+            || ret == EAI_NODATA
+#endif
+            )
+        https_dns_store(client, host, NULL);
+    return MBEDTLS_ERR_NET_UNKNOWN_HOST;
+}
+
+static void https_dns_set_port(https_addr_list_t *list, uint16_t port)
+{
+    int i;
+
+    for(i = 0; i < list->count; i++) {
+        if(list->addrs[i].sa.sa_family == AF_INET6)
+            list->addrs[i].in6.sin6_port = htons(port);
+        else
+            list->addrs[i].in.sin_port = htons(port);
     }
+}
 
-https_download_exit:
-    if(alloc)
-        sys_free(alloc);
-    if(request)
-        sys_free(request);
-    if(port_str)
-        sys_free(port_str);
-    if(rsp_result.header_bak)
-        sys_free(rsp_result.header_bak);
+// Addresses of host from the cache, else from getaddrinfo(). Returns 0 and
+// fills list with port set, MBEDTLS_ERR_NET_UNKNOWN_HOST when the host does
+// not resolve. *cached tells whether the answer came from the cache; with
+// refresh set the cache is skipped and updated.
+static int https_dns_resolve(https_client_t *client, const char *host, uint16_t port,
+                             https_addr_list_t *list, int refresh, int *cached)
+{
+    int ret;
+
+    *cached = 0;
+    list->count = 0;
+    if(!refresh) {
+        if((ret = https_dns_lookup(client, host, list)) < 0)
+            return MBEDTLS_ERR_NET_UNKNOWN_HOST;
+        *cached = ret;
+    }
+    if(!*cached && (ret = https_dns_query(client, host, list)) != 0)
+        return ret;
 
-    sys_file_close(&save_file);
+    https_dns_set_port(list, port);
+    return 0;
+}
 
-    mbedtls_net_free(&server_fd);
-    mbedtls_ssl_free(&ssl);
-    mbedtls_ssl_config_free(&conf);
-    mbedtls_entropy_free(&entropy);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
+int https_client_resolve(https_client_t *client, const char *host)
+{
+    https_addr_list_t list;
+    int cached;
 
-    return ret;
+    if(!client || !host || !*host)
+        return -1;
+    return https_dns_resolve(client, host, 0, &list, 1, &cached) == 0 ? 0 : -1;
+}
+
+/////////////////////////////////////////////////////////////////////////
+////////////////////////// HTTPS Connection Pool ////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Same as mbedtls_net_send() but never raises SIGPIPE when a pooled
+// connection has been closed by the server in the meantime
+static int https_net_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    https_conn_t *conn = (https_conn_t *)ctx;
+    int fd = conn->server_fd.fd;
+    ssize_t ret;
+
+    if(fd < 0)
+        return MBEDTLS_ERR_NET_INVALID_CONTEXT;
+
+    ret = send(fd, buf, len, MSG_NOSIGNAL);
+    if(ret >= 0) {
+        conn->wire_out += (uint64_t)ret;
+        return (int)ret;
+    }
+
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    if(errno == EPIPE || errno == ECONNRESET)
+        return MBEDTLS_ERR_NET_CONN_RESET;
+
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+static int https_net_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    https_conn_t *conn = (https_conn_t *)ctx;
+    int ret = mbedtls_net_recv(&conn->server_fd, buf, len);
+
+    if(ret > 0)
+        conn->wire_in += (uint64_t)ret;
+    return ret;
+}
+
+// Only the first failure is kept, later ones are usually its consequences
+static void https_stats_fail(https_transfer_stats_t *stats, https_error_class_t error_class)
+{
+    if(stats && stats->error_class == HTTPS_ERROR_NONE)
+        stats->error_class = error_class;
+}
+
+// Move the counters of a connection into the stats of the request using it
+static void https_stats_take_conn(https_transfer_stats_t *stats, https_conn_t *conn)
+{
+    if(stats) {
+        stats->wire_bytes_in += conn->wire_in;
+        stats->wire_bytes_out += conn->wire_out;
+        stats->ssl_reads += conn->ssl_reads;
+        stats->io_wait_us += conn->io_wait_us;
+    }
+    conn->wire_in = conn->wire_out = conn->ssl_reads = conn->io_wait_us = 0;
+}
+
+static void https_addr_string(const https_sockaddr_t *addr, char *out, size_t out_len)
+{
+    if(getnameinfo(&addr->sa, https_sockaddr_len(addr), out, (socklen_t)out_len, NULL, 0, NI_NUMERICHOST) != 0)
+        snprintf(out, out_len, "?");
+}
+
+static void https_race_init(https_race_t *race, const https_client_config_t *config,
+                            const https_addr_list_t *addrs)
+{
+    uint64_t now = sys_get_time_us();
+
+    race->config = config;
+    race->addrs = addrs;
+    race->total_deadline = config->connect_timeout_ms ? now + (uint64_t)config->connect_timeout_ms * 1000 : 0;
+    race->next_start = now;
+    race->next = 0;
+    race->active = 0;
+}
+
+// Close every attempt still in flight but keep (-1 = all of them)
+static void https_race_close(https_race_t *race, int keep)
+{
+    int i;
+
+    for(i = 0; i < race->next; i++) {
+        if(i != keep && race->pfds[i].fd >= 0) {
+            close(race->pfds[i].fd);
+            race->pfds[i].fd = -1;
+        }
+    }
+    race->active = 0;
+}
+
+// Happy Eyeballs (RFC 8305): start a non-blocking connect to the next
+// address every connect_attempt_delay_ms, or as soon as an attempt fails,
+// and keep the first one that completes. Each attempt gives up after
+// connect_attempt_timeout_ms, the whole race after connect_timeout_ms.
+//
+// One step never blocks: it collects the attempts pfds[].revents reports,
+// drops those past their deadline and starts the ones that are due. The
+// caller waits for the sockets or https_race_wake(), whichever comes first,
+// with poll() or its event loop. Returns 1 with the winning socket, still
+// non-blocking, in conn; 0 while attempts are in flight; negative once
+// every address failed or the race timed out.
+static int https_race_step(https_race_t *race, https_conn_t *conn, https_transfer_stats_t *stats)
+{
+    const https_client_config_t *config = race->config;
+    const https_addr_list_t *addrs = race->addrs;
+    uint64_t now = sys_get_time_us();
+    int winner = -1, i;
+    char addr_str[64];
+
+    for(i = 0; i < race->next && winner < 0; i++) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if(race->pfds[i].fd < 0)
+            continue;
+        if(race->pfds[i].revents) {
+            if(getsockopt(race->pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+                err = errno;
+            else if(err == 0) {
+                winner = i;
+                break;
+            }
+        } else if(!race->deadlines[i] || now < race->deadlines[i]) {
+            continue;
+        }
+        if(SYS_LOG_ON(LOG_LEVEL_DEBUG)) {
+            https_addr_string(&addrs->addrs[i], addr_str, sizeof(addr_str));
+            SYS_LOG_DEBUG("[HTTPS] Connect to %s %s", addr_str, err ? strerror(err) : "timed out");
+        }
+        close(race->pfds[i].fd);
+        race->pfds[i].fd = -1;
+        race->active--;
+        race->next_start = now;
+    }
+
+    if(winner < 0 && race->total_deadline && now >= race->total_deadline) {
+        SYS_LOG_ERROR("[HTTPS] Connect to %s timed out after %u ms", conn->host, config->connect_timeout_ms);
+        https_race_close(race, -1);
+        return MBEDTLS_ERR_NET_CONNECT_FAILED;
+    }
+
+    // the next attempt's turn has come, or nothing else is in flight
+    while(winner < 0 && race->next < addrs->count && (now >= race->next_start || race->active == 0)) {
+        const https_sockaddr_t *addr = &addrs->addrs[race->next];
+        struct pollfd *pfd = &race->pfds[race->next];
+        int fd = socket(addr->sa.sa_family, SOCK_STREAM, IPPROTO_TCP);
+
+        pfd->fd = -1;
+        pfd->events = POLLOUT;
+        pfd->revents = 0;
+        race->deadlines[race->next] = config->connect_attempt_timeout_ms ?
+                now + (uint64_t)config->connect_attempt_timeout_ms * 1000 : 0;
+        race->next_start = now + (uint64_t)config->connect_attempt_delay_ms * 1000;
+        if(stats)
+            stats->connect_attempts++;
+        if(fd >= 0 && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0) {
+            if(connect(fd, &addr->sa, https_sockaddr_len(addr)) == 0) {
+                pfd->fd = fd;
+                winner = race->next;
+                fd = -1;
+            } else if(errno == EINPROGRESS) {
+                pfd->fd = fd;
+                race->active++;
+                fd = -1;
+            }
+        }
+        if(fd >= 0)
+            close(fd);
+        // failed right away, the next address needn't wait its turn
+        if(pfd->fd < 0)
+            race->next_start = now;
+        race->next++;
+    }
+
+    if(winner < 0)
+        return race->active > 0 ? 0 : MBEDTLS_ERR_NET_CONNECT_FAILED;
+
+    // the losers are dropped, whatever state they are in
+    https_race_close(race, winner);
+    conn->server_fd.fd = race->pfds[winner].fd;
+    race->pfds[winner].fd = -1;
+    if(stats && !stats->remote_addr[0])
+        https_addr_string(&addrs->addrs[winner], stats->remote_addr, sizeof(stats->remote_addr));
+    if(SYS_LOG_ON(LOG_LEVEL_DEBUG)) {
+        https_addr_string(&addrs->addrs[winner], addr_str, sizeof(addr_str));
+        SYS_LOG_DEBUG("[HTTPS] Connected to %s after %d attempts", addr_str, race->next);
+    }
+    return 1;
+}
+
+// sys_get_time_us() when the race next needs a step without any socket
+// event: the next attempt's turn or a deadline. 0 = only sockets matter.
+static uint64_t https_race_wake(const https_race_t *race)
+{
+    uint64_t wake = race->total_deadline;
+    int i;
+
+    if(race->next < race->addrs->count && (!wake || race->next_start < wake))
+        wake = race->next_start;
+    for(i = 0; i < race->next; i++) {
+        if(race->pfds[i].fd >= 0 && race->deadlines[i] && (!wake || race->deadlines[i] < wake))
+            wake = race->deadlines[i];
+    }
+    return wake;
+}
+
+// Run a race to the end, sleeping in poll()
+static int https_connect_race(const https_client_config_t *config, const https_addr_list_t *addrs,
+                              https_conn_t *conn, https_transfer_stats_t *stats)
+{
+    https_race_t race;
+    int ret;
+
+    https_race_init(&race, config, addrs);
+    while((ret = https_race_step(&race, conn, stats)) == 0) {
+        uint64_t wake = https_race_wake(&race), now = sys_get_time_us();
+        int timeout_ms = wake ? (wake > now ? (int)((wake - now + 999) / 1000) : 0) : -1;
+
+        if(poll(race.pfds, (nfds_t)race.next, timeout_ms) < 0 && errno != EINTR) {
+            https_race_close(&race, -1);
+            return MBEDTLS_ERR_NET_CONNECT_FAILED;
+        }
+    }
+    return ret > 0 ? 0 : ret;
+}
+
+// Name resolution, then the connect race, timed apart
+static int https_net_connect(https_client_t *client, https_conn_t *conn, https_transfer_stats_t *stats)
+{
+    https_addr_list_t addrs;
+    int ret, cached;
+
+    if((ret = https_dns_resolve(client, conn->host, conn->port, &addrs, 0, &cached)) != 0) {
+        https_stats_fail(stats, HTTPS_ERROR_DNS);
+        return ret;
+    }
+    if(stats && !stats->dns_us) {
+        stats->dns_us = sys_get_time_us();
+        stats->dns_cached = cached;
+    }
+
+    ret = https_connect_race(&client->config, &addrs, conn, stats);
+    if(ret != 0)
+        https_stats_fail(stats, HTTPS_ERROR_CONNECT);
+    else if(stats && !stats->connect_us)
+        stats->connect_us = sys_get_time_us();
+    return ret;
+}
+
+static void https_conn_free(https_conn_t *conn)
+{
+    if(!conn)
+        return;
+
+    mbedtls_net_free(&conn->server_fd);
+    mbedtls_ssl_free(&conn->ssl);
+    sys_free(conn);
+}
+
+static https_conn_t *https_conn_new(const char *host, uint16_t port)
+{
+    https_conn_t *conn = (https_conn_t *)sys_calloc(1, sizeof(https_conn_t));
+
+    if(!conn) {
+        SYS_LOG_ERROR("[HTTPS] Alloc connection failed");
+        return NULL;
+    }
+    mbedtls_net_init(&conn->server_fd);
+    mbedtls_ssl_init(&conn->ssl);
+    snprintf(conn->host, sizeof(conn->host), "%s", host);
+    conn->port = port;
+    return conn;
+}
+
+// Put TLS on top of a connected socket. With resume set the last session
+// of the server is offered; *session_offered then tells whether its master
+// secret was copied to offered_master.
+static int https_conn_setup_tls(https_client_t *client, https_conn_t *conn, int resume,
+                                int *session_offered, unsigned char offered_master[48])
+{
+    int ret;
+
+    // Handshake flights and the request are small writes, don't let Nagle
+    // hold them back waiting for delayed ACKs
+    int nodelay = 1;
+    setsockopt(conn->server_fd.fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    mbedtls_ssl_set_bio(&conn->ssl, conn, https_net_send, https_net_recv, NULL);
+
+    if((ret = mbedtls_ssl_setup(&conn->ssl, &client->conf)) != 0) {
+        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_setup ret(%d)", ret);
+        return -1;
+    }
+
+    // Set hostname for SNI (Server Name Indication)
+    if((ret = mbedtls_ssl_set_hostname(&conn->ssl, conn->host)) != 0) {
+        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_set_hostname ret(%d)", ret);
+        return -1;
+    }
+
+    // Offer the last session of this server for an abbreviated handshake
+    *session_offered = resume ? https_session_load(client, &conn->ssl, conn->host, conn->port, offered_master) : 0;
+    return 0;
+}
+
+// Count a completed handshake and remember its session
+static void https_conn_handshake_done(https_client_t *client, https_conn_t *conn,
+                                      int session_offered, const unsigned char offered_master[48],
+                                      uint64_t started_us)
+{
+    // A resumed session keeps the master secret of the one we offered
+    int resumed = session_offered &&
+        memcmp(mbedtls_ssl_get_session_pointer(&conn->ssl)->master, offered_master, 48) == 0;
+
+    conn->resumed = resumed;
+    pthread_mutex_lock(&client->lock);
+    if(resumed)
+        client->stats.tls_resumed_handshakes++;
+    else
+        client->stats.tls_full_handshakes++;
+    client->stats.tls_handshake_us += sys_get_time_us() - started_us;
+    pthread_mutex_unlock(&client->lock);
+
+    // Store even after a resumption, the server may have renewed the ticket
+    https_session_store(client, &conn->ssl, conn->host, conn->port);
+
+    SYS_LOG_INFO("[HTTPS] SSL ciphersuite %s%s", mbedtls_ssl_get_ciphersuite(&conn->ssl),
+            resumed ? " (session resumed)" : "");
+}
+
+// Open a TCP connection and complete the TLS handshake, stats (may be NULL)
+// get the phases the first time round
+static https_conn_t *https_conn_open(https_client_t *client, const char *host, uint16_t port,
+                                     https_transfer_stats_t *stats)
+{
+    https_conn_t *conn;
+    unsigned char offered_master[48];
+    int session_offered, ret;
+    int handshake_retry = 0;
+    const int max_handshake_retries = client->config.handshake_retries > 0 ? client->config.handshake_retries : 1;
+    uint64_t handshake_start;
+
+    for(;;) {
+        conn = https_conn_new(host, port);
+        if(!conn)
+            return NULL;
+
+        // the socket comes out non-blocking, waits go through https_conn_wait()
+        if((ret = https_net_connect(client, conn, stats)) != 0) {
+            SYS_LOG_ERROR("[HTTPS] Connect to %s:%d failed ret(%d)", host, port, ret);
+            goto https_conn_open_fail;
+        }
+
+        // a retry falls back to a full handshake
+        handshake_start = sys_get_time_us();
+        if(https_conn_setup_tls(client, conn, handshake_retry == 0, &session_offered, offered_master) != 0) {
+            https_stats_fail(stats, HTTPS_ERROR_TLS);
+            goto https_conn_open_fail;
+        }
+
+        while((ret = mbedtls_ssl_handshake(&conn->ssl)) == MBEDTLS_ERR_SSL_WANT_READ ||
+                ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            if((ret = https_conn_wait(conn, ret, client->config.read_timeout_ms)) != 0)
+                break;
+        }
+        if(ret == 0)
+            break; // Success
+
+        handshake_retry++;
+        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_handshake attempt %d failed ret(-0x%x): %s", handshake_retry, -ret, https_get_ssl_error_string(ret));
+
+        // Provide more detailed error information
+        if(ret == -0x7780) {
+            SYS_LOG_ERROR("[HTTPS] Possible causes: cipher suite mismatch, certificate issues, or SNI problems");
+        }
+
+        // The server sent an alert, closed or is stuck halfway through this
+        // handshake, so a retry only works on a new connection
+        https_stats_take_conn(stats, conn);
+        https_conn_free(conn);
+        if(handshake_retry >= max_handshake_retries) {
+            SYS_LOG_ERROR("[HTTPS] SSL handshake failed after %d attempts", handshake_retry);
+            https_stats_fail(stats, HTTPS_ERROR_TLS);
+            return NULL;
+        }
+        if(stats)
+            stats->handshake_retries++;
+        SYS_LOG_INFO("[HTTPS] Retrying SSL handshake on a new connection");
+        https_backoff(&client->config, handshake_retry, stats);
+    }
+
+    if(stats && !stats->handshake_us)
+        stats->handshake_us = sys_get_time_us();
+
+    https_conn_handshake_done(client, conn, session_offered, offered_master, handshake_start);
+    return conn;
+
+https_conn_open_fail:
+    https_stats_take_conn(stats, conn);
+    https_conn_free(conn);
+    return NULL;
+}
+
+// An idle keep-alive connection must have nothing to read: readable data
+// means the server sent close_notify, a FIN or something unexpected
+static int https_conn_is_alive(https_conn_t *conn)
+{
+    if(mbedtls_ssl_get_bytes_avail(&conn->ssl) > 0)
+        return 0;
+
+    return mbedtls_net_poll(&conn->server_fd, MBEDTLS_NET_POLL_READ, 0) == 0;
+}
+
+// Unlink idle connections that are expired or over capacity; caller holds the lock
+static https_conn_t *https_pool_collect_expired(https_client_t *client, uint64_t now_ms)
+{
+    https_conn_t **it = &client->idle_conns;
+    https_conn_t *victims = NULL;
+    int kept = 0;
+
+    while(*it) {
+        https_conn_t *conn = *it;
+        if(kept >= client->config.max_idle_connections ||
+                now_ms - conn->idle_since_ms >= client->config.idle_timeout_ms) {
+            *it = conn->next;
+            conn->next = victims;
+            victims = conn;
+            client->idle_count--;
+            client->stats.pool_evictions++;
+        } else {
+            kept++;
+            it = &conn->next;
+        }
+    }
+
+    return victims;
+}
+
+static void https_pool_free_list(https_conn_t *list)
+{
+    while(list) {
+        https_conn_t *next = list->next;
+        https_conn_free(list);
+        list = next;
+    }
+}
+
+// Take an idle connection to host:port out of the pool, NULL if there is none
+static https_conn_t *https_pool_acquire(https_client_t *client, const char *host, uint16_t port)
+{
+    https_conn_t *conn = NULL, *victims;
+    https_conn_t **it;
+    uint64_t now_ms = sys_get_time_ms();
+
+    for(;;) {
+        pthread_mutex_lock(&client->lock);
+        victims = https_pool_collect_expired(client, now_ms);
+        for(it = &client->idle_conns; *it; it = &(*it)->next) {
+            if((*it)->port == port && strcmp((*it)->host, host) == 0) {
+                conn = *it;
+                *it = conn->next;
+                conn->next = NULL;
+                client->idle_count--;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&client->lock);
+        https_pool_free_list(victims);
+
+        if(!conn || https_conn_is_alive(conn))
+            break;
+
+        SYS_LOG_DEBUG("[HTTPS] Dropping dead pooled connection to %s:%d", host, port);
+        https_conn_free(conn);
+        conn = NULL;
+        pthread_mutex_lock(&client->lock);
+        client->stats.pool_evictions++;
+        pthread_mutex_unlock(&client->lock);
+    }
+
+    pthread_mutex_lock(&client->lock);
+    if(conn)
+        client->stats.pool_hits++;
+    else
+        client->stats.pool_misses++;
+    pthread_mutex_unlock(&client->lock);
+
+    return conn;
+}
+
+// Park a connection whose last response was fully consumed
+static void https_pool_release(https_client_t *client, https_conn_t *conn)
+{
+    https_conn_t *victims;
+
+    if(client->config.max_idle_connections <= 0) {
+        https_conn_free(conn);
+        return;
+    }
+
+    conn->idle_since_ms = sys_get_time_ms();
+
+    pthread_mutex_lock(&client->lock);
+    conn->next = client->idle_conns;
+    client->idle_conns = conn;
+    client->idle_count++;
+    victims = https_pool_collect_expired(client, conn->idle_since_ms);
+    pthread_mutex_unlock(&client->lock);
+
+    https_pool_free_list(victims);
+}
+
+void https_client_config_init(https_client_config_t *config)
+{
+    if(!config)
+        return;
+
+    memset(config, 0, sizeof(https_client_config_t));
+    config->read_timeout_ms = HTTPS_READ_TIMEOUT_MS;
+    config->connect_timeout_ms = HTTPS_CONNECT_TIMEOUT_MS;
+    config->connect_attempt_timeout_ms = HTTPS_ATTEMPT_TIMEOUT_MS;
+    config->connect_attempt_delay_ms = HTTPS_ATTEMPT_DELAY_MS;
+    config->handshake_retries = HTTPS_HANDSHAKE_RETRIES;
+    config->backoff_base_ms = HTTPS_BACKOFF_BASE_MS;
+    config->backoff_max_ms = HTTPS_BACKOFF_MAX_MS;
+    config->backoff_jitter = HTTPS_BACKOFF_JITTER;
+    config->max_idle_connections = HTTPS_POOL_MAX_IDLE;
+    config->idle_timeout_ms = HTTPS_POOL_IDLE_TIMEOUT_MS;
+    config->session_cache_size = HTTPS_SESSION_CACHE_SIZE;
+    config->session_lifetime_ms = HTTPS_SESSION_LIFETIME_MS;
+    config->max_redirects = HTTPS_MAX_REDIRECTS;
+    config->dns_cache_size = HTTPS_DNS_CACHE_SIZE;
+    config->dns_cache_ttl_ms = HTTPS_DNS_CACHE_TTL_MS;
+    config->dns_negative_ttl_ms = HTTPS_DNS_NEGATIVE_TTL_MS;
+    config->buffer_size = HTTPS_DOWNLOAD_BUF_SIZE;
+    config->max_buffer_size = HTTPS_DOWNLOAD_BUF_MAX;
+    config->tls_profile = HTTPS_TLS_PROFILE_COMPAT;
+}
+
+// Turn "NAME:NAME:..." into a zero-terminated list of suite ids
+static int *https_parse_ciphersuites(const char *names)
+{
+    char name[128];
+    int *ids = (int *)sys_calloc(HTTPS_MAX_CIPHERSUITES + 1, sizeof(int));
+    int count = 0;
+
+    if(!ids)
+        return NULL;
+    while(*names) {
+        size_t len = strcspn(names, ":, ");
+        if(len > 0) {
+            if(len >= sizeof(name) || count == HTTPS_MAX_CIPHERSUITES)
+                goto https_parse_ciphersuites_fail;
+            memcpy(name, names, len);
+            name[len] = '\0';
+            ids[count] = mbedtls_ssl_get_ciphersuite_id(name);
+            if(ids[count] == 0) {
+                SYS_LOG_ERROR("[HTTPS] Unknown cipher suite: %s", name);
+                goto https_parse_ciphersuites_fail;
+            }
+            count++;
+        }
+        names += len;
+        if(*names)
+            names++;
+    }
+    if(count > 0)
+        return ids;
+
+https_parse_ciphersuites_fail:
+    sys_free(ids);
+    return NULL;
+}
+
+// Protocol versions, cipher suites and curves of the configured profile
+static int https_client_conf_tls(https_client_t *client)
+{
+    const int *suites = https_ciphersuites_compat;
+
+    if(client->config.tls_profile == HTTPS_TLS_PROFILE_FAST) {
+        suites = https_ciphersuites_fast;
+#if defined(MBEDTLS_AESNI_C)
+        if(!mbedtls_aesni_has_support(MBEDTLS_AESNI_AES))
+            suites = https_ciphersuites_fast_soft;
+#else
+        suites = https_ciphersuites_fast_soft;
+#endif
+        // TLS 1.2 only, mbedTLS 2.28 has no TLS 1.3 client
+        mbedtls_ssl_conf_min_version(&client->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+        mbedtls_ssl_conf_max_version(&client->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+#if defined(MBEDTLS_ECP_C)
+        mbedtls_ssl_conf_curves(&client->conf, https_fast_curves);
+#endif
+    } else {
+        // Force TLS 1.2 only (MAJOR_VERSION_3 + MINOR_VERSION_3 = TLS 1.2)
+        mbedtls_ssl_conf_min_version(&client->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+        mbedtls_ssl_conf_max_version(&client->conf, MBEDTLS_SSL_MAJOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_3);
+    }
+
+    if(client->config.ciphersuites) {
+        client->ciphersuites = https_parse_ciphersuites(client->config.ciphersuites);
+        if(!client->ciphersuites) {
+            SYS_LOG_ERROR("[HTTPS] Invalid cipher suite list: %s", client->config.ciphersuites);
+            return -1;
+        }
+        suites = client->ciphersuites;
+    }
+    // the string belongs to the caller
+    client->config.ciphersuites = NULL;
+    mbedtls_ssl_conf_ciphersuites(&client->conf, suites);
+    return 0;
+}
+
+void https_download_opts_init(https_download_opts_t *opts)
+{
+    if(!opts)
+        return;
+
+    memset(opts, 0, sizeof(https_download_opts_t));
+}
+
+https_client_t *https_client_create(const https_client_config_t *config)
+{
+    https_client_t *client;
+    int ret;
+
+    pthread_once(&https_platform_once, https_platform_setup);
+    client = (https_client_t *)sys_calloc(1, sizeof(https_client_t));
+    if(!client) {
+        SYS_LOG_ERROR("[HTTPS] Alloc client failed");
+        return NULL;
+    }
+
+    if(config)
+        client->config = *config;
+    else
+        https_client_config_init(&client->config);
+
+    if(pthread_key_create(&client->drbg_key, https_drbg_thread_exit) != 0) {
+        SYS_LOG_ERROR("[HTTPS] pthread_key_create failed");
+        sys_free(client);
+        return NULL;
+    }
+    pthread_mutex_init(&client->lock, NULL);
+    mbedtls_ssl_config_init(&client->conf);
+
+    if((ret = mbedtls_ssl_config_defaults(&client->conf,
+                    MBEDTLS_SSL_IS_CLIENT,
+                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                    MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+
+        SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_config_defaults ret(%d)", ret);
+        https_client_destroy(client);
+        return NULL;
+    }
+
+    mbedtls_ssl_conf_authmode(&client->conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&client->conf, https_client_rng, client);
+
+    // Set read timeout to handle slow connections
+    mbedtls_ssl_conf_read_timeout(&client->conf, client->config.read_timeout_ms);
+
+    if(https_client_conf_tls(client) != 0) {
+        https_client_destroy(client);
+        return NULL;
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    // Tickets let servers without a session cache resume too
+    mbedtls_ssl_conf_session_tickets(&client->conf,
+            client->config.session_cache_size > 0 ? MBEDTLS_SSL_SESSION_TICKETS_ENABLED
+                                                  : MBEDTLS_SSL_SESSION_TICKETS_DISABLED);
+#endif
+
+    return client;
+}
+
+void https_client_destroy(https_client_t *client)
+{
+    https_drbg_t *drbg;
+
+    if(!client)
+        return;
+
+    https_pool_free_list(client->idle_conns);
+    client->idle_conns = NULL;
+    client->idle_count = 0;
+
+    while(client->sessions) {
+        https_session_entry_t *entry = client->sessions;
+        client->sessions = entry->next;
+        https_session_entry_free(entry);
+    }
+    client->session_count = 0;
+
+    while(client->dns) {
+        https_dns_entry_t *entry = client->dns;
+        client->dns = entry->next;
+        sys_free(entry);
+    }
+    client->dns_count = 0;
+
+    mbedtls_ssl_config_free(&client->conf);
+    sys_free(client->ciphersuites);
+
+    // Generators of threads that are still running are released here,
+    // the ones of finished threads were already freed on thread exit
+    pthread_key_delete(client->drbg_key);
+    while((drbg = client->drbg_list) != NULL) {
+        client->drbg_list = drbg->next;
+        mbedtls_ctr_drbg_free(&drbg->ctr_drbg);
+        sys_free(drbg);
+    }
+    pthread_mutex_destroy(&client->lock);
+
+    sys_free(client);
+}
+
+void https_client_get_stats(https_client_t *client, https_client_stats_t *stats)
+{
+    if(!client || !stats)
+        return;
+
+    pthread_mutex_lock(&client->lock);
+    *stats = client->stats;
+    stats->pool_idle = (uint32_t)client->idle_count;
+    pthread_mutex_unlock(&client->lock);
+}
+
+// One GET on a pooled connection, the response body is handed to callbacks
+typedef struct {
+    const char *extra_headers;      // Request header lines ending in "\r\n", may be NULL
+    uint32_t buffer_size;           // Initial receive buffer size, 0 = client default
+    // Called once the header is parsed: 0 reads the body, 1 stops without
+    // it, negative fails the request
+    int (*on_response)(void *ctx, const https_response_t *rsp);
+    // Called for each run of body bytes, pointing into the receive buffer:
+    // 0 continues, 1 stops early, negative fails the request
+    int (*on_body)(void *ctx, const uint8_t *data, uint32_t len);
+    // Called after the body when on_response was called, with the request
+    // result; the response is still valid. Non-zero fails the request.
+    int (*on_end)(void *ctx, const https_response_t *rsp, int result);
+    void *ctx;
+    https_transfer_stats_t *stats;  // Phases and counters are added here, may be NULL
+    https_redirect_fn on_redirect;  // Told about each redirect before it is followed, may be NULL
+    void *redirect_ctx;
+    char *final_url;                // Gets the URL that answered last, may be NULL
+    size_t final_url_size;
+} https_request_t;
+
+// Sits between the parser and the request callbacks to keep the stats
+typedef struct {
+    const https_request_t *req;
+    const https_parser_t *parser;
+    int began;                      // on_response was called
+    int follow;                     // Redirects are followed
+    uint32_t redirect_status;       // The response is a redirect to follow, its body is drained unseen
+    https_rate_meter_t meter;
+} https_request_state_t;
+
+static void https_rate_add(https_rate_meter_t *m, uint32_t len)
+{
+    uint64_t now = sys_get_time_us();
+
+    if(m->window_start_us == 0)
+        m->window_start_us = now;
+    m->window_bytes += len;
+    if(now - m->window_start_us >= HTTPS_RATE_WINDOW_US) {
+        double rate = m->window_bytes * 1000000.0 / (double)(now - m->window_start_us);
+        if(rate > m->peak)
+            m->peak = rate;
+        m->window_start_us = now;
+        m->window_bytes = 0;
+    }
+}
+
+static void https_stats_finish(https_transfer_stats_t *stats, int result)
+{
+    // failed attempts that were retried successfully don't count
+    if(result == 0)
+        stats->error_class = HTTPS_ERROR_NONE;
+    else if(result == HTTPS_ERR_CHECKSUM)
+        stats->error_class = HTTPS_ERROR_CHECKSUM;
+    else if(result == HTTPS_ERR_CANCELLED)
+        stats->error_class = HTTPS_ERROR_CANCELLED;
+    else
+        https_stats_fail(stats, HTTPS_ERROR_OTHER);
+    stats->end_us = sys_get_time_us();
+    if(stats->first_byte_us && stats->end_us > stats->first_byte_us)
+        stats->avg_bytes_per_sec = stats->body_bytes * 1000000.0 / (double)(stats->end_us - stats->first_byte_us);
+    // a transfer shorter than one window has only its average
+    if(stats->peak_bytes_per_sec < stats->avg_bytes_per_sec)
+        stats->peak_bytes_per_sec = stats->avg_bytes_per_sec;
+}
+
+// Throttles the progress callback of one download and derives the rates
+typedef struct {
+    https_progress_fn fn;
+    void *ctx;
+    uint64_t interval_us;
+    uint64_t byte_step;
+    uint64_t start_us;
+    uint64_t last_us;               // Time of the previous report
+    uint64_t last_bytes;            // bytes at the previous report
+    uint64_t bytes;
+    int64_t total;
+    double smoothed;
+    int reports;
+    int cancelled;                  // The callback asked to stop
+} https_progress_state_t;
+
+static void https_progress_init(https_progress_state_t *p, const https_download_opts_t *opts, uint64_t start_us)
+{
+    memset(p, 0, sizeof(*p));
+    p->fn = opts->progress;
+    p->ctx = opts->progress_ctx;
+    p->interval_us = (uint64_t)(opts->progress_interval_ms ? opts->progress_interval_ms : HTTPS_PROGRESS_INTERVAL_MS) * 1000;
+    p->byte_step = opts->progress_bytes;
+    p->start_us = p->last_us = start_us;
+    p->total = -1;
+}
+
+// Bytes that were already there count as done but not towards the rate
+static void https_progress_begin(https_progress_state_t *p, uint64_t bytes, int64_t total)
+{
+    p->bytes = p->last_bytes = bytes;
+    p->total = total;
+}
+
+static int https_progress_report(https_progress_state_t *p, uint64_t now, int done)
+{
+    https_progress_t info;
+    double dt = (now - p->last_us) / 1000000.0;
+
+    info.bytes = p->bytes;
+    info.total = p->total;
+    info.rate = dt > 0 ? (p->bytes - p->last_bytes) / dt : 0;
+    // exponential moving average weighted by the time each rate covered
+    if(p->reports++ == 0)
+        p->smoothed = info.rate;
+    else
+        p->smoothed += dt / (dt + HTTPS_PROGRESS_SMOOTHING_S) * (info.rate - p->smoothed);
+    info.smoothed_rate = p->smoothed;
+    if(p->total >= 0 && (uint64_t)p->total <= p->bytes)
+        info.eta_seconds = 0;
+    else if(p->total >= 0 && p->smoothed > 0)
+        info.eta_seconds = ((uint64_t)p->total - p->bytes) / p->smoothed;
+    else
+        info.eta_seconds = -1;
+    info.elapsed_us = now - p->start_us;
+    info.done = done;
+    p->last_us = now;
+    p->last_bytes = p->bytes;
+
+    if(p->fn(p->ctx, &info) != 0 && !done) {
+        SYS_LOG_DEBUG("[HTTPS] Download cancelled by the progress callback");
+        p->cancelled = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Record that bytes are done and report if the interval or byte step has
+// passed. Returns -1 once the callback cancelled the download.
+static int https_progress_update(https_progress_state_t *p, uint64_t bytes, int64_t total)
+{
+    uint64_t now;
+
+    if(!p || !p->fn)
+        return 0;
+    if(p->cancelled)
+        return -1;
+    p->bytes = bytes;
+    p->total = total;
+    if(p->byte_step && bytes - p->last_bytes >= p->byte_step)
+        return https_progress_report(p, sys_get_time_us(), 0);
+    now = sys_get_time_us();
+    if(now - p->last_us < p->interval_us)
+        return 0;
+    return https_progress_report(p, now, 0);
+}
+
+static int https_is_redirect(uint32_t status_code)
+{
+    return status_code == 301 || status_code == 302 || status_code == 303 ||
+           status_code == 307 || status_code == 308;
+}
+
+static int https_request_on_headers(void *ctx, const https_response_t *rsp)
+{
+    https_request_state_t *st = (https_request_state_t *)ctx;
+    https_transfer_stats_t *stats = st->req->stats;
+    int ret;
+
+    // the callbacks only ever see the final response
+    if(st->follow && https_is_redirect(rsp->status_code) && https_response_header(rsp, "Location")) {
+        st->redirect_status = rsp->status_code;
+        // a body that may be long is not worth reading to keep the connection
+        if(rsp->body_mode == HTTPS_BODY_CLOSE ||
+                (rsp->body_mode == HTTPS_BODY_LENGTH && rsp->content_length > HTTPS_REDIRECT_MAX_BODY))
+            return 1;
+        return 0;
+    }
+
+    st->began = 1;
+    if(stats) {
+        if(!stats->first_byte_us)
+            stats->first_byte_us = sys_get_time_us();
+        stats->status_code = rsp->status_code;
+    }
+    ret = st->req->on_response ? st->req->on_response(st->req->ctx, rsp) : 0;
+    // the callbacks refuse a status or range they can't use
+    if(ret < 0)
+        https_stats_fail(stats, HTTPS_ERROR_HTTP);
+    return ret;
+}
+
+static int https_request_on_body(void *ctx, const uint8_t *data, uint32_t len)
+{
+    https_request_state_t *st = (https_request_state_t *)ctx;
+    int ret;
+
+    if(st->redirect_status)
+        return st->parser->body_received + len > HTTPS_REDIRECT_MAX_BODY ? 1 : 0;
+    ret = st->req->on_body ? st->req->on_body(st->req->ctx, data, len) : 0;
+    if(ret < 0)
+        https_stats_fail(st->req->stats, HTTPS_ERROR_WRITE);
+    if(st->req->stats) {
+        st->req->stats->body_bytes += len;
+        https_rate_add(&st->meter, len);
+        if(st->meter.peak > st->req->stats->peak_bytes_per_sec)
+            st->req->stats->peak_bytes_per_sec = st->meter.peak;
+    }
+    return ret;
+}
+
+// Absolute URL of a Location value: relative ones are taken against the
+// request's host, port and resource, a fragment is dropped. Only https is
+// followed, a redirect to plain http would give away the transport.
+static int https_resolve_location(const char *location, const char *host, uint16_t port,
+                                  const char *resource, char *url, size_t url_size)
+{
+    size_t scheme = strspn(location, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+    int len;
+
+    if(strncasecmp(location, "https://", 8) == 0) {
+        len = snprintf(url, url_size, "https://%s", location + 8);
+    } else if(strncmp(location, "//", 2) == 0) {
+        len = snprintf(url, url_size, "https:%s", location);
+    } else if(scheme > 0 && location[scheme] == ':') {
+        SYS_LOG_ERROR("[HTTPS] Redirect to another scheme: %s", location);
+        return -1;
+    } else if(location[0] == '/') {
+        len = snprintf(url, url_size, "https://%s:%u%s", host, port, location);
+    } else {
+        // next to the current resource, whose query doesn't count
+        size_t path_len = strcspn(resource, "?#");
+        while(path_len > 0 && resource[path_len - 1] != '/')
+            path_len--;
+        len = snprintf(url, url_size, "https://%s:%u/%.*s%s", host, port, (int)path_len, resource, location);
+    }
+    if(len < 0 || (size_t)len >= url_size) {
+        SYS_LOG_ERROR("[HTTPS] Redirect target too long");
+        return -1;
+    }
+    url[strcspn(url, "#")] = '\0';
+    return 0;
+}
+
+// GET request for resource on host; extra_headers are whole lines or NULL.
+// Taken from arena when given, else from sys_malloc. A port other than 443
+// goes into Host, servers build absolute redirects from it.
+static char *https_build_request(sys_arena_t *arena, const char *host, uint16_t port, const char *resource,
+                                 const char *extra_headers)
+{
+    char *request;
+    char port_str[8] = "";
+    size_t len;
+
+    if(!extra_headers)
+        extra_headers = "";
+    if(port != 443)
+        snprintf(port_str, sizeof(port_str), ":%u", port);
+    len = strlen("GET /") + strlen(resource) + strlen(" HTTP/1.1\r\nHost: ")
+            + strlen(host) + strlen(port_str) + strlen("\r\n") + strlen(extra_headers) + strlen("\r\n") + 1;
+    request = (char *)(arena ? sys_arena_alloc(arena, len) : sys_malloc(len));
+    if (!request) {
+        SYS_LOG_ERROR("[HTTPS] Failed to allocate request buffer");
+        return NULL;
+    }
+    snprintf(request, len, "GET /%s HTTP/1.1\r\nHost: %s%s\r\n%s\r\n", resource, host, port_str, extra_headers);
+    return request;
+}
+
+// A request that stopped early leaves unread body on the connection, so the
+// connection is closed instead of going back to the pool
+static int https_client_request(https_client_t *client, const char *url, const https_request_t *req)
+{
+    int ret = -1;
+    char host[HTTPS_MAX_HOST_LEN] = {0};
+    char resource[HTTPS_MAX_RESOURCE_LEN] = {0};
+    uint16_t port = 443;
+
+    unsigned char *alloc = NULL;
+    unsigned char *request = NULL;
+    int alloc_buf_size = HTTPS_DOWNLOAD_BUF_SIZE;
+    int max_buf_size;
+    int full_reads = 0;
+    int read_bytes = 0;
+    int consumed;
+
+    https_parser_t *parser = NULL;
+    https_parser_callbacks_t callbacks;
+    https_request_state_t state = {0};
+    sys_arena_t arena;              // Parser and request line, released together
+
+    https_conn_t *conn = NULL;
+    https_transfer_stats_t *stats = req->stats;
+    int reused = 0;
+    int keep_alive = 0;
+
+    https_redirect_info_t *redirect = NULL;
+    const char *cur_url = url;      // Where the current hop is sent
+    uint32_t hops = 0;
+    uint64_t hop_start_us = sys_get_time_us();
+
+    sys_arena_init(&arena, HTTPS_REQUEST_ARENA_SIZE);
+    SYS_LOG_INFO("[HTTPS] Starting download from: %s", url);
+
+    if(https_parse_url(url, host, &port, resource) != 0) {
+        SYS_LOG_ERROR("[HTTPS] Failed to parse URL");
+        goto https_request_exit;
+    }
+
+    // Start at the requested buffer size and let the body loop grow it
+    if(req->buffer_size > 0)
+        alloc_buf_size = (int)req->buffer_size;
+    else if(client->config.buffer_size > 0)
+        alloc_buf_size = (int)client->config.buffer_size;
+    if(alloc_buf_size < HTTPS_DOWNLOAD_BUF_MIN)
+        alloc_buf_size = HTTPS_DOWNLOAD_BUF_MIN;
+    max_buf_size = (int)client->config.max_buffer_size;
+    if(max_buf_size < alloc_buf_size)
+        max_buf_size = alloc_buf_size;
+
+    alloc = (unsigned char *)sys_malloc(alloc_buf_size);
+    parser = (https_parser_t *)sys_arena_alloc(&arena, sizeof(https_parser_t));
+    if(!alloc || !parser){
+        SYS_LOG_ERROR("[HTTPS] Alloc buffer failed");
+        goto https_request_exit;
+    }
+
+    // build https request
+    request = (unsigned char *)https_build_request(&arena, host, port, resource, req->extra_headers);
+    if (!request)
+        goto https_request_exit;
+
+    state.req = req;
+    state.parser = parser;
+    state.follow = client->config.max_redirects > 0;
+    callbacks.on_headers = https_request_on_headers;
+    callbacks.on_body = https_request_on_body;
+    callbacks.ctx = &state;
+
+https_request_connect:
+    // reuse an idle keep-alive connection when there is one
+    conn = https_pool_acquire(client, host, port);
+    reused = (conn != NULL);
+    if(conn) {
+        https_stats_take_conn(NULL, conn);
+    } else {
+        conn = https_conn_open(client, host, port, stats);
+        if(!conn)
+            goto https_request_exit;
+    }
+https_request_send:
+    if(stats) {
+        if(stats->requests == 0)
+            stats->reused_connection = reused;
+        if(!stats->ciphersuite[0]) {
+            snprintf(stats->ciphersuite, sizeof(stats->ciphersuite), "%s", mbedtls_ssl_get_ciphersuite(&conn->ssl));
+            snprintf(stats->tls_version, sizeof(stats->tls_version), "%s", mbedtls_ssl_get_version(&conn->ssl));
+            stats->session_resumed = conn->resumed;
+        }
+        stats->requests++;
+    }
+
+    // send https request
+    ret = https_conn_write(conn, request, strlen((char*)request), client->config.read_timeout_ms);
+    if(ret < 0){
+        if(reused) {
+            // the server closed the idle connection under us, try again
+            SYS_LOG_DEBUG("[HTTPS] Pooled connection went stale, reconnecting");
+            https_stats_take_conn(stats, conn);
+            https_conn_free(conn);
+            conn = NULL;
+            if(stats)
+                stats->retries++;
+            goto https_request_connect;
+        }
+        SYS_LOG_ERROR("[HTTPS] Send HTTPS request failed");
+        https_stats_fail(stats, HTTPS_ERROR_NETWORK);
+        goto https_request_exit;
+    }
+    ret = -1;
+    if(stats && !stats->request_us)
+        stats->request_us = sys_get_time_us();
+
+    // every received byte goes through the parser exactly once
+    https_parser_init(parser, &callbacks);
+
+    while(parser->state != HTTPS_PARSE_DONE && parser->state != HTTPS_PARSE_STOPPED) {
+        read_bytes = https_read_socket(conn, alloc, alloc_buf_size, client->config.read_timeout_ms);
+
+        if(read_bytes <= 0 && read_bytes != HTTPS_READ_TIMED_OUT && reused &&
+                parser->state == HTTPS_PARSE_STATUS_LINE && parser->line_len == 0) {
+            // nothing at all came back on the pooled connection, a slow
+            // server is left to the read timeout
+            SYS_LOG_DEBUG("[HTTPS] Pooled connection went stale, reconnecting");
+            https_stats_take_conn(stats, conn);
+            https_conn_free(conn);
+            conn = NULL;
+            if(stats)
+                stats->retries++;
+            goto https_request_connect;
+        }
+
+        if(read_bytes < 0) {
+            // the read already waited read_timeout_ms or the TLS stream
+            // broke, reading on it again can't help; range downloads resume
+            // from the written bytes on a new connection
+            SYS_LOG_ERROR("[HTTPS] Read data failed: %d", read_bytes);
+            https_stats_fail(stats, HTTPS_ERROR_NETWORK);
+            break;
+        }
+
+        if(read_bytes == 0) {
+            // Connection closed by peer, this ends a read-until-close body
+            if(https_parser_finish(parser) != 0) {
+                SYS_LOG_ERROR("[HTTPS] Unexpected connection close: %llu bytes of body received",
+                        (unsigned long long)parser->body_received);
+            }
+            break;
+        }
+
+        consumed = https_parser_execute(parser, alloc, (uint32_t)read_bytes);
+        if(consumed < 0)
+            break;
+        if(consumed < read_bytes) {
+            // more data than the response holds, the stream can't be trusted for reuse
+            SYS_LOG_DEBUG("[HTTPS] %d bytes after the end of the response", read_bytes - consumed);
+            parser->rsp.keep_alive = 0;
+        }
+
+        // Reads keep filling the whole buffer: the data is arriving faster
+        // than we drain it, so move to a bigger buffer
+        if(read_bytes == alloc_buf_size && alloc_buf_size < max_buf_size) {
+            full_reads++;
+        } else {
+            full_reads = 0;
+        }
+
+        if(full_reads >= HTTPS_BUF_GROW_AFTER) {
+            int new_size = alloc_buf_size * 2 < max_buf_size ? alloc_buf_size * 2 : max_buf_size;
+            unsigned char *bigger = (unsigned char *)sys_malloc(new_size);
+            if(bigger) {
+                // the buffer is fully consumed here, nothing to copy
+                sys_free(alloc);
+                alloc = bigger;
+                alloc_buf_size = new_size;
+                SYS_LOG_DEBUG("[HTTPS] Receive buffer grown to %d bytes", alloc_buf_size);
+            }
+            full_reads = 0;
+        }
+    }
+
+    if(state.redirect_status && (parser->state == HTTPS_PARSE_DONE || parser->state == HTTPS_PARSE_STOPPED)) {
+        const char *location = https_response_header(&parser->rsp, "Location");
+        uint64_t now = sys_get_time_us();
+        char *next_url;
+        int drained, same_conn;
+
+        if(++hops > (uint32_t)client->config.max_redirects) {
+            SYS_LOG_ERROR("[HTTPS] Stopped after %d redirects", client->config.max_redirects);
+            https_stats_fail(stats, HTTPS_ERROR_HTTP);
+            goto https_request_exit;
+        }
+        if(!redirect && !(redirect = (https_redirect_info_t *)sys_arena_alloc(&arena, sizeof(https_redirect_info_t)))) {
+            SYS_LOG_ERROR("[HTTPS] Alloc redirect failed");
+            goto https_request_exit;
+        }
+        next_url = redirect->urls[hops % 2];
+        if(https_resolve_location(location, host, port, resource, next_url, HTTPS_MAX_URL_LEN) != 0 ||
+                https_parse_url(next_url, redirect->host, &redirect->port, redirect->resource) != 0 ||
+                !redirect->host[0]) {
+            SYS_LOG_ERROR("[HTTPS] Cannot follow the redirect to %s", location);
+            https_stats_fail(stats, HTTPS_ERROR_HTTP);
+            goto https_request_exit;
+        }
+
+        // a drained response leaves the connection ready for the next
+        // request, which it can carry when the host stays the same
+        drained = parser->state == HTTPS_PARSE_DONE && parser->rsp.keep_alive;
+        same_conn = drained && port == redirect->port && strcasecmp(host, redirect->host) == 0;
+        SYS_LOG_INFO("[HTTPS] Redirect %u to %s after %.1f ms%s", state.redirect_status, next_url,
+                (now - hop_start_us) / 1000.0, same_conn ? ", same connection" : "");
+        if(stats) {
+            stats->redirects++;
+            stats->redirect_us += now - hop_start_us;
+        }
+        if(req->on_redirect) {
+            https_redirect_t info;
+
+            info.status_code = state.redirect_status;
+            info.from = cur_url;
+            info.to = next_url;
+            info.hop = hops;
+            info.elapsed_us = now - hop_start_us;
+            info.same_connection = same_conn;
+            if(req->on_redirect(req->redirect_ctx, &info) != 0) {
+                SYS_LOG_INFO("[HTTPS] Redirect to %s refused", next_url);
+                https_stats_fail(stats, HTTPS_ERROR_HTTP);
+                goto https_request_exit;
+            }
+        }
+
+        cur_url = next_url;
+        hop_start_us = now;
+        memcpy(host, redirect->host, sizeof(host));
+        memcpy(resource, redirect->resource, sizeof(resource));
+        port = redirect->port;
+        state.redirect_status = 0;
+        request = (unsigned char *)https_build_request(&arena, host, port, resource, req->extra_headers);
+        if(!request)
+            goto https_request_exit;
+        if(same_conn) {
+            reused = 1;
+            goto https_request_send;
+        }
+        https_stats_take_conn(stats, conn);
+        if(drained)
+            https_pool_release(client, conn);
+        else
+            https_conn_free(conn);
+        conn = NULL;
+        goto https_request_connect;
+    }
+
+    if(parser->state == HTTPS_PARSE_DONE) {
+        SYS_LOG_INFO("[HTTPS] Download completed successfully: %llu bytes", (unsigned long long)parser->body_received);
+        keep_alive = parser->rsp.keep_alive;
+        ret = 0;
+    } else if(parser->state == HTTPS_PARSE_STOPPED) {
+        ret = 0;
+    } else if(parser->state == HTTPS_PARSE_ERROR) {
+        // a failing callback was classified already, what is left is the parser's
+        https_stats_fail(stats, HTTPS_ERROR_PROTOCOL);
+    } else {
+        SYS_LOG_ERROR("[HTTPS] Download incomplete: %llu bytes of body received", (unsigned long long)parser->body_received);
+        https_stats_fail(stats, HTTPS_ERROR_NETWORK);
+    }
+
+    if(state.began && req->on_end && req->on_end(req->ctx, &parser->rsp, ret) != 0 && ret == 0) {
+        https_stats_fail(stats, HTTPS_ERROR_WRITE);
+        ret = -1;
+    }
+    if(ret == 0 && req->final_url)
+        snprintf(req->final_url, req->final_url_size, "%s", cur_url);
+
+https_request_exit:
+    if(alloc) {
+        if(stats && (uint32_t)alloc_buf_size > stats->recv_buffer_size)
+            stats->recv_buffer_size = (uint32_t)alloc_buf_size;
+        sys_free(alloc);
+    }
+    sys_arena_destroy(&arena);
+
+    if(conn) {
+        https_stats_take_conn(stats, conn);
+        // only a connection whose response was consumed exactly can be reused
+        if(ret == 0 && keep_alive)
+            https_pool_release(client, conn);
+        else
+            https_conn_free(conn);
+    }
+
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////
+//////////////////////// HTTPS Sink Download Functions ///////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// Adapts the request callbacks to a user sink
+typedef struct {
+    https_sink_fn sink;
+    void *user_ctx;
+    https_sink_info_t info;
+    int began;                      // BEGIN was delivered, so END is owed
+    https_transfer_stats_t *stats;  // May be NULL
+} https_sink_ctx_t;
+
+static void https_sink_fill_info(https_sink_ctx_t *sc, const https_response_t *rsp)
+{
+    sc->info.status_code = rsp->status_code;
+    if(rsp->body_mode == HTTPS_BODY_LENGTH)
+        sc->info.content_length = rsp->content_length;
+    else
+        sc->info.content_length = rsp->body_mode == HTTPS_BODY_NONE ? 0 : -1;
+    sc->info.etag = rsp->etag;
+    sc->info.last_modified = rsp->last_modified;
+    sc->info.response = rsp;
+}
+
+static int https_sink_on_response(void *ctx, const https_response_t *rsp)
+{
+    https_sink_ctx_t *sc = (https_sink_ctx_t *)ctx;
+
+    if (rsp->status_code != 200) {
+        SYS_LOG_ERROR("[HTTPS] The HTTPS response status code is %d", rsp->status_code);
+        return -1;
+    }
+    https_sink_fill_info(sc, rsp);
+    sc->began = 1;
+    if(sc->sink(sc->user_ctx, HTTPS_SINK_BEGIN, &sc->info, NULL, 0) != 0) {
+        https_stats_fail(sc->stats, HTTPS_ERROR_WRITE);
+        return -1;
+    }
+    return 0;
+}
+
+static int https_sink_on_body(void *ctx, const uint8_t *data, uint32_t len)
+{
+    https_sink_ctx_t *sc = (https_sink_ctx_t *)ctx;
+    int ret = sc->sink(sc->user_ctx, HTTPS_SINK_DATA, &sc->info, data, len);
+
+    sc->info.received += len;
+    return ret == 0 ? 0 : -1;
+}
+
+static int https_sink_on_end(void *ctx, const https_response_t *rsp, int result)
+{
+    https_sink_ctx_t *sc = (https_sink_ctx_t *)ctx;
+
+    if(!sc->began)
+        return 0;
+    https_sink_fill_info(sc, rsp);
+    sc->info.result = result;
+    return sc->sink(sc->user_ctx, HTTPS_SINK_END, &sc->info, NULL, 0);
+}
+
+// opts may be NULL; only the buffer size, stats and redirect callback are used
+static int https_sink_download(https_client_t *client, const char *url, https_sink_fn sink, void *user_ctx,
+                               const https_download_opts_t *opts)
+{
+    https_sink_ctx_t sc;
+    https_request_t req = {0};
+
+    memset(&sc, 0, sizeof(sc));
+    sc.sink = sink;
+    sc.user_ctx = user_ctx;
+    sc.stats = opts ? opts->stats : NULL;
+    req.on_response = https_sink_on_response;
+    req.on_body = https_sink_on_body;
+    req.on_end = https_sink_on_end;
+    req.ctx = &sc;
+    if(opts) {
+        req.buffer_size = opts->buffer_size;
+        req.stats = opts->stats;
+        req.on_redirect = opts->redirect;
+        req.redirect_ctx = opts->redirect_ctx;
+    }
+
+    return https_client_request(client, url, &req);
+}
+
+// Expected digest from 64 hex digits, either case
+static int https_sha256_parse(const char *hex, uint8_t digest[HTTPS_SHA256_LEN])
+{
+    if(strlen(hex) != HTTPS_SHA256_LEN * 2)
+        return -1;
+    for(int i = 0; i < HTTPS_SHA256_LEN * 2; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if(v < 0)
+            return -1;
+        if(i % 2 == 0)
+            digest[i / 2] = (uint8_t)(v << 4);
+        else
+            digest[i / 2] |= (uint8_t)v;
+    }
+    return 0;
+}
+
+// Compare a computed digest with the expected one, logging both on a mismatch
+static int https_sha256_check(const uint8_t expected[HTTPS_SHA256_LEN], const uint8_t actual[HTTPS_SHA256_LEN],
+                              const char *save_path)
+{
+    char hex[HTTPS_SHA256_LEN * 2 + 1];
+
+    if(memcmp(expected, actual, HTTPS_SHA256_LEN) == 0) {
+        SYS_LOG_DEBUG("[HTTPS] SHA-256 verified: %s", save_path);
+        return 0;
+    }
+    for(int i = 0; i < HTTPS_SHA256_LEN; i++)
+        sprintf(hex + i * 2, "%02x", actual[i]);
+    SYS_LOG_ERROR("[HTTPS] SHA-256 mismatch for %s: got %s", save_path, hex);
+    return -1;
+}
+
+// Hash a finished file, for downloads that arrive out of order
+static int https_sha256_file(const char *path, uint8_t digest[HTTPS_SHA256_LEN])
+{
+    mbedtls_sha256_context sha;
+    sys_file_t file = {0};
+    uint8_t *buf = NULL;
+    uint32_t len;
+    int ret = -1;
+
+    mbedtls_sha256_init(&sha);
+    if(sys_file_open(&file, path, SYS_FILE_READ) != SYS_FILE_OK) {
+        SYS_LOG_ERROR("[HTTPS] Cannot open %s to verify it", path);
+        goto https_sha256_file_exit;
+    }
+    buf = (uint8_t *)sys_malloc(HTTPS_VERIFY_CHUNK);
+    if(!buf)
+        goto https_sha256_file_exit;
+    mbedtls_sha256_starts_ret(&sha, 0);
+    do {
+        if(sys_file_read(&file, buf, HTTPS_VERIFY_CHUNK, &len) != SYS_FILE_OK)
+            goto https_sha256_file_exit;
+        mbedtls_sha256_update_ret(&sha, buf, len);
+    } while(len == HTTPS_VERIFY_CHUNK);
+    mbedtls_sha256_finish_ret(&sha, digest);
+    ret = 0;
+
+https_sha256_file_exit:
+    if(buf)
+        sys_free(buf);
+    sys_file_close(&file);
+    mbedtls_sha256_free(&sha);
+    return ret;
+}
+
+// Reserve the whole file before any data arrives. Only a full disk is an
+// error, file systems without fallocate just grow the file as it comes.
+static int https_preallocate(sys_file_t *file, uint64_t size, const char *save_path)
+{
+    switch(sys_file_preallocate(file, size)) {
+    case SYS_FILE_OK:
+        return 0;
+    case SYS_FILE_NO_SPACE:
+        SYS_LOG_ERROR("[HTTPS] Not enough disk space for %llu bytes: %s", (unsigned long long)size, save_path);
+        return -1;
+    default:
+        SYS_LOG_DEBUG("[HTTPS] Cannot preallocate %s, the file grows as data arrives", save_path);
+        return 0;
+    }
+}
+
+// Whole-file download, the body goes to save_path in order
+typedef struct {
+    const char *save_path;
+    sys_file_t file;
+    sys_file_backend_t backend;
+    https_client_t *client;         // Gets the write-behind counters, NULL = no write-behind
+    int write_buffers;
+    uint32_t write_buffer_size;
+    https_writer_t *writer;
+    int verify;                     // Hash the body and compare with expected
+    int mismatch;                   // The body arrived whole but its digest is wrong
+    https_progress_state_t *progress;   // May be NULL
+    uint8_t expected[HTTPS_SHA256_LEN];
+    mbedtls_sha256_context sha;
+} https_file_sink_t;
+
+// Stop the write-behind thread once everything queued is on disk
+static int https_file_sink_flush(https_file_sink_t *f)
+{
+    https_writer_stats_t stats;
+    int ret;
+
+    if(!f->writer)
+        return 0;
+
+    ret = https_writer_close(f->writer, &stats);
+    f->writer = NULL;
+    SYS_LOG_DEBUG("[HTTPS] Write-behind: %llu bytes in %u writes, download waited %.1f ms, writer waited %.1f ms",
+            (unsigned long long)stats.bytes, stats.writes, stats.producer_wait_us / 1000.0, stats.writer_wait_us / 1000.0);
+
+    pthread_mutex_lock(&f->client->lock);
+    f->client->stats.write_wait_us += stats.producer_wait_us;
+    f->client->stats.writer_idle_us += stats.writer_wait_us;
+    pthread_mutex_unlock(&f->client->lock);
+    return ret;
+}
+
+static int https_file_sink(void *user_ctx, https_sink_event_t event, const https_sink_info_t *info,
+                           const uint8_t *data, uint32_t len)
+{
+    https_file_sink_t *f = (https_file_sink_t *)user_ctx;
+    uint32_t nwrites = 0;
+
+    switch(event) {
+    case HTTPS_SINK_BEGIN:
+        if (0 == info->content_length) {
+            SYS_LOG_ERROR("[HTTPS] File size = 0 !");
+            return -1;
+        }
+        if (info->content_length > 0)
+            SYS_LOG_INFO("[HTTPS] Download file begin, total size : %lld", (long long)info->content_length);
+        else
+            SYS_LOG_INFO("[HTTPS] Download file begin, size not known in advance");
+
+        // open save file
+        if (sys_file_open_backend(&f->file, f->save_path, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE, f->backend) != SYS_FILE_OK) {
+            SYS_LOG_ERROR("[HTTPS] Cannot create file: %s", f->save_path);
+            return -1;
+        }
+        if (f->file.backend != f->backend)
+            SYS_LOG_DEBUG("[HTTPS] File backend %s not available, using %s", sys_file_backend_name(f->backend),
+                    sys_file_backend_name(f->file.backend));
+        if (info->content_length > 0 && https_preallocate(&f->file, (uint64_t)info->content_length, f->save_path) != 0)
+            return -1;
+        if (f->client && f->write_buffers > 0) {
+            f->writer = https_writer_create(&f->file, f->write_buffers, f->write_buffer_size);
+            if (!f->writer)
+                return -1;
+        }
+        if (f->verify) {
+            mbedtls_sha256_init(&f->sha);
+            mbedtls_sha256_starts_ret(&f->sha, 0);
+        }
+        if (f->progress)
+            https_progress_begin(f->progress, 0, info->content_length);
+        return 0;
+
+    case HTTPS_SINK_DATA:
+        // hashed while the bytes are still in the receive buffer
+        if (f->verify)
+            mbedtls_sha256_update_ret(&f->sha, data, len);
+        if (f->writer) {
+            if (https_writer_write(f->writer, data, len) != 0)
+                return -1;
+        } else if (sys_file_write(&f->file, data, len, &nwrites) != SYS_FILE_OK || nwrites != len) {
+            SYS_LOG_ERROR("[HTTPS] Write file failed: wrote %u/%u bytes", nwrites, len);
+            return -1;
+        }
+        return https_progress_update(f->progress, info->received + len, info->content_length);
+
+    case HTTPS_SINK_END: {
+        int ret = https_file_sink_flush(f);
+        if (ret == 0 && f->file.is_open && sys_file_flush(&f->file) != SYS_FILE_OK) {
+            SYS_LOG_ERROR("[HTTPS] Write file failed: %s", f->save_path);
+            ret = -1;
+        }
+        sys_file_close(&f->file);
+        if (f->verify) {
+            uint8_t digest[HTTPS_SHA256_LEN];
+            if (ret == 0 && info->result == 0) {
+                mbedtls_sha256_finish_ret(&f->sha, digest);
+                if (https_sha256_check(f->expected, digest, f->save_path) != 0) {
+                    f->mismatch = 1;
+                    ret = -1;
+                }
+            }
+            mbedtls_sha256_free(&f->sha);
+        }
+        return ret;
+    }
+    }
+    return -1;
+}
+
+static int https_stream_download(https_client_t *client, const char *url, const char *save_path,
+                                 const https_download_opts_t *opts, https_progress_state_t *progress)
+{
+    https_file_sink_t f = {0};
+    int ret;
+
+    f.save_path = save_path;
+    f.progress = progress;
+    if(opts)
+        f.backend = (sys_file_backend_t)opts->file_backend;
+    if(opts && opts->sha256) {
+        if(https_sha256_parse(opts->sha256, f.expected) != 0) {
+            SYS_LOG_ERROR("[HTTPS] Invalid SHA-256: %s", opts->sha256);
+            return -1;
+        }
+        f.verify = 1;
+    }
+    if(opts && opts->write_buffers > 0) {
+        f.client = client;
+        f.write_buffers = opts->write_buffers;
+        f.write_buffer_size = opts->write_buffer_size;
+    }
+    ret = https_sink_download(client, url, https_file_sink, &f, opts);
+    https_file_sink_flush(&f);
+    sys_file_close(&f.file);
+    if(f.mismatch) {
+        sys_file_remove(save_path);
+        ret = HTTPS_ERR_CHECKSUM;
+    }
+    if(ret != 0 && progress && progress->cancelled)
+        ret = HTTPS_ERR_CANCELLED;
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////
+//////////////////////// HTTPS Range Download Functions //////////////////
+/////////////////////////////////////////////////////////////////////////
+
+// A byte range still to fetch; workers advance pos, stealing shrinks end
+typedef struct {
+    uint64_t pos;                   // Next byte to fetch
+    uint64_t end;                   // One past the last byte to fetch
+    int active;                     // A worker is fetching this range
+} https_segment_t;
+
+// Progress of a resumable download as recorded in its sidecar file
+typedef struct {
+    char etag[HTTPS_MAX_VALIDATOR_LEN];
+    char last_modified[HTTPS_MAX_VALIDATOR_LEN];
+    uint64_t total;
+    uint64_t (*ranges)[2];          // Committed [start, end) ranges, sorted
+    int range_count;
+} https_resume_t;
+
+typedef struct {
+    https_client_t *client;
+    const char *url;
+    const char *fetch_url;          // Where the probe ended up after redirects, the ranges come from there
+    const char *sidecar_path;       // Progress sidecar, NULL when not resumable
+    char validator[HTTPS_MAX_VALIDATOR_LEN];    // If-Range value, empty = none
+    const https_response_t *probe;
+    sys_file_t file;
+    uint64_t total;
+    uint32_t buffer_size;
+    pthread_mutex_t lock;           // Protects the segment table, failed and unsaved
+    https_segment_t *segments;
+    int segment_count;
+    int segment_max;
+    int failed;
+    uint32_t unsaved;               // Bytes written since the sidecar was last saved
+    pthread_mutex_t save_lock;      // One sidecar writer at a time
+    https_transfer_stats_t *stats;  // Counters of all workers, NULL = not wanted; under lock
+    https_rate_meter_t meter;       // Throughput of all workers together, under lock
+    https_progress_state_t *progress;   // NULL = not wanted; under lock
+    uint64_t done_bytes;            // Bytes of the file on disk, under lock
+} https_range_job_t;
+
+// One range request of a worker
+typedef struct {
+    https_range_job_t *job;
+    int seg;
+    uint64_t start;                 // First byte asked for
+} https_range_ctx_t;
+
+// ETag is preferred for If-Range, but a weak one may not be used there
+static const char *https_pick_validator(const char *etag, const char *last_modified)
+{
+    if(etag[0] && strncmp(etag, "W/", 2) != 0)
+        return etag;
+    return last_modified;
+}
+
+static int https_compare_range(const void *a, const void *b)
+{
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return (x > y) - (x < y);
+}
+
+static void https_resume_free(https_resume_t *r)
+{
+    if(r->ranges)
+        sys_free(r->ranges);
+    memset(r, 0, sizeof(*r));
+}
+
+// Load the sidecar of a previous attempt at url. Anything unexpected means
+// the partial data can't be trusted and the download starts over.
+static int https_resume_load(const char *sidecar_path, const char *url, https_resume_t *r)
+{
+    sys_file_t file = {0};
+    char *text = NULL, *line, *save = NULL;
+    uint32_t len = 0;
+    int url_ok = 0, version_ok = 0, ret = -1;
+
+    memset(r, 0, sizeof(*r));
+    if(sys_file_open(&file, sidecar_path, SYS_FILE_READ) != SYS_FILE_OK)
+        return -1;
+
+    text = (char *)sys_malloc(HTTPS_RESUME_MAX_SIDECAR + 1);
+    r->ranges = (uint64_t (*)[2])sys_calloc(HTTPS_RESUME_MAX_RANGES, sizeof(*r->ranges));
+    if(!text || !r->ranges || sys_file_read(&file, text, HTTPS_RESUME_MAX_SIDECAR, &len) != SYS_FILE_OK)
+        goto https_resume_load_exit;
+    text[len] = '\0';
+
+    for(line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long long a, b;
+        if(strcmp(line, HTTPS_RESUME_MAGIC) == 0) {
+            version_ok = 1;
+        } else if(strncmp(line, "url ", 4) == 0) {
+            url_ok = strcmp(line + 4, url) == 0;
+        } else if(strncmp(line, "etag ", 5) == 0) {
+            snprintf(r->etag, sizeof(r->etag), "%s", line + 5);
+        } else if(strncmp(line, "last-modified ", 14) == 0) {
+            snprintf(r->last_modified, sizeof(r->last_modified), "%s", line + 14);
+        } else if(sscanf(line, "size %llu", &a) == 1) {
+            r->total = a;
+        } else if(sscanf(line, "range %llu %llu", &a, &b) == 2) {
+            if(r->range_count >= HTTPS_RESUME_MAX_RANGES || a >= b)
+                goto https_resume_load_exit;
+            r->ranges[r->range_count][0] = a;
+            r->ranges[r->range_count][1] = b;
+            r->range_count++;
+        }
+    }
+
+    if(!version_ok || !url_ok || r->total == 0 || !https_pick_validator(r->etag, r->last_modified)[0])
+        goto https_resume_load_exit;
+    qsort(r->ranges, r->range_count, sizeof(*r->ranges), https_compare_range);
+    for(int i = 0; i < r->range_count; i++) {
+        if(r->ranges[i][1] > r->total || (i > 0 && r->ranges[i][0] < r->ranges[i - 1][1]))
+            goto https_resume_load_exit;
+    }
+    ret = 0;
+
+https_resume_load_exit:
+    sys_file_close(&file);
+    if(text)
+        sys_free(text);
+    if(ret != 0)
+        https_resume_free(r);
+    return ret;
+}
+
+// Record what is on disk. The snapshot is taken before the data file is
+// synced, so every range in the sidecar is durable by the time the sidecar
+// replaces the previous one.
+static int https_resume_save(https_range_job_t *job)
+{
+    uint64_t (*pending)[2] = NULL;
+    int npending = 0, i, ret = -1;
+    uint64_t cursor = 0;
+    char tmp_path[HTTPS_MAX_PATH_LEN];
+    char line[HTTPS_MAX_RESOURCE_LEN + 64];
+    sys_file_t file = {0};
+    uint32_t nwrites;
+    int len;
+
+    pending = (uint64_t (*)[2])sys_calloc(job->segment_max, sizeof(*pending));
+    if(!pending)
+        return -1;
+    pthread_mutex_lock(&job->lock);
+    for(i = 0; i < job->segment_count; i++) {
+        if(job->segments[i].pos < job->segments[i].end) {
+            pending[npending][0] = job->segments[i].pos;
+            pending[npending][1] = job->segments[i].end;
+            npending++;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    qsort(pending, npending, sizeof(*pending), https_compare_range);
+
+    if(sys_file_sync(&job->file) != SYS_FILE_OK) {
+        SYS_LOG_ERROR("[HTTPS] Sync of the download file failed");
+        goto https_resume_save_exit;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->sidecar_path);
+    if(sys_file_open(&file, tmp_path, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE) != SYS_FILE_OK) {
+        SYS_LOG_ERROR("[HTTPS] Cannot create file: %s", tmp_path);
+        goto https_resume_save_exit;
+    }
+
+    len = snprintf(line, sizeof(line), "%s\nurl %s\netag %s\nlast-modified %s\nsize %llu\n", HTTPS_RESUME_MAGIC,
+            job->url, job->probe->etag, job->probe->last_modified, (unsigned long long)job->total);
+    if(sys_file_write(&file, line, (uint32_t)len, &nwrites) != SYS_FILE_OK)
+        goto https_resume_save_exit;
+
+    // committed data is everything between the ranges still pending
+    for(i = 0; i <= npending; i++) {
+        uint64_t next = i < npending ? pending[i][0] : job->total;
+        if(next > cursor) {
+            len = snprintf(line, sizeof(line), "range %llu %llu\n", (unsigned long long)cursor, (unsigned long long)next);
+            if(sys_file_write(&file, line, (uint32_t)len, &nwrites) != SYS_FILE_OK)
+                goto https_resume_save_exit;
+        }
+        if(i < npending && pending[i][1] > cursor)
+            cursor = pending[i][1];
+    }
+
+    if(sys_file_sync(&file) != SYS_FILE_OK)
+        goto https_resume_save_exit;
+    sys_file_close(&file);
+    if(sys_file_rename(tmp_path, job->sidecar_path) != SYS_FILE_OK) {
+        SYS_LOG_ERROR("[HTTPS] Cannot replace %s", job->sidecar_path);
+        goto https_resume_save_exit;
+    }
+    ret = 0;
+
+https_resume_save_exit:
+    sys_file_close(&file);
+    sys_free(pending);
+    return ret;
+}
+
+static int https_probe_on_response(void *ctx, const https_response_t *rsp)
+{
+    if(rsp->status_code != 200 && rsp->status_code != 206) {
+        SYS_LOG_ERROR("[HTTPS] The HTTPS response status code is %d", rsp->status_code);
+        return -1;
+    }
+    *(https_response_t *)ctx = *rsp;
+    // A 200 would send the whole file, don't read it twice
+    return rsp->status_code == 206 ? 0 : 1;
+}
+
+static int https_discard_on_body(void *ctx, const uint8_t *data, uint32_t len)
+{
+    (void)ctx;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+static int https_range_on_response(void *ctx, const https_response_t *rsp)
+{
+    https_range_ctx_t *r = (https_range_ctx_t *)ctx;
+
+    // If-Range turns a changed resource into a 200 with the new content
+    if(rsp->status_code != 206 || rsp->range_start != r->start) {
+        SYS_LOG_ERROR("[HTTPS] Range request at %llu answered with status %u at %llu",
+                (unsigned long long)r->start, rsp->status_code, (unsigned long long)rsp->range_start);
+        return -1;
+    }
+    return 0;
+}
+
+static int https_range_on_body(void *ctx, const uint8_t *data, uint32_t len)
+{
+    https_range_ctx_t *r = (https_range_ctx_t *)ctx;
+    https_range_job_t *job = r->job;
+    https_segment_t *seg;
+    uint64_t pos, left;
+    uint32_t n, nwrites = 0;
+    int done, save = 0;
+
+    pthread_mutex_lock(&job->lock);
+    seg = &job->segments[r->seg];
+    pos = seg->pos;
+    left = seg->end > pos ? seg->end - pos : 0;
+    pthread_mutex_unlock(&job->lock);
+    n = left < len ? (uint32_t)left : len;
+
+    // Another worker may take over our tail meanwhile, it writes the same bytes
+    if(n > 0 && (sys_file_write_at(&job->file, pos, data, n, &nwrites) != SYS_FILE_OK || nwrites != n)) {
+        SYS_LOG_ERROR("[HTTPS] Write file at %llu failed: wrote %u/%u bytes", (unsigned long long)pos, nwrites, n);
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    seg->pos += n;
+    done = seg->pos >= seg->end;
+    job->unsaved += n;
+    job->done_bytes += n;
+    if(https_progress_update(job->progress, job->done_bytes, (int64_t)job->total) != 0) {
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+        return -1;
+    }
+    if(job->stats)
+        https_rate_add(&job->meter, n);
+    if(job->sidecar_path && job->unsaved >= HTTPS_RESUME_SAVE_STEP) {
+        job->unsaved = 0;
+        save = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    // a save already running elsewhere covers us well enough
+    if(save && pthread_mutex_trylock(&job->save_lock) == 0) {
+        https_resume_save(job);
+        pthread_mutex_unlock(&job->save_lock);
+    }
+
+    return done ? 1 : 0;
+}
+
+// Split the back half off the largest range, the caller holds job->lock.
+// Returns the new range or -1 when no range is worth splitting.
+static int https_range_split(https_range_job_t *job)
+{
+    https_segment_t *seg, *tail;
+    uint64_t largest = 0;
+    int i, victim = -1;
+
+    for(i = 0; i < job->segment_count; i++) {
+        seg = &job->segments[i];
+        if(seg->pos < seg->end && seg->end - seg->pos > largest) {
+            largest = seg->end - seg->pos;
+            victim = i;
+        }
+    }
+    if(victim < 0 || largest < 2 * HTTPS_PARALLEL_MIN_SPLIT || job->segment_count >= job->segment_max)
+        return -1;
+
+    seg = &job->segments[victim];
+    tail = &job->segments[job->segment_count];
+    tail->pos = seg->pos + largest / 2;
+    tail->end = seg->end;
+    tail->active = 0;
+    seg->end = tail->pos;
+    return job->segment_count++;
+}
+
+// Pick the next range to fetch: an unassigned one, else the back half of
+// the largest range still in flight. Returns -1 when nothing is left or
+// the job failed.
+static int https_range_take(https_range_job_t *job)
+{
+    int i;
+
+    pthread_mutex_lock(&job->lock);
+    if(job->failed) {
+        pthread_mutex_unlock(&job->lock);
+        return -1;
+    }
+    for(i = 0; i < job->segment_count; i++) {
+        https_segment_t *seg = &job->segments[i];
+        if(!seg->active && seg->pos < seg->end)
+            break;
+    }
+    if(i == job->segment_count) {
+        i = https_range_split(job);
+        if(i >= 0)
+            SYS_LOG_DEBUG("[HTTPS] Split range %llu-%llu off a slow connection",
+                    (unsigned long long)job->segments[i].pos, (unsigned long long)job->segments[i].end);
+    }
+    if(i >= 0)
+        job->segments[i].active = 1;
+    pthread_mutex_unlock(&job->lock);
+    return i;
+}
+
+// Add the counters of one worker request to the job totals
+static void https_range_merge_stats(https_range_job_t *job, https_transfer_stats_t *ws)
+{
+    https_transfer_stats_t *stats = job->stats;
+
+    pthread_mutex_lock(&job->lock);
+    stats->body_bytes += ws->body_bytes;
+    stats->wire_bytes_in += ws->wire_bytes_in;
+    stats->wire_bytes_out += ws->wire_bytes_out;
+    stats->ssl_reads += ws->ssl_reads;
+    stats->requests += ws->requests;
+    stats->retries += ws->retries;
+    stats->handshake_retries += ws->handshake_retries;
+    stats->io_wait_us += ws->io_wait_us;
+    stats->backoff_us += ws->backoff_us;
+    stats->connect_attempts += ws->connect_attempts;
+    stats->redirects += ws->redirects;
+    stats->redirect_us += ws->redirect_us;
+    if(!stats->remote_addr[0])
+        memcpy(stats->remote_addr, ws->remote_addr, sizeof(stats->remote_addr));
+    if(ws->recv_buffer_size > stats->recv_buffer_size)
+        stats->recv_buffer_size = ws->recv_buffer_size;
+    if(ws->status_code)
+        stats->status_code = ws->status_code;
+    https_stats_fail(stats, (https_error_class_t)ws->error_class);
+    pthread_mutex_unlock(&job->lock);
+    memset(ws, 0, sizeof(*ws));
+}
+
+static void *https_range_worker(void *arg)
+{
+    https_range_job_t *job = (https_range_job_t *)arg;
+    char headers[64 + HTTPS_MAX_VALIDATOR_LEN];
+    https_transfer_stats_t ws = {0};
+    https_request_t req = {0};
+    https_range_ctx_t r;
+    int seg;
+
+    req.extra_headers = headers;
+    req.buffer_size = job->buffer_size;
+    req.on_response = https_range_on_response;
+    req.on_body = https_range_on_body;
+    req.ctx = &r;
+    req.stats = job->stats ? &ws : NULL;
+
+    while((seg = https_range_take(job)) >= 0) {
+        int attempt = 0;
+
+        for(;;) {
+            uint64_t pos, end;
+            int len, ret;
+
+            pthread_mutex_lock(&job->lock);
+            pos = job->segments[seg].pos;
+            end = job->segments[seg].end;
+            if(job->failed)
+                end = pos;
+            pthread_mutex_unlock(&job->lock);
+            if(pos >= end)
+                break;
+
+            // the end may shrink while we fetch, the body callback stops there
+            r.job = job;
+            r.seg = seg;
+            r.start = pos;
+            len = snprintf(headers, sizeof(headers), "Range: bytes=%llu-%llu\r\n",
+                    (unsigned long long)pos, (unsigned long long)(end - 1));
+            if(job->validator[0])
+                snprintf(headers + len, sizeof(headers) - len, "If-Range: %s\r\n", job->validator);
+            // only this worker advances pos of its range
+            ret = https_client_request(job->client, job->fetch_url, &req);
+            if(job->stats)
+                https_range_merge_stats(job, &ws);
+            if(ret == 0 && job->segments[seg].pos > pos)
+                continue;   // done, or stopped at a shrunken end
+
+            // a retry resumes from the last byte written; only attempts
+            // that got nothing count, a connection cut mid-body still helped
+            if(job->segments[seg].pos > pos)
+                attempt = 0;
+            else if(++attempt > HTTPS_PARALLEL_RETRIES) {
+                SYS_LOG_ERROR("[HTTPS] Range at %llu failed after %d attempts", (unsigned long long)pos, attempt);
+                pthread_mutex_lock(&job->lock);
+                job->failed = 1;
+                pthread_mutex_unlock(&job->lock);
+                break;
+            }
+            ws.retries++;
+            if(attempt > 0)
+                https_backoff(&job->client->config, attempt, req.stats);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        job->segments[seg].active = 0;
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    // the retry and backoff of the last attempt came after its merge
+    if(job->stats)
+        https_range_merge_stats(job, &ws);
+    return NULL;
+}
+
+// Fill the segment table with the gaps between the committed ranges and
+// spread them over nconn connections
+static void https_range_plan(https_range_job_t *job, const https_resume_t *prev, int nconn)
+{
+    uint64_t cursor = 0, step;
+    int i;
+
+    for(i = 0; i <= (prev ? prev->range_count : 0); i++) {
+        uint64_t next = prev && i < prev->range_count ? prev->ranges[i][0] : job->total;
+        if(next > cursor) {
+            job->segments[job->segment_count].pos = cursor;
+            job->segments[job->segment_count].end = next;
+            job->segment_count++;
+        }
+        if(prev && i < prev->range_count)
+            cursor = prev->ranges[i][1];
+    }
+
+    if(job->segment_count == 1 && nconn > 1) {
+        // a fresh download is cut into equal ranges
+        uint64_t start = job->segments[0].pos, len = job->segments[0].end - start;
+        if((uint64_t)nconn > len / HTTPS_PARALLEL_MIN_SPLIT + 1)
+            nconn = (int)(len / HTTPS_PARALLEL_MIN_SPLIT + 1);
+        step = len / (uint64_t)nconn;
+        for(i = 0; i < nconn; i++) {
+            job->segments[i].pos = start + step * (uint64_t)i;
+            job->segments[i].end = i == nconn - 1 ? start + len : start + step * (uint64_t)(i + 1);
+        }
+        job->segment_count = nconn;
+    }
+    while(job->segment_count < nconn && https_range_split(job) >= 0)
+        ;
+}
+
+// Range-based download, used for parallel and resumable downloads
+static int https_range_download(https_client_t *client, const char *url, const char *save_path,
+                                const https_download_opts_t *opts, https_progress_state_t *progress)
+{
+    https_range_job_t job;
+    https_response_t probe = {0};
+    https_resume_t prev = {0};
+    https_request_t req = {0};
+    pthread_t threads[HTTPS_PARALLEL_MAX_CONN];
+    char sidecar_path[HTTPS_MAX_PATH_LEN];
+    char probe_headers[64 + HTTPS_MAX_VALIDATOR_LEN];
+    char fetch_url[HTTPS_MAX_URL_LEN];
+    int nconn = opts->connections < 1 ? 1 : opts->connections;
+    int have_prev = 0, started = 0, i, ret = -1;
+    int mismatch = 0;
+    uint8_t expected[HTTPS_SHA256_LEN];
+    sys_file_backend_t backend;
+
+    if(nconn > HTTPS_PARALLEL_MAX_CONN)
+        nconn = HTTPS_PARALLEL_MAX_CONN;
+    if(opts->sha256 && https_sha256_parse(opts->sha256, expected) != 0) {
+        SYS_LOG_ERROR("[HTTPS] Invalid SHA-256: %s", opts->sha256);
+        return -1;
+    }
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_mutex_init(&job.save_lock, NULL);
+
+    if(opts->resume) {
+        if(snprintf(sidecar_path, sizeof(sidecar_path), "%s%s", save_path, HTTPS_RESUME_SUFFIX) >= (int)sizeof(sidecar_path)) {
+            SYS_LOG_ERROR("[HTTPS] Save path too long: %s", save_path);
+            goto https_range_download_exit;
+        }
+        have_prev = https_resume_load(sidecar_path, url, &prev) == 0;
+    }
+
+    // Ask for the first byte to learn the size and whether ranges work;
+    // the probe connection goes back to the pool for the first worker
+    i = snprintf(probe_headers, sizeof(probe_headers), "Range: bytes=0-0\r\n");
+    if(have_prev)
+        snprintf(probe_headers + i, sizeof(probe_headers) - i, "If-Range: %s\r\n",
+                https_pick_validator(prev.etag, prev.last_modified));
+    req.extra_headers = probe_headers;
+    req.on_response = https_probe_on_response;
+    req.on_body = https_discard_on_body;
+    req.ctx = &probe;
+    req.stats = opts->stats;
+    req.on_redirect = opts->redirect;
+    req.redirect_ctx = opts->redirect_ctx;
+    req.final_url = fetch_url;
+    req.final_url_size = sizeof(fetch_url);
+    if(https_client_request(client, url, &req) != 0)
+        goto https_range_download_exit;
+    if(probe.status_code != 206 || probe.range_total == 0) {
+        SYS_LOG_INFO("[HTTPS] Server does not support ranges, using a single connection");
+        if(opts->resume)
+            sys_file_remove(sidecar_path);
+        ret = https_stream_download(client, fetch_url, save_path, opts, progress);
+        goto https_range_download_exit;
+    }
+
+    job.client = client;
+    job.url = url;
+    job.fetch_url = fetch_url;
+    job.probe = &probe;
+    job.total = probe.range_total;
+    job.buffer_size = opts->buffer_size;
+    job.stats = opts->stats;
+    snprintf(job.validator, sizeof(job.validator), "%s", https_pick_validator(probe.etag, probe.last_modified));
+    if(opts->resume) {
+        job.sidecar_path = sidecar_path;
+        if(!job.validator[0])
+            SYS_LOG_INFO("[HTTPS] No ETag or Last-Modified, a partial download can't be resumed");
+    }
+
+    // the data on disk belongs to this very version of the resource
+    if(have_prev && (prev.total != job.total || strcmp(prev.etag, probe.etag) != 0 ||
+                strcmp(prev.last_modified, probe.last_modified) != 0)) {
+        SYS_LOG_INFO("[HTTPS] Resource changed since the last attempt, starting over");
+        have_prev = 0;
+    }
+    if(have_prev && sys_file_open(&job.file, save_path, SYS_FILE_OPEN_EXISTING | SYS_FILE_WRITE) != SYS_FILE_OK)
+        have_prev = 0;
+    // positioned writes at any offset rule out O_DIRECT
+    backend = opts->file_backend == SYS_FILE_BACKEND_DIRECT ? SYS_FILE_BACKEND_STDIO : (sys_file_backend_t)opts->file_backend;
+    if(!have_prev && sys_file_open_backend(&job.file, save_path, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE, backend) != SYS_FILE_OK) {
+        SYS_LOG_ERROR("[HTTPS] Cannot create file: %s", save_path);
+        https_stats_fail(opts->stats, HTTPS_ERROR_WRITE);
+        goto https_range_download_exit;
+    }
+    if(https_preallocate(&job.file, job.total, save_path) != 0) {
+        https_stats_fail(opts->stats, HTTPS_ERROR_WRITE);
+        goto https_range_download_exit;
+    }
+
+    job.segment_max = ((have_prev ? prev.range_count + 1 : 1) + nconn) * HTTPS_PARALLEL_SPLITS_PER_CONN;
+    job.segments = (https_segment_t *)sys_calloc(job.segment_max, sizeof(https_segment_t));
+    if(!job.segments) {
+        SYS_LOG_ERROR("[HTTPS] Alloc segment table failed");
+        goto https_range_download_exit;
+    }
+    https_range_plan(&job, have_prev ? &prev : NULL, nconn);
+
+    if(have_prev) {
+        uint64_t missing = 0;
+        for(i = 0; i < job.segment_count; i++)
+            missing += job.segments[i].end - job.segments[i].pos;
+        job.done_bytes = job.total - missing;
+        SYS_LOG_INFO("[HTTPS] Resuming download, %llu of %llu bytes missing", (unsigned long long)missing,
+                (unsigned long long)job.total);
+    } else {
+        SYS_LOG_INFO("[HTTPS] Download file begin, total size : %llu, %d connections", (unsigned long long)job.total, nconn);
+    }
+    if(progress && progress->fn) {
+        job.progress = progress;
+        https_progress_begin(progress, job.done_bytes, (int64_t)job.total);
+    }
+
+    if(nconn > job.segment_count)
+        nconn = job.segment_count;
+    for(i = 0; i < nconn - 1; i++) {
+        if(pthread_create(&threads[i], NULL, https_range_worker, &job) != 0) {
+            SYS_LOG_ERROR("[HTTPS] Failed to start download thread %d", i);
+            break;
+        }
+        started++;
+    }
+    // the calling thread is a worker too
+    https_range_worker(&job);
+    for(i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if(job.stats && job.meter.peak > job.stats->peak_bytes_per_sec)
+        job.stats->peak_bytes_per_sec = job.meter.peak;
+
+    ret = job.failed ? -1 : 0;
+    for(i = 0; i < job.segment_count && ret == 0; i++) {
+        if(job.segments[i].pos < job.segments[i].end)
+            ret = -1;
+    }
+
+    // ranges land out of order, so the digest comes from the finished file
+    if(ret == 0 && opts->sha256) {
+        uint8_t digest[HTTPS_SHA256_LEN];
+        if(sys_file_flush(&job.file) != SYS_FILE_OK || https_sha256_file(save_path, digest) != 0) {
+            ret = -1;
+        } else if(https_sha256_check(expected, digest, save_path) != 0) {
+            mismatch = 1;
+            ret = -1;
+            if(job.sidecar_path)
+                sys_file_remove(sidecar_path);
+        }
+    }
+
+    if(job.sidecar_path) {
+        if(ret == 0) {
+            // the data must be durable before its record goes away
+            if(sys_file_sync(&job.file) == SYS_FILE_OK)
+                sys_file_remove(sidecar_path);
+        } else if(job.validator[0] && !mismatch) {
+            https_resume_save(&job);
+        }
+    }
+
+    if(ret == 0)
+        SYS_LOG_INFO("[HTTPS] Download completed successfully: %llu bytes in %d ranges", (unsigned long long)job.total,
+                job.segment_count);
+    else if(job.progress && job.progress->cancelled)
+        SYS_LOG_INFO("[HTTPS] Range download cancelled");
+    else
+        SYS_LOG_ERROR("[HTTPS] Range download failed");
+
+https_range_download_exit:
+    sys_file_close(&job.file);
+    if(mismatch) {
+        sys_file_remove(save_path);
+        ret = HTTPS_ERR_CHECKSUM;
+    }
+    if(ret != 0 && progress && progress->cancelled)
+        ret = HTTPS_ERR_CANCELLED;
+    pthread_mutex_destroy(&job.lock);
+    pthread_mutex_destroy(&job.save_lock);
+    if(job.segments)
+        sys_free(job.segments);
+    https_resume_free(&prev);
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////
+////////////////////////// HTTPS Event Engine ///////////////////////////
+/////////////////////////////////////////////////////////////////////////
+
+typedef enum {
+    HTTPS_XFER_QUEUED,              // Waiting for a free slot
+    HTTPS_XFER_RESOLVE,             // Host lookup running on a resolver thread
+    HTTPS_XFER_CONNECT,             // Connect race in flight
+    HTTPS_XFER_HANDSHAKE,
+    HTTPS_XFER_BACKOFF,             // Waiting to retry a failed handshake on a new connection
+    HTTPS_XFER_SEND,                // Writing the request
+    HTTPS_XFER_RECEIVE,             // Reading the response through the parser
+    HTTPS_XFER_DONE                 // Finished, waiting to be collected
+} https_xfer_state_t;
+
+// One download driven by an engine. Every blocking step of
+// https_client_request() is a state here that returns to the loop instead
+// of waiting, and picks up again when epoll reports the socket ready.
+typedef struct https_transfer {
+    https_engine_t *engine;
+    https_xfer_state_t state;
+    char host[HTTPS_MAX_HOST_LEN];
+    uint16_t port;
+    char *request;
+    size_t request_len;
+    size_t sent;                    // Request bytes accepted by mbedtls_ssl_write
+    https_conn_t *conn;
+    int reused;                     // conn came from the pool
+    int attempts;                   // Handshakes started
+    https_addr_list_t addrs;        // Resolved on the first connect, count 0 until then
+    struct https_resolve_job *resolve; // Lookup running for this transfer, NULL when none
+    https_race_t race;              // Connect attempts while in HTTPS_XFER_CONNECT
+    uint32_t race_watched;          // Attempts registered with epoll, one bit each
+    int session_offered;
+    unsigned char offered_master[48];
+    uint64_t handshake_start;       // sys_get_time_us() when the TLS handshake began
+    uint32_t events;                // Registered epoll events, 0 = not registered
+    int again;                      // Stopped with data possibly left inside mbedTLS
+    uint64_t deadline_ms;           // Fails when nothing happens until then, 0 = never
+    uint64_t timer_ms;              // Stepped at this time without a socket event, 0 = not set
+    https_parser_t *parser;         // Only while receiving
+    https_request_t req;
+    https_request_state_t rstate;
+    https_sink_ctx_t sink;
+    https_file_sink_t file;         // Used by https_engine_submit_file()
+    char *save_path;
+    https_completion_t done;
+    struct https_transfer *prev;    // Active list only
+    struct https_transfer *next;
+} https_transfer_t;
+
+struct https_engine {
+    https_client_t *client;
+    int epfd;
+    int max_active;
+    int active_count;
+    int pending;                    // Submitted and not collected yet
+    https_transfer_t *queued;       // FIFO of transfers waiting for a slot
+    https_transfer_t *queued_tail;
+    https_transfer_t *active;
+    https_transfer_t *done;         // FIFO of finished transfers
+    https_transfer_t *done_tail;
+    int done_count;
+    uint8_t *buf;                   // Receive buffer shared by all transfers
+    uint32_t buf_size;
+    int resolve_pipe[2];            // Resolver threads hand finished jobs back through it
+    int resolving;                  // Jobs not handed back yet
+};
+
+// A host lookup of the engine. getaddrinfo() blocks, so a cache miss is
+// resolved on a thread of its own while the loop keeps running.
+typedef struct https_resolve_job {
+    https_client_t *client;
+    char host[HTTPS_MAX_HOST_LEN];
+    https_addr_list_t list;         // The answer, count 0 when the host did not resolve
+    int notify_fd;                  // Write end of the engine's resolve_pipe
+    https_transfer_t *transfer;     // Waiting for the answer, NULL once it is gone
+} https_resolve_job_t;
+
+static void *https_resolve_thread(void *arg)
+{
+    https_resolve_job_t *job = (https_resolve_job_t *)arg;
+    int fd = job->notify_fd;
+    ssize_t n;
+
+    https_dns_query(job->client, job->host, &job->list);
+    // the job belongs to the engine again once written, a pointer is
+    // far below PIPE_BUF so it arrives in one piece
+    do {
+        n = write(fd, &job, sizeof(job));
+    } while(n < 0 && errno == EINTR);
+    return NULL;
+}
+
+static void https_transfer_push(https_transfer_t **head, https_transfer_t **tail, https_transfer_t *t)
+{
+    t->next = NULL;
+    if(*tail)
+        (*tail)->next = t;
+    else
+        *head = t;
+    *tail = t;
+}
+
+static https_transfer_t *https_transfer_pop(https_transfer_t **head, https_transfer_t **tail)
+{
+    https_transfer_t *t = *head;
+
+    if(t) {
+        *head = t->next;
+        if(!*head)
+            *tail = NULL;
+        t->next = NULL;
+    }
+    return t;
+}
+
+static void https_transfer_free(https_transfer_t *t)
+{
+    if(t->parser)
+        sys_free(t->parser);
+    if(t->request)
+        sys_free(t->request);
+    if(t->save_path)
+        sys_free(t->save_path);
+    sys_free(t);
+}
+
+static void https_engine_touch(https_transfer_t *t)
+{
+    uint32_t timeout_ms = t->engine->client->config.read_timeout_ms;
+
+    // a backoff only ends by its timer
+    t->deadline_ms = timeout_ms && t->state != HTTPS_XFER_BACKOFF ? sys_get_time_ms() + timeout_ms : 0;
+}
+
+static int https_engine_watch(https_transfer_t *t, uint32_t events)
+{
+    struct epoll_event ev;
+
+    if(t->events == events)
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = t;
+    if(epoll_ctl(t->engine->epfd, t->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, t->conn->server_fd.fd, &ev) != 0) {
+        SYS_LOG_ERROR("[HTTPS] epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+    t->events = events;
+    return 0;
+}
+
+static void https_engine_unwatch(https_transfer_t *t)
+{
+    if(t->events && t->conn && t->conn->server_fd.fd >= 0)
+        epoll_ctl(t->engine->epfd, EPOLL_CTL_DEL, t->conn->server_fd.fd, NULL);
+    t->events = 0;
+}
+
+// Wait for the direction mbedTLS is blocked on
+static int https_engine_want(https_transfer_t *t, int ret)
+{
+    return https_engine_watch(t, ret == MBEDTLS_ERR_SSL_WANT_WRITE ? EPOLLOUT : EPOLLIN);
+}
+
+static void https_engine_drop_conn(https_transfer_t *t)
+{
+    https_engine_unwatch(t);
+    https_conn_free(t->conn);
+    t->conn = NULL;
+}
+
+// The step functions below return 0 while waiting for the socket, 1 once
+// the response is complete and negative when the transfer failed
+
+static int https_engine_begin_send(https_transfer_t *t);
+
+static int https_engine_connected(https_transfer_t *t);
+
+// Advance the connect race. epoll only tells that one of the attempts
+// changed, poll() without waiting finds out which.
+static int https_engine_race(https_transfer_t *t)
+{
+    https_race_t *race = &t->race;
+    struct epoll_event ev;
+    int ret, i;
+
+    if(race->next > 0 && poll(race->pfds, (nfds_t)race->next, 0) < 0) {
+        for(i = 0; i < race->next; i++)
+            race->pfds[i].revents = 0;
+    }
+
+    ret = https_race_step(race, t->conn, NULL);
+    if(ret < 0) {
+        SYS_LOG_ERROR("[HTTPS] Connect to %s:%d failed", t->host, t->port);
+        return -1;
+    }
+    if(ret > 0) {
+        // start the connection's own registration from scratch, the winner
+        // may or may not be watched from its attempt
+        epoll_ctl(t->engine->epfd, EPOLL_CTL_DEL, t->conn->server_fd.fd, NULL);
+        t->events = 0;
+        return https_engine_connected(t);
+    }
+
+    // watch the attempts this step started, failed ones close on their own
+    for(i = 0; i < race->next; i++) {
+        if(race->pfds[i].fd < 0 || (t->race_watched & (1u << i)))
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLOUT;
+        ev.data.ptr = t;
+        if(epoll_ctl(t->engine->epfd, EPOLL_CTL_ADD, race->pfds[i].fd, &ev) != 0) {
+            SYS_LOG_ERROR("[HTTPS] epoll_ctl failed: %s", strerror(errno));
+            https_race_close(race, -1);
+            return -1;
+        }
+        t->race_watched |= 1u << i;
+    }
+    t->timer_ms = (https_race_wake(race) + 999) / 1000;
+    return 0;
+}
+
+// Start racing connects to the resolved addresses
+static int https_engine_connect(https_transfer_t *t)
+{
+    if(!t->conn && !(t->conn = https_conn_new(t->host, t->port)))
+        return -1;
+
+    https_race_init(&t->race, &t->engine->client->config, &t->addrs);
+    t->race_watched = 0;
+    t->state = HTTPS_XFER_CONNECT;
+    return https_engine_race(t);
+}
+
+// A cache miss goes to a resolver thread, the transfer waits in
+// HTTPS_XFER_RESOLVE until https_engine_resolved() hands back the answer
+static int https_engine_resolve(https_transfer_t *t)
+{
+    https_engine_t *engine = t->engine;
+    https_resolve_job_t *job;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+
+    job = (https_resolve_job_t *)sys_calloc(1, sizeof(https_resolve_job_t));
+    if(!job) {
+        SYS_LOG_ERROR("[HTTPS] Alloc resolve job failed");
+        return -1;
+    }
+    job->client = engine->client;
+    snprintf(job->host, sizeof(job->host), "%s", t->host);
+    job->notify_fd = engine->resolve_pipe[1];
+    job->transfer = t;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, https_resolve_thread, job);
+    pthread_attr_destroy(&attr);
+    if(ret != 0) {
+        // no thread to spare, resolve in the loop after all
+        SYS_LOG_DEBUG("[HTTPS] No resolver thread for %s: %s", t->host, strerror(ret));
+        sys_free(job);
+        if(https_dns_query(engine->client, t->host, &t->addrs) != 0)
+            return -1;
+        https_dns_set_port(&t->addrs, t->port);
+        return https_engine_connect(t);
+    }
+
+    engine->resolving++;
+    t->resolve = job;
+    t->state = HTTPS_XFER_RESOLVE;
+    return 0;
+}
+
+// Take a pooled connection or resolve the host and start connecting
+static int https_engine_start(https_transfer_t *t)
+{
+    https_engine_t *engine = t->engine;
+    int ret;
+
+    t->conn = https_pool_acquire(engine->client, t->host, t->port);
+    t->reused = (t->conn != NULL);
+    if(t->conn)
+        return https_engine_begin_send(t);
+
+    if(!t->addrs.count) {
+        if((ret = https_dns_lookup(engine->client, t->host, &t->addrs)) < 0)
+            return -1;
+        if(ret == 0)
+            return https_engine_resolve(t);
+        https_dns_set_port(&t->addrs, t->port);
+    }
+    return https_engine_connect(t);
+}
+
+// A pooled connection turned out to be closed before any answer
+static int https_engine_reconnect(https_transfer_t *t)
+{
+    SYS_LOG_DEBUG("[HTTPS] Pooled connection went stale, reconnecting");
+    https_engine_drop_conn(t);
+    return https_engine_start(t);
+}
+
+// A handshake failed or stalled: give up, or retry on a new connection once
+// the backoff has passed, falling back to a full handshake. The timer wakes
+// the transfer.
+static int https_engine_handshake_failed(https_transfer_t *t, int ret)
+{
+    https_client_t *client = t->engine->client;
+    const int max_attempts = client->config.handshake_retries > 0 ? client->config.handshake_retries : 1;
+    uint64_t delay;
+
+    SYS_LOG_ERROR("[HTTPS] mbedtls_ssl_handshake attempt %d failed ret(-0x%x): %s", t->attempts, -ret,
+            https_get_ssl_error_string(ret));
+    if(t->attempts >= max_attempts) {
+        SYS_LOG_ERROR("[HTTPS] SSL handshake failed after %d attempts", max_attempts);
+        return -1;
+    }
+
+    https_engine_drop_conn(t);
+    delay = https_backoff_delay(&client->config, t->attempts);
+    SYS_LOG_DEBUG("[HTTPS] Retrying in %llu ms", (unsigned long long)delay);
+    t->state = HTTPS_XFER_BACKOFF;
+    t->timer_ms = sys_get_time_ms() + delay;
+    return 0;
+}
+
+static int https_engine_handshake(https_transfer_t *t)
+{
+    int ret = mbedtls_ssl_handshake(&t->conn->ssl);
+
+    if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+        return https_engine_want(t, ret);
+    if(ret != 0)
+        return https_engine_handshake_failed(t, ret);
+
+    https_conn_handshake_done(t->engine->client, t->conn, t->session_offered, t->offered_master, t->handshake_start);
+    return https_engine_begin_send(t);
+}
+
+// The race delivered a connected socket, put TLS on it
+static int https_engine_connected(https_transfer_t *t)
+{
+    t->handshake_start = sys_get_time_us();
+    if(https_conn_setup_tls(t->engine->client, t->conn, t->attempts == 0,
+                            &t->session_offered, t->offered_master) != 0)
+        return -1;
+    t->attempts++;
+    t->state = HTTPS_XFER_HANDSHAKE;
+    return https_engine_handshake(t);
+}
+
+static int https_engine_send(https_transfer_t *t)
+{
+    https_parser_callbacks_t callbacks;
+
+    while(t->sent < t->request_len) {
+        int ret = mbedtls_ssl_write(&t->conn->ssl, (const unsigned char *)t->request + t->sent,
+                                    t->request_len - t->sent);
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            return https_engine_want(t, ret);
+        if(ret < 0) {
+            if(t->reused)
+                return https_engine_reconnect(t);
+            SYS_LOG_ERROR("[HTTPS] Send HTTPS request failed");
+            return -1;
+        }
+        t->sent += (size_t)ret;
+    }
+
+    if(!t->parser && !(t->parser = (https_parser_t *)sys_malloc(sizeof(https_parser_t)))) {
+        SYS_LOG_ERROR("[HTTPS] Alloc buffer failed");
+        return -1;
+    }
+    t->rstate.parser = t->parser;
+    callbacks.on_headers = https_request_on_headers;
+    callbacks.on_body = https_request_on_body;
+    callbacks.ctx = &t->rstate;
+    https_parser_init(t->parser, &callbacks);
+
+    t->state = HTTPS_XFER_RECEIVE;
+    return https_engine_watch(t, EPOLLIN);
+}
+
+static int https_engine_begin_send(https_transfer_t *t)
+{
+    t->sent = 0;
+    t->state = HTTPS_XFER_SEND;
+    return https_engine_send(t);
+}
+
+static int https_engine_receive(https_transfer_t *t)
+{
+    https_engine_t *engine = t->engine;
+    https_parser_t *parser = t->parser;
+    int budget = HTTPS_ENGINE_READ_BUDGET;
+
+    t->again = 0;
+    while(budget-- > 0) {
+        int ret = mbedtls_ssl_read(&t->conn->ssl, engine->buf, engine->buf_size);
+        int consumed;
+
+        if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+            return https_engine_want(t, ret);
+
+        if(ret <= 0 && t->reused && parser->state == HTTPS_PARSE_STATUS_LINE && parser->line_len == 0)
+            return https_engine_reconnect(t);
+
+        if(ret == 0 || ret == MBEDTLS_ERR_SSL_CONN_EOF || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            // Connection closed by peer, this ends a read-until-close body
+            if(https_parser_finish(parser) != 0) {
+                SYS_LOG_ERROR("[HTTPS] Unexpected connection close: %llu bytes of body received",
+                        (unsigned long long)parser->body_received);
+                return -1;
+            }
+            return 1;
+        }
+        if(ret < 0) {
+            SYS_LOG_ERROR("[HTTPS] SSL read failed [%d]: %s", ret, https_get_ssl_error_string(ret));
+            return -1;
+        }
+
+        consumed = https_parser_execute(parser, engine->buf, (uint32_t)ret);
+        if(consumed < 0)
+            return -1;
+        if(consumed < ret) {
+            // more data than the response holds, the stream can't be trusted for reuse
+            SYS_LOG_DEBUG("[HTTPS] %d bytes after the end of the response", ret - consumed);
+            parser->rsp.keep_alive = 0;
+        }
+        if(parser->state == HTTPS_PARSE_DONE || parser->state == HTTPS_PARSE_STOPPED)
+            return 1;
+    }
+
+    // give the other transfers a turn; decrypted or buffered records are
+    // invisible to epoll, so this one is run again without waiting
+    t->again = 1;
+    return 0;
+}
+
+static void https_engine_finish(https_transfer_t *t, int ret)
+{
+    https_engine_t *engine = t->engine;
+    https_parser_t *parser = t->parser;
+    int keep_alive = 0;
+
+    if(parser && ret == 0 && parser->state == HTTPS_PARSE_DONE) {
+        SYS_LOG_INFO("[HTTPS] Download completed successfully: %llu bytes", (unsigned long long)parser->body_received);
+        keep_alive = parser->rsp.keep_alive;
+    } else if(parser && ret != 0 && parser->state != HTTPS_PARSE_ERROR) {
+        SYS_LOG_ERROR("[HTTPS] Download incomplete: %llu bytes of body received", (unsigned long long)parser->body_received);
+    }
+
+    if(t->rstate.began && t->req.on_end && t->req.on_end(t->req.ctx, &parser->rsp, ret) != 0 && ret == 0)
+        ret = -1;
+    sys_file_close(&t->file.file);
+
+    // the resolver thread still hands its job back, without anyone to tell
+    if(t->resolve) {
+        t->resolve->transfer = NULL;
+        t->resolve = NULL;
+    }
+    if(t->state == HTTPS_XFER_CONNECT)
+        https_race_close(&t->race, -1);
+    t->timer_ms = 0;
+
+    https_engine_unwatch(t);
+    if(t->conn) {
+        // only a connection whose response was consumed exactly can be reused
+        if(ret == 0 && keep_alive) {
+            https_pool_release(engine->client, t->conn);
+        } else {
+            https_conn_free(t->conn);
+        }
+        t->conn = NULL;
+    }
+
+    t->done.result = ret;
+    t->done.status_code = t->rstate.began ? parser->rsp.status_code : 0;
+    t->done.received = parser ? parser->body_received : 0;
+
+    // keep just the completion until it is collected
+    if(parser)
+        sys_free(parser);
+    if(t->request)
+        sys_free(t->request);
+    if(t->save_path)
+        sys_free(t->save_path);
+    t->parser = NULL;
+    t->request = NULL;
+    t->save_path = NULL;
+
+    if(t->prev)
+        t->prev->next = t->next;
+    else
+        engine->active = t->next;
+    if(t->next)
+        t->next->prev = t->prev;
+    t->prev = NULL;
+    engine->active_count--;
+
+    t->state = HTTPS_XFER_DONE;
+    https_transfer_push(&engine->done, &engine->done_tail, t);
+    engine->done_count++;
+}
+
+static void https_engine_step(https_transfer_t *t)
+{
+    int ret;
+
+    switch(t->state) {
+    case HTTPS_XFER_RESOLVE:
+        // woken by https_engine_resolved() once the lookup is back
+        if(t->resolve)
+            return;
+        ret = t->addrs.count ? https_engine_connect(t) : -1;
+        break;
+    case HTTPS_XFER_CONNECT:
+        ret = https_engine_race(t);
+        break;
+    case HTTPS_XFER_HANDSHAKE:
+        ret = https_engine_handshake(t);
+        break;
+    case HTTPS_XFER_BACKOFF:
+        // only the timer ends the wait, stale socket events don't
+        if(t->timer_ms)
+            return;
+        ret = https_engine_connect(t);
+        break;
+    case HTTPS_XFER_SEND:
+        ret = https_engine_send(t);
+        break;
+    case HTTPS_XFER_RECEIVE:
+        ret = https_engine_receive(t);
+        break;
+    default:
+        return;
+    }
+
+    if(ret != 0)
+        https_engine_finish(t, ret > 0 ? 0 : -1);
+    else
+        https_engine_touch(t);
+}
+
+// Take the finished lookups off the resolve pipe and wake their transfers
+static void https_engine_resolved(https_engine_t *engine)
+{
+    https_resolve_job_t *job;
+
+    while(read(engine->resolve_pipe[0], &job, sizeof(job)) == (ssize_t)sizeof(job)) {
+        https_transfer_t *t = job->transfer;
+
+        engine->resolving--;
+        if(t) {
+            t->resolve = NULL;
+            t->addrs = job->list;
+            https_dns_set_port(&t->addrs, t->port);
+            https_engine_step(t);
+        }
+        sys_free(job);
+    }
+}
+
+// Move queued transfers into free slots
+static void https_engine_promote(https_engine_t *engine)
+{
+    while(engine->active_count < engine->max_active && engine->queued) {
+        https_transfer_t *t = https_transfer_pop(&engine->queued, &engine->queued_tail);
+
+        t->prev = NULL;
+        t->next = engine->active;
+        if(engine->active)
+            engine->active->prev = t;
+        engine->active = t;
+        engine->active_count++;
+
+        SYS_LOG_INFO("[HTTPS] Starting download from: %s:%d", t->host, t->port);
+        https_engine_touch(t);
+        if(https_engine_start(t) != 0)
+            https_engine_finish(t, -1);
+    }
+}
+
+// The loop reads finished lookups without blocking, resolver threads
+// write theirs; the read end is watched with a NULL data pointer
+static int https_engine_setup_resolve(https_engine_t *engine)
+{
+    struct epoll_event ev;
+    int i;
+
+    if(pipe(engine->resolve_pipe) != 0)
+        return -1;
+    for(i = 0; i < 2; i++)
+        fcntl(engine->resolve_pipe[i], F_SETFD, FD_CLOEXEC);
+    if(fcntl(engine->resolve_pipe[0], F_SETFL, fcntl(engine->resolve_pipe[0], F_GETFL) | O_NONBLOCK) != 0)
+        return -1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    return epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->resolve_pipe[0], &ev);
+}
+
+https_engine_t *https_engine_create(https_client_t *client, int max_active)
+{
+    https_engine_t *engine;
+
+    if(!client) {
+        SYS_LOG_ERROR("[HTTPS] Invalid arguments");
+        return NULL;
+    }
+
+    engine = (https_engine_t *)sys_calloc(1, sizeof(https_engine_t));
+    if(!engine) {
+        SYS_LOG_ERROR("[HTTPS] Alloc engine failed");
+        return NULL;
+    }
+    engine->client = client;
+    engine->max_active = max_active > 0 ? max_active : HTTPS_ENGINE_MAX_ACTIVE;
+
+    // one transfer reads at a time, so they all share the largest buffer
+    engine->buf_size = client->config.max_buffer_size > client->config.buffer_size ?
+                       client->config.max_buffer_size : client->config.buffer_size;
+    if(engine->buf_size < HTTPS_DOWNLOAD_BUF_MIN)
+        engine->buf_size = HTTPS_DOWNLOAD_BUF_MIN;
+    engine->buf = (uint8_t *)sys_malloc(engine->buf_size);
+
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->resolve_pipe[0] = engine->resolve_pipe[1] = -1;
+    if(!engine->buf || engine->epfd < 0 || https_engine_setup_resolve(engine) != 0) {
+        SYS_LOG_ERROR("[HTTPS] Engine setup failed");
+        https_engine_destroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+static https_transfer_t *https_engine_new_transfer(https_engine_t *engine, const char *url, void *user_ctx)
+{
+    char resource[HTTPS_MAX_RESOURCE_LEN];
+    https_transfer_t *t;
+
+    t = (https_transfer_t *)sys_calloc(1, sizeof(https_transfer_t));
+    if(!t) {
+        SYS_LOG_ERROR("[HTTPS] Alloc transfer failed");
+        return NULL;
+    }
+    t->engine = engine;
+    t->port = 443;
+    if(https_parse_url(url, t->host, &t->port, resource) != 0) {
+        SYS_LOG_ERROR("[HTTPS] Failed to parse URL");
+        sys_free(t);
+        return NULL;
+    }
+    t->request = https_build_request(NULL, t->host, t->port, resource, NULL);
+    if(!t->request) {
+        sys_free(t);
+        return NULL;
+    }
+    t->request_len = strlen(t->request);
+
+    t->req.on_response = https_sink_on_response;
+    t->req.on_body = https_sink_on_body;
+    t->req.on_end = https_sink_on_end;
+    t->req.ctx = &t->sink;
+    t->rstate.req = &t->req;
+    t->done.user_ctx = user_ctx;
+    return t;
+}
+
+static void https_engine_queue(https_engine_t *engine, https_transfer_t *t)
+{
+    t->state = HTTPS_XFER_QUEUED;
+    https_transfer_push(&engine->queued, &engine->queued_tail, t);
+    engine->pending++;
+}
+
+int https_engine_submit(https_engine_t *engine, const char *url, https_sink_fn sink, void *user_ctx)
+{
+    https_transfer_t *t;
+
+    if(!engine || !url || !sink) {
+        SYS_LOG_ERROR("[HTTPS] Invalid arguments");
+        return -1;
+    }
+
+    t = https_engine_new_transfer(engine, url, user_ctx);
+    if(!t)
+        return -1;
+    t->sink.sink = sink;
+    t->sink.user_ctx = user_ctx;
+    https_engine_queue(engine, t);
+    return 0;
+}
+
+int https_engine_submit_file(https_engine_t *engine, const char *url, const char *save_path, void *user_ctx)
+{
+    https_transfer_t *t;
+
+    if(!engine || !url || !save_path) {
+        SYS_LOG_ERROR("[HTTPS] Invalid arguments");
+        return -1;
+    }
+
+    t = https_engine_new_transfer(engine, url, user_ctx);
+    if(!t)
+        return -1;
+    t->save_path = (char *)sys_malloc(strlen(save_path) + 1);
+    if(!t->save_path) {
+        SYS_LOG_ERROR("[HTTPS] Alloc transfer failed");
+        https_transfer_free(t);
+        return -1;
+    }
+    strcpy(t->save_path, save_path);
+    t->file.save_path = t->save_path;
+    t->sink.sink = https_file_sink;
+    t->sink.user_ctx = &t->file;
+    https_engine_queue(engine, t);
+    return 0;
+}
+
+int https_engine_poll(https_engine_t *engine, int timeout_ms)
+{
+    struct epoll_event events[HTTPS_ENGINE_MAX_EVENTS];
+    https_transfer_t *t, *next;
+    uint64_t now_ms;
+    int wait_ms = timeout_ms, n, i;
+
+    if(!engine)
+        return -1;
+
+    https_engine_promote(engine);
+
+    // transfers that ran out of budget go first, their data is already here
+    for(t = engine->active; t; t = next) {
+        next = t->next;
+        if(t->again)
+            https_engine_step(t);
+    }
+
+    // don't sleep on work that is ready, and wake up for the next deadline
+    now_ms = sys_get_time_ms();
+    for(t = engine->active; t; t = t->next) {
+        if(t->again) {
+            wait_ms = 0;
+            continue;
+        }
+        if(t->deadline_ms) {
+            int left = t->deadline_ms > now_ms ? (int)(t->deadline_ms - now_ms) : 0;
+            if(wait_ms < 0 || left < wait_ms)
+                wait_ms = left;
+        }
+        if(t->timer_ms) {
+            int left = t->timer_ms > now_ms ? (int)(t->timer_ms - now_ms) : 0;
+            if(wait_ms < 0 || left < wait_ms)
+                wait_ms = left;
+        }
+    }
+    if(engine->done_count > 0 || engine->active_count == 0)
+        wait_ms = 0;
+
+    n = epoll_wait(engine->epfd, events, HTTPS_ENGINE_MAX_EVENTS, wait_ms);
+    if(n < 0 && errno != EINTR) {
+        SYS_LOG_ERROR("[HTTPS] epoll_wait failed: %s", strerror(errno));
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        t = (https_transfer_t *)events[i].data.ptr;
+        if(!t)
+            https_engine_resolved(engine);
+        else if(t->state != HTTPS_XFER_DONE)
+            https_engine_step(t);
+    }
+
+    // timers: the next connect attempt, a connect deadline or a backoff
+    now_ms = sys_get_time_ms();
+    for(t = engine->active; t; t = next) {
+        next = t->next;
+        if(t->timer_ms && now_ms >= t->timer_ms) {
+            t->timer_ms = 0;
+            https_engine_step(t);
+        }
+    }
+
+    now_ms = sys_get_time_ms();
+    for(t = engine->active; t; t = next) {
+        next = t->next;
+        if(t->deadline_ms && now_ms >= t->deadline_ms) {
+            // a stalled handshake is retried like a failed one
+            if(t->state == HTTPS_XFER_HANDSHAKE && https_engine_handshake_failed(t, MBEDTLS_ERR_SSL_TIMEOUT) == 0) {
+                https_engine_touch(t);
+                continue;
+            }
+            SYS_LOG_ERROR("[HTTPS] Transfer from %s timed out", t->host);
+            https_engine_finish(t, -1);
+        }
+    }
+
+    https_engine_promote(engine);
+    return engine->done_count;
+}
+
+int https_engine_complete(https_engine_t *engine, https_completion_t *completions, int max)
+{
+    int n = 0;
+
+    if(!engine || !completions)
+        return -1;
+
+    while(n < max && engine->done) {
+        https_transfer_t *t = https_transfer_pop(&engine->done, &engine->done_tail);
+        completions[n++] = t->done;
+        engine->done_count--;
+        engine->pending--;
+        sys_free(t);
+    }
+    return n;
+}
+
+int https_engine_pending(https_engine_t *engine)
+{
+    return engine ? engine->pending : 0;
+}
+
+void https_engine_destroy(https_engine_t *engine)
+{
+    https_transfer_t *t;
+
+    if(!engine)
+        return;
+
+    // sinks that got BEGIN still get their END
+    while(engine->active)
+        https_engine_finish(engine->active, -1);
+    while((t = https_transfer_pop(&engine->queued, &engine->queued_tail)) != NULL)
+        https_transfer_free(t);
+    while((t = https_transfer_pop(&engine->done, &engine->done_tail)) != NULL)
+        sys_free(t);
+
+    // resolver threads still running write to the pipe, wait for them
+    while(engine->resolving > 0) {
+        struct pollfd pfd;
+
+        pfd.fd = engine->resolve_pipe[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            break;
+        https_engine_resolved(engine);
+    }
+    if(engine->resolve_pipe[0] >= 0)
+        close(engine->resolve_pipe[0]);
+    if(engine->resolve_pipe[1] >= 0)
+        close(engine->resolve_pipe[1]);
+
+    if(engine->epfd >= 0)
+        close(engine->epfd);
+    if(engine->buf)
+        sys_free(engine->buf);
+    sys_free(engine);
+}
+
+int https_client_download_ex(https_client_t *client, const char *url, const char *save_path,
+                             const https_download_opts_t *opts)
+{
+    https_progress_state_t progress;
+    https_progress_state_t *p = NULL;
+    int ret;
+
+    if(!client || !url || !save_path) {
+        SYS_LOG_ERROR("[HTTPS] Invalid arguments");
+        return -1;
+    }
+
+    if(opts && opts->stats) {
+        memset(opts->stats, 0, sizeof(*opts->stats));
+        opts->stats->start_us = sys_get_time_us();
+    }
+    if(opts && opts->progress) {
+        https_progress_init(&progress, opts, sys_get_time_us());
+        p = &progress;
+    }
+    if(opts && (opts->connections > 1 || opts->resume))
+        ret = https_range_download(client, url, save_path, opts, p);
+    else
+        ret = https_stream_download(client, url, save_path, opts, p);
+    // the last call always comes, with done set, whatever the outcome
+    if(p)
+        https_progress_report(p, sys_get_time_us(), 1);
+    if(opts && opts->stats)
+        https_stats_finish(opts->stats, ret);
+    return ret;
+}
+
+int https_client_download(https_client_t *client, const char *url, const char *save_path)
+{
+    return https_client_download_ex(client, url, save_path, NULL);
+}
+
+int https_client_download_to_sink(https_client_t *client, const char *url, https_sink_fn sink, void *user_ctx)
+{
+    if(!client || !url || !sink) {
+        SYS_LOG_ERROR("[HTTPS] Invalid arguments");
+        return -1;
+    }
+
+    return https_sink_download(client, url, sink, user_ctx, NULL);
+}
+
+int https_client_download_parallel(https_client_t *client, const char *url, const char *save_path, int nconn)
+{
+    https_download_opts_t opts;
+
+    https_download_opts_init(&opts);
+    opts.connections = nconn;
+    return https_client_download_ex(client, url, save_path, &opts);
+}
+
+static void https_default_client_init(void)
+{
+    https_default_client = https_client_create(NULL);
+}
+
+int https_download(char *url, const char *save_path)
+{
+    pthread_once(&https_default_client_once, https_default_client_init);
+    if(!https_default_client) {
+        SYS_LOG_ERROR("[HTTPS] Failed to create default client");
+        return -1;
+    }
+
+    return https_client_download(https_default_client, url, save_path);
+}
+
+int https_download_parallel(char *url, const char *save_path, int nconn)
+{
+    pthread_once(&https_default_client_once, https_default_client_init);
+    if(!https_default_client) {
+        SYS_LOG_ERROR("[HTTPS] Failed to create default client");
+        return -1;
+    }
+
+    return https_client_download_parallel(https_default_client, url, save_path, nconn);
+}
+
+int https_download_ex(const char *url, const char *save_path, const https_download_opts_t *opts)
+{
+    pthread_once(&https_default_client_once, https_default_client_init);
+    if(!https_default_client) {
+        SYS_LOG_ERROR("[HTTPS] Failed to create default client");
+        return -1;
+    }
+
+    return https_client_download_ex(https_default_client, url, save_path, opts);
+}
+
+int https_download_to_sink(const char *url, https_sink_fn sink, void *user_ctx)
+{
+    pthread_once(&https_default_client_once, https_default_client_init);
+    if(!https_default_client) {
+        SYS_LOG_ERROR("[HTTPS] Failed to create default client");
+        return -1;
+    }
+
+    return https_client_download_to_sink(https_default_client, url, sink, user_ctx);
+}
+
+const char *https_error_class_name(int error_class)
+{
+    static const char *const names[] = {
+        "none", "dns", "connect", "tls", "http", "protocol", "network", "write", "checksum", "cancelled", "other"
+    };
+
+    if(error_class < 0 || error_class > HTTPS_ERROR_OTHER)
+        return "other";
+    return names[error_class];
+}
+
+const char *https_sink_header(const https_sink_info_t *info, const char *name)
+{
+    if(!info || !info->response || !name)
+        return NULL;
+    return https_response_header((const https_response_t *)info->response, name);
 }
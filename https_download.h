@@ -1,21 +1,512 @@
-#ifndef HTTPS_DOWNLOAD_H
-#define HTTPS_DOWNLOAD_H
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-/**
- * Download a file from an HTTPS URL
- * 
- * @param url The HTTPS URL to download from
- * @param save_path The local path where the file should be saved
- * @return 0 on success, negative value on error
- */
-int https_download(char *url, const char *save_path);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif // HTTPS_DOWNLOAD_H
+#ifndef HTTPS_DOWNLOAD_H
+#define HTTPS_DOWNLOAD_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Reusable download context.
+ *
+ * A client owns the TLS configuration and the random number generators, so
+ * the expensive one-time setup (DRBG seeding, ssl config defaults, cipher
+ * suite selection) is paid once instead of on every download. A client may
+ * be shared by several threads; each thread lazily gets its own DRBG.
+ */
+typedef struct https_client https_client_t;
+
+#define HTTPS_ERR_CHECKSUM  (-2)    // The body arrived whole but didn't match https_download_opts_t.sha256
+#define HTTPS_ERR_CANCELLED (-3)    // The progress callback cancelled the download
+
+// Cipher suite selection of a client
+typedef enum {
+    HTTPS_TLS_PROFILE_COMPAT = 0,   // RSA key exchange with AES-CBC and 3DES, TLS 1.2, for old servers
+    HTTPS_TLS_PROFILE_FAST          // ECDHE with AES-GCM or ChaCha20-Poly1305, TLS 1.2 only
+} https_tls_profile_t;
+
+typedef struct {
+    uint32_t read_timeout_ms;   // Longest wait for the socket in a handshake, write or read, 0 = forever
+    uint32_t connect_timeout_ms; // Longest time to connect to a host over all its addresses, 0 = no limit
+    uint32_t connect_attempt_timeout_ms; // Longest wait for one address, 0 = no limit
+    uint32_t connect_attempt_delay_ms;   // Head start of an attempt before the next address is tried too
+    int handshake_retries;      // Handshake attempts before giving up
+    uint32_t backoff_base_ms;   // Delay before the first retry after a failure, doubled for each further one
+    uint32_t backoff_max_ms;    // Longest delay between retries
+    uint32_t backoff_jitter;    // Percent of each delay that is random, 0-100
+    int max_idle_connections;   // Keep-alive connections kept in the pool, 0 disables reuse
+    uint32_t idle_timeout_ms;   // Idle connections older than this are evicted
+    int session_cache_size;     // TLS sessions remembered for resumption, 0 disables resumption
+    uint32_t session_lifetime_ms; // Cached sessions older than this are not offered
+    int max_redirects;          // 301/302/303/307/308 answers followed per request, 0 = treated as errors
+    int dns_cache_size;         // Host names whose addresses are remembered, 0 resolves every connect
+    uint32_t dns_cache_ttl_ms;  // How long resolved addresses are used
+    uint32_t dns_negative_ttl_ms; // How long a name that does not exist is not looked up again, 0 = not cached
+    uint32_t buffer_size;       // Initial receive buffer size in bytes
+    uint32_t max_buffer_size;   // Receive buffer growth limit while data keeps streaming in
+    int tls_profile;            // https_tls_profile_t
+    const char *ciphersuites;   // "NAME:NAME" of mbedTLS suite names replacing the profile's list,
+                                // NULL = the profile's. Only read by https_client_create.
+} https_client_config_t;
+
+// What made a download fail, https_transfer_stats_t.error_class
+typedef enum {
+    HTTPS_ERROR_NONE = 0,
+    HTTPS_ERROR_DNS,            // The host name did not resolve
+    HTTPS_ERROR_CONNECT,        // No TCP connection could be made
+    HTTPS_ERROR_TLS,            // TLS setup or handshake failed
+    HTTPS_ERROR_HTTP,           // The server answered with a status the download can't use
+    HTTPS_ERROR_PROTOCOL,       // The response was malformed
+    HTTPS_ERROR_NETWORK,        // Send or receive failed, or the connection closed early
+    HTTPS_ERROR_WRITE,          // The body could not be stored: file or sink failure
+    HTTPS_ERROR_CHECKSUM,       // The body didn't match https_download_opts_t.sha256
+    HTTPS_ERROR_CANCELLED,      // The progress callback cancelled the download
+    HTTPS_ERROR_OTHER           // Bad arguments, allocation failures and the like
+} https_error_class_t;
+
+/**
+ * Timing and transfer figures of one download, see https_download_opts_t.stats.
+ *
+ * Phase timestamps are sys_get_time_us() values taken when the phase
+ * ended, 0 when it didn't happen: a pooled connection has no DNS, connect
+ * or handshake phase. A Range download takes its phases from the first
+ * request and sums the counters over all connections.
+ */
+typedef struct {
+    uint64_t start_us;          // The download was called
+    uint64_t dns_us;            // Host name resolved
+    uint64_t connect_us;        // TCP connection established
+    uint64_t handshake_us;      // TLS handshake completed
+    uint64_t request_us;        // Request written
+    uint64_t first_byte_us;     // Response head parsed
+    uint64_t end_us;            // Download finished, successfully or not
+    uint64_t body_bytes;        // Body bytes received
+    uint64_t wire_bytes_in;     // Bytes read from the socket: handshake, records, headers
+    uint64_t wire_bytes_out;    // Bytes written to the socket
+    uint64_t ssl_reads;         // mbedtls_ssl_read() calls
+    uint32_t recv_buffer_size;  // Largest receive buffer a request grew to
+    uint32_t requests;          // HTTP requests sent
+    uint32_t retries;           // Requests repeated on a stale pooled connection or for a failed range
+    uint32_t handshake_retries; // Failed handshake attempts that were retried
+    uint64_t io_wait_us;        // Time spent waiting for the socket to get ready
+    uint64_t backoff_us;        // Time slept before retries
+    uint32_t connect_attempts;  // TCP connects started, more than one when addresses were raced
+    uint32_t redirects;         // Redirects followed
+    uint64_t redirect_us;       // Time spent on the requests that were redirected
+    int reused_connection;      // The first request went over a pooled connection
+    int session_resumed;        // The first connection resumed a cached TLS session
+    int dns_cached;             // The first connection's addresses came from the resolver cache
+    char ciphersuite[64];       // Negotiated cipher suite, "" when no connection was made
+    char tls_version[16];       // Negotiated protocol version, e.g. "TLSv1.2"
+    char remote_addr[48];       // Numeric address of the first connection, "" when none was made
+    double avg_bytes_per_sec;   // Body bytes from the first byte to the end
+    double peak_bytes_per_sec;  // Best rate over a 100 ms window
+    uint32_t status_code;       // Status of the last response, 0 when none arrived
+    int error_class;            // https_error_class_t of the first failure, HTTPS_ERROR_NONE on success
+} https_transfer_stats_t;
+
+// Where a download stands, see https_download_opts_t.progress
+typedef struct {
+    uint64_t bytes;             // Body bytes on disk, including those of a resumed download
+    int64_t total;              // Size of the file, -1 when not known in advance
+    double rate;                // Bytes per second since the previous call
+    double smoothed_rate;       // Moving average of rate over a few seconds
+    double eta_seconds;         // Time left at the smoothed rate, -1 when not known
+    uint64_t elapsed_us;        // Since the download was called
+    int done;                   // Last call, made once the download has finished or failed
+} https_progress_t;
+
+/**
+ * Receives the progress of a download
+ *
+ * Called on a download thread, one call at a time, at most every
+ * progress_interval_ms or progress_bytes, and once more with done set.
+ *
+ * @param user_ctx https_download_opts_t.progress_ctx
+ * @param progress Where the download stands
+ * @return 0 to go on, non-zero to cancel the download with HTTPS_ERR_CANCELLED
+ */
+typedef int (*https_progress_fn)(void *user_ctx, const https_progress_t *progress);
+
+// A redirect about to be followed, see https_download_opts_t.redirect
+typedef struct {
+    uint32_t status_code;       // 301, 302, 303, 307 or 308
+    const char *from;           // URL that answered with the redirect
+    const char *to;             // Absolute URL requested next
+    uint32_t hop;               // 1 for the first redirect of the download
+    uint64_t elapsed_us;        // Time spent on the request that was redirected
+    int same_connection;        // The next request goes over the same connection
+} https_redirect_t;
+
+/**
+ * Told about each redirect of a download, in order, so the chain can be
+ * logged or checked. The strings are only valid during the call.
+ *
+ * @param user_ctx https_download_opts_t.redirect_ctx
+ * @param redirect The hop about to be made
+ * @return 0 to follow it, non-zero to fail the download instead
+ */
+typedef int (*https_redirect_fn)(void *user_ctx, const https_redirect_t *redirect);
+
+typedef struct {
+    uint32_t buffer_size;       // Initial receive buffer size, 0 = client default
+    int connections;            // Parallel Range connections, 0 or 1 = single stream
+    int resume;                 // Continue a partial download recorded in "<save_path>.resume"
+    int write_buffers;          // Write-behind ring for single-stream downloads, 0 = write synchronously
+    uint32_t write_buffer_size; // Bytes per write-behind buffer, 0 = 1 MB
+    int file_backend;           // sys_file_backend_t of the saved file, 0 = stdio
+    const char *sha256;         // Expected SHA-256 of the body as 64 hex digits, NULL = not checked
+    https_transfer_stats_t *stats; // Filled in for this download, NULL = not wanted
+    https_progress_fn progress; // Progress reports, NULL = none
+    void *progress_ctx;         // Passed to progress
+    uint32_t progress_interval_ms; // Least time between reports, 0 = 250 ms
+    uint64_t progress_bytes;    // Also report once this many bytes arrived, 0 = by time only
+    https_redirect_fn redirect; // Redirect reports, NULL = follow without telling
+    void *redirect_ctx;         // Passed to redirect
+} https_download_opts_t;
+
+typedef struct {
+    uint64_t pool_hits;         // Downloads that reused an idle connection
+    uint64_t pool_misses;       // Downloads that had to open a new connection
+    uint64_t pool_evictions;    // Idle connections dropped as dead, expired or over capacity
+    uint32_t pool_idle;         // Connections currently idle in the pool
+    uint64_t tls_full_handshakes;    // Handshakes that negotiated a new session
+    uint64_t tls_resumed_handshakes; // Handshakes that resumed a cached session
+    uint64_t tls_handshake_us;  // Time spent in successful handshakes, both kinds
+    uint64_t write_wait_us;     // Time downloads waited for a free write-behind buffer
+    uint64_t writer_idle_us;    // Time write-behind threads waited for data
+    uint64_t dns_cache_hits;    // Connects whose addresses came from the resolver cache
+    uint64_t dns_negative_hits; // Connects failed from a cached "no such name"
+    uint64_t dns_cache_misses;  // Connects that had to ask the resolver
+    uint64_t dns_resolves;      // getaddrinfo() calls, https_client_resolve() included
+    uint64_t dns_resolve_us;    // Time spent in them
+} https_client_stats_t;
+
+typedef enum {
+    HTTPS_SINK_BEGIN,           // Response head parsed, before any body data
+    HTTPS_SINK_DATA,            // A run of body bytes
+    HTTPS_SINK_END              // Transfer finished, info->result tells how
+} https_sink_event_t;
+
+typedef struct {
+    uint32_t status_code;
+    int64_t content_length;     // Body size, -1 when not known in advance (chunked or until close)
+    const char *etag;           // "" when absent
+    const char *last_modified;  // "" when absent
+    uint64_t received;          // Body bytes delivered before this event
+    int result;                 // HTTPS_SINK_END only: 0 if the body is complete, negative on error
+    const void *response;       // Parsed head, read it through https_sink_header()
+} https_sink_info_t;
+
+/**
+ * Receives a download as a stream of events
+ *
+ * BEGIN comes once the response head is parsed, then DATA for each run of
+ * body bytes in order, then END. END is delivered whenever BEGIN was, also
+ * when the transfer fails, so the sink can release what it holds. Data
+ * points into the library's receive buffer and is only valid during the
+ * call. Returning non-zero aborts the download.
+ */
+typedef int (*https_sink_fn)(void *user_ctx, https_sink_event_t event, const https_sink_info_t *info,
+                             const uint8_t *data, uint32_t len);
+
+/**
+ * Event-driven engine running many downloads from one thread.
+ *
+ * Every connection is non-blocking and every phase of a transfer (connect,
+ * TLS handshake, request, response) is a resumable state driven by epoll,
+ * so hundreds of downloads share one thread and one receive buffer. Host
+ * lookups that miss the DNS cache run on short-lived resolver threads.
+ * Connections, TLS sessions and counters come from the client, so the pool
+ * is shared with blocking downloads. An engine must only be used by the
+ * thread that created it.
+ */
+typedef struct https_engine https_engine_t;
+
+typedef struct {
+    void *user_ctx;             // As given to the submit call
+    int result;                 // 0 on success, negative value on error
+    uint32_t status_code;       // HTTP status, 0 when no response arrived
+    uint64_t received;          // Body bytes received
+} https_completion_t;
+
+/**
+ * Fill a client configuration with the library defaults
+ *
+ * @param config The configuration to initialize
+ */
+void https_client_config_init(https_client_config_t *config);
+
+/**
+ * Create a download client
+ *
+ * The first call points the mbedTLS allocator at sys_calloc/sys_free when
+ * mbedTLS is built with MBEDTLS_PLATFORM_MEMORY, so an application that
+ * uses mbedTLS itself should create a client before anything else.
+ *
+ * @param config Client configuration, or NULL for the defaults
+ * @return The new client, or NULL on error
+ */
+https_client_t *https_client_create(const https_client_config_t *config);
+
+/**
+ * Download a file from an HTTPS URL using an existing client
+ *
+ * @param client The client created by https_client_create()
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @return 0 on success, negative value on error
+ */
+int https_client_download(https_client_t *client, const char *url, const char *save_path);
+
+/**
+ * Fill per-download options with the defaults (everything inherited from the client)
+ *
+ * @param opts The options to initialize
+ */
+void https_download_opts_init(https_download_opts_t *opts);
+
+/**
+ * Download a file from an HTTPS URL with per-download options
+ *
+ * With opts->resume set, progress is kept in a sidecar file next to
+ * save_path (URL, ETag/Last-Modified, size and the byte ranges already on
+ * disk), saved every few megabytes after the data has been synced. A later
+ * call with the same URL and path fetches only the missing ranges, using
+ * If-Range so a changed resource is downloaded again from scratch. The
+ * sidecar is removed once the download completes.
+ *
+ * With opts->write_buffers set, a single-stream download copies the body
+ * into a ring of that many buffers and a writer thread drains them to the
+ * file, so disk stalls don't stop the network reads. The download waits
+ * only when all buffers are full, and fails if a write fails.
+ *
+ * opts->file_backend picks how the file is written: stdio, large write(2)
+ * calls, O_DIRECT past the page cache, io_uring with several writes in
+ * flight, or stores into a mapping of the file (see sys_file_open_backend()).
+ * Parallel downloads write at arbitrary offsets and use stdio instead of
+ * O_DIRECT. When the size is known the whole file is preallocated before
+ * the body is read, so a full disk fails the download up front.
+ *
+ * With opts->sha256 set, a single-stream download hashes the body as it
+ * streams through the receive buffer. Parallel and resumed downloads
+ * receive the file out of order and hash it once it is complete. On a
+ * mismatch the file is deleted and HTTPS_ERR_CHECKSUM is returned.
+ *
+ * opts->stats, when set, is filled with the phase timestamps and counters
+ * of this download, whether it succeeds or fails.
+ *
+ * opts->progress, when set, is called as the body arrives and can cancel
+ * the download. A cancelled download keeps what it wrote, and with
+ * opts->resume set it can be continued later.
+ *
+ * @param client The client created by https_client_create()
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @param opts Per-download options, or NULL for the defaults
+ * @return 0 on success, negative value on error
+ */
+int https_client_download_ex(https_client_t *client, const char *url, const char *save_path,
+                             const https_download_opts_t *opts);
+
+/**
+ * Stream a download into a sink instead of a file
+ *
+ * @param client The client created by https_client_create()
+ * @param url The HTTPS URL to download from
+ * @param sink Receives the BEGIN, DATA and END events
+ * @param user_ctx Passed to every sink call
+ * @return 0 on success, negative value on error or when the sink aborted
+ */
+int https_client_download_to_sink(https_client_t *client, const char *url, https_sink_fn sink, void *user_ctx);
+
+/**
+ * Look up a response header from within a sink
+ *
+ * @param info The info passed to the sink
+ * @param name Header name, compared case-insensitively
+ * @return The header value, or NULL when absent. Valid until the sink returns.
+ */
+const char *https_sink_header(const https_sink_info_t *info, const char *name);
+
+/**
+ * Download a file over several connections at once
+ *
+ * The size is probed with a one-byte Range request, then the file is split
+ * into nconn byte ranges fetched by as many threads and written in place.
+ * A connection that finishes early takes over half of the largest range
+ * still in flight, so one slow connection doesn't hold up the download.
+ * Servers that ignore Range get a plain single-stream download.
+ *
+ * @param client The client created by https_client_create()
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @param nconn Number of connections, 1 or less downloads in a single stream
+ * @return 0 on success, negative value on error
+ */
+int https_client_download_parallel(https_client_t *client, const char *url, const char *save_path, int nconn);
+
+/**
+ * Create an event-driven download engine on top of a client
+ *
+ * @param client The client providing TLS setup, the connection pool and stats
+ * @param max_active Transfers in flight at once, more are queued; 0 = default (256)
+ * @return The new engine, or NULL on error
+ */
+https_engine_t *https_engine_create(https_client_t *client, int max_active);
+
+/**
+ * Queue a download into a sink
+ *
+ * Nothing happens before the next https_engine_poll(), which also delivers
+ * all sink events.
+ *
+ * @param engine The engine
+ * @param url The HTTPS URL to download from
+ * @param sink Receives the BEGIN, DATA and END events
+ * @param user_ctx Passed to every sink call and returned in the completion
+ * @return 0 if the download was queued, negative value on error
+ */
+int https_engine_submit(https_engine_t *engine, const char *url, https_sink_fn sink, void *user_ctx);
+
+/**
+ * Queue a download into a file
+ *
+ * @param engine The engine
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @param user_ctx Returned in the completion
+ * @return 0 if the download was queued, negative value on error
+ */
+int https_engine_submit_file(https_engine_t *engine, const char *url, const char *save_path, void *user_ctx);
+
+/**
+ * Run the engine: start queued transfers, wait for socket readiness and
+ * advance every transfer that can make progress
+ *
+ * @param engine The engine
+ * @param timeout_ms Longest wait for activity, negative waits until
+ *        something happens; returns at once when completions are waiting
+ * @return Number of completions ready for https_engine_complete(),
+ *         negative value on error
+ */
+int https_engine_poll(https_engine_t *engine, int timeout_ms);
+
+/**
+ * Collect finished transfers, oldest first
+ *
+ * @param engine The engine
+ * @param completions Filled with up to max completions
+ * @param max Capacity of completions
+ * @return Number of completions stored
+ */
+int https_engine_complete(https_engine_t *engine, https_completion_t *completions, int max);
+
+/**
+ * Count transfers that were submitted and not collected yet
+ *
+ * @param engine The engine
+ * @return Queued, running and uncollected transfers
+ */
+int https_engine_pending(https_engine_t *engine);
+
+/**
+ * Destroy an engine, failing the transfers still running
+ *
+ * Sinks that got BEGIN receive END with an error first. Host lookups still
+ * running are waited for, they use the client.
+ *
+ * @param engine The engine to destroy, may be NULL
+ */
+void https_engine_destroy(https_engine_t *engine);
+
+/**
+ * Short name of an error class for logs and metrics
+ *
+ * @param error_class A https_error_class_t value
+ * @return "none", "dns", "connect", "tls", "http", "protocol", "network",
+ *         "write", "checksum", "cancelled" or "other"
+ */
+const char *https_error_class_name(int error_class);
+
+/**
+ * Resolve a host now and cache its addresses
+ *
+ * Looks the name up even when it is cached, so it also refreshes an
+ * entry before it expires. Downloads from the host then connect without
+ * waiting for the resolver until dns_cache_ttl_ms has passed.
+ *
+ * @param client The client whose cache is filled
+ * @param host Host name or numeric address
+ * @return 0 if the host resolved, -1 otherwise
+ */
+int https_client_resolve(https_client_t *client, const char *host);
+
+/**
+ * Get a snapshot of the client's counters
+ *
+ * @param client The client to query
+ * @param stats Filled with the current counters
+ */
+void https_client_get_stats(https_client_t *client, https_client_stats_t *stats);
+
+/**
+ * Destroy a client and release everything it owns
+ *
+ * @param client The client to destroy, may be NULL
+ */
+void https_client_destroy(https_client_t *client);
+
+/**
+ * Download a file from an HTTPS URL
+ *
+ * Uses a process-wide client that is created on first use.
+ *
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @return 0 on success, negative value on error
+ */
+int https_download(char *url, const char *save_path);
+
+/**
+ * Download a file from an HTTPS URL over several connections
+ *
+ * Uses the same process-wide client as https_download().
+ *
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @param nconn Number of connections, see https_client_download_parallel()
+ * @return 0 on success, negative value on error
+ */
+int https_download_parallel(char *url, const char *save_path, int nconn);
+
+/**
+ * Stream a download into a sink
+ *
+ * Uses the same process-wide client as https_download().
+ *
+ * @param url The HTTPS URL to download from
+ * @param sink Receives the BEGIN, DATA and END events
+ * @param user_ctx Passed to every sink call
+ * @return 0 on success, negative value on error or when the sink aborted
+ */
+int https_download_to_sink(const char *url, https_sink_fn sink, void *user_ctx);
+
+/**
+ * Download a file from an HTTPS URL with per-download options
+ *
+ * Uses the same process-wide client as https_download().
+ *
+ * @param url The HTTPS URL to download from
+ * @param save_path The local path where the file should be saved
+ * @param opts Per-download options, or NULL for the defaults
+ * @return 0 on success, negative value on error
+ */
+int https_download_ex(const char *url, const char *save_path, const https_download_opts_t *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTPS_DOWNLOAD_H
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "system_abstraction.h"
+#include "https_parser.h"
+
+static int https_parser_fail(https_parser_t *parser, const char *reason)
+{
+    SYS_LOG_ERROR("[HTTPS] Malformed response: %s", reason);
+    parser->state = HTTPS_PARSE_ERROR;
+    return -1;
+}
+
+// Case-insensitive search for a token inside a header value
+static int https_value_has(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    for(; *value; value++) {
+        if(strncasecmp(value, token, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int https_parse_status_line(https_parser_t *parser)
+{
+    const char *line = parser->line;
+    char *end;
+    unsigned long code;
+
+    // HTTP/1.x SSS Reason
+    if(strncmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') || line[8] != ' ')
+        return https_parser_fail(parser, "bad status line");
+    code = strtoul(line + 9, &end, 10);
+    if(end != line + 12 || (*end != ' ' && *end != '\0') || code < 100 || code > 999)
+        return https_parser_fail(parser, "bad status code");
+
+    memset(&parser->rsp, 0, offsetof(https_response_t, headers));
+    parser->rsp.status_code = (uint32_t)code;
+    parser->rsp.keep_alive = line[7] == '1';    // HTTP/1.0 closes unless asked otherwise
+    parser->has_length = 0;
+    parser->chunked = 0;
+    parser->interim = code < 200;
+    parser->state = HTTPS_PARSE_HEADER_LINE;
+    return 0;
+}
+
+static int https_parse_header_line(https_parser_t *parser)
+{
+    https_response_t *rsp = &parser->rsp;
+    char *name = parser->line, *value, *end;
+
+    // obsolete line folding, the continuation is ignored
+    if(name[0] == ' ' || name[0] == '\t')
+        return 0;
+    value = strchr(name, ':');
+    if(!value || value == name)
+        return https_parser_fail(parser, "bad header line");
+    *value++ = '\0';
+    while(*value == ' ' || *value == '\t')
+        value++;
+    end = value + strlen(value);
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+
+    size_t name_len = strlen(name) + 1, value_len = (size_t)(end - value) + 1;
+    if(rsp->headers_len + name_len + value_len <= sizeof(rsp->headers)) {
+        memcpy(rsp->headers + rsp->headers_len, name, name_len);
+        memcpy(rsp->headers + rsp->headers_len + name_len, value, value_len);
+        rsp->headers_len += (uint32_t)(name_len + value_len);
+    }
+
+    if(strcasecmp(name, "Content-Length") == 0) {
+        unsigned long long len = strtoull(value, &end, 10);
+        if(end == value || *end != '\0' || len > INT64_MAX ||
+                (parser->has_length && len != rsp->content_length))
+            return https_parser_fail(parser, "bad Content-Length");
+        rsp->content_length = len;
+        parser->has_length = 1;
+    } else if(strcasecmp(name, "Transfer-Encoding") == 0) {
+        if(https_value_has(value, "chunked"))
+            parser->chunked = 1;
+    } else if(strcasecmp(name, "Connection") == 0) {
+        if(https_value_has(value, "close"))
+            rsp->keep_alive = 0;
+        else if(https_value_has(value, "keep-alive"))
+            rsp->keep_alive = 1;
+    } else if(strcasecmp(name, "Content-Range") == 0) {
+        unsigned long long first, last, total;
+        if(sscanf(value, "bytes %llu-%llu/%llu", &first, &last, &total) == 3) {
+            rsp->range_start = first;
+            rsp->range_total = total;
+        }
+    } else if(strcasecmp(name, "ETag") == 0) {
+        snprintf(rsp->etag, sizeof(rsp->etag), "%s", value);
+    } else if(strcasecmp(name, "Last-Modified") == 0) {
+        snprintf(rsp->last_modified, sizeof(rsp->last_modified), "%s", value);
+    }
+    return 0;
+}
+
+// The empty line after the headers: decide how the body is delimited
+static int https_parse_head_end(https_parser_t *parser)
+{
+    https_response_t *rsp = &parser->rsp;
+    int ret;
+
+    if(parser->interim) {
+        // 100 Continue and friends, the real response follows
+        parser->state = HTTPS_PARSE_STATUS_LINE;
+        return 0;
+    }
+
+    if(rsp->status_code == 204 || rsp->status_code == 304) {
+        rsp->body_mode = HTTPS_BODY_NONE;
+    } else if(parser->chunked) {
+        // chunked wins over a Content-Length sent alongside
+        rsp->body_mode = HTTPS_BODY_CHUNKED;
+    } else if(parser->has_length) {
+        rsp->body_mode = rsp->content_length > 0 ? HTTPS_BODY_LENGTH : HTTPS_BODY_NONE;
+    } else {
+        rsp->body_mode = HTTPS_BODY_CLOSE;
+        rsp->keep_alive = 0;
+    }
+
+    ret = parser->cb.on_headers ? parser->cb.on_headers(parser->cb.ctx, rsp) : 0;
+    if(ret < 0) {
+        parser->state = HTTPS_PARSE_ERROR;
+        return -1;
+    }
+
+    switch(rsp->body_mode) {
+    case HTTPS_BODY_NONE:
+        parser->state = HTTPS_PARSE_DONE;
+        return 0;
+    case HTTPS_BODY_CHUNKED:
+        parser->state = HTTPS_PARSE_CHUNK_SIZE;
+        break;
+    case HTTPS_BODY_LENGTH:
+        parser->remaining = rsp->content_length;
+        parser->state = HTTPS_PARSE_BODY;
+        break;
+    case HTTPS_BODY_CLOSE:
+        parser->state = HTTPS_PARSE_BODY;
+        break;
+    }
+    if(ret > 0)
+        parser->state = HTTPS_PARSE_STOPPED;
+    return 0;
+}
+
+static int https_parse_chunk_size(https_parser_t *parser)
+{
+    char *end;
+    unsigned long long size = strtoull(parser->line, &end, 16);
+
+    if(end == parser->line || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t') || size > INT64_MAX)
+        return https_parser_fail(parser, "bad chunk size");
+    if(size == 0) {
+        parser->state = HTTPS_PARSE_TRAILER;
+    } else {
+        parser->remaining = size;
+        parser->state = HTTPS_PARSE_CHUNK_DATA;
+    }
+    return 0;
+}
+
+// A complete line sits in parser->line, without its CRLF
+static int https_parse_line(https_parser_t *parser)
+{
+    switch(parser->state) {
+    case HTTPS_PARSE_STATUS_LINE:
+        return https_parse_status_line(parser);
+    case HTTPS_PARSE_HEADER_LINE:
+        if(parser->line_len == 0)
+            return https_parse_head_end(parser);
+        return https_parse_header_line(parser);
+    case HTTPS_PARSE_CHUNK_SIZE:
+        return https_parse_chunk_size(parser);
+    case HTTPS_PARSE_CHUNK_END:
+        if(parser->line_len != 0)
+            return https_parser_fail(parser, "missing CRLF after chunk");
+        parser->state = HTTPS_PARSE_CHUNK_SIZE;
+        return 0;
+    case HTTPS_PARSE_TRAILER:
+        // trailer fields are not used, the empty line ends the response
+        if(parser->line_len == 0)
+            parser->state = HTTPS_PARSE_DONE;
+        return 0;
+    default:
+        return https_parser_fail(parser, "unexpected line");
+    }
+}
+
+void https_parser_init(https_parser_t *parser, const https_parser_callbacks_t *cb)
+{
+    memset(parser, 0, offsetof(https_parser_t, line));
+    parser->line[0] = '\0';
+    if(cb)
+        parser->cb = *cb;
+    parser->state = HTTPS_PARSE_STATUS_LINE;
+}
+
+int https_parser_execute(https_parser_t *parser, const uint8_t *data, uint32_t len)
+{
+    uint32_t i = 0;
+
+    while(i < len) {
+        switch(parser->state) {
+        case HTTPS_PARSE_STATUS_LINE:
+        case HTTPS_PARSE_HEADER_LINE:
+        case HTTPS_PARSE_CHUNK_SIZE:
+        case HTTPS_PARSE_CHUNK_END:
+        case HTTPS_PARSE_TRAILER: {
+            const uint8_t *nl = (const uint8_t *)memchr(data + i, '\n', len - i);
+            uint32_t n = nl ? (uint32_t)(nl - (data + i)) : len - i;
+
+            if(parser->line_len + n >= sizeof(parser->line))
+                return https_parser_fail(parser, "line too long");
+            if(parser->state == HTTPS_PARSE_STATUS_LINE || parser->state == HTTPS_PARSE_HEADER_LINE) {
+                parser->head_len += n + 1;
+                if(parser->head_len > HTTPS_PARSER_MAX_HEAD)
+                    return https_parser_fail(parser, "response head too long");
+            }
+            memcpy(parser->line + parser->line_len, data + i, n);
+            parser->line_len += n;
+            i += n;
+            if(!nl)
+                break;  // the rest of the line comes with the next fragment
+
+            i++;
+            if(parser->line_len > 0 && parser->line[parser->line_len - 1] == '\r')
+                parser->line_len--;
+            parser->line[parser->line_len] = '\0';
+            if(https_parse_line(parser) != 0)
+                return -1;
+            parser->line_len = 0;
+            break;
+        }
+
+        case HTTPS_PARSE_BODY:
+        case HTTPS_PARSE_CHUNK_DATA: {
+            uint32_t n = len - i;
+            int ret;
+
+            if(parser->rsp.body_mode != HTTPS_BODY_CLOSE && n > parser->remaining)
+                n = (uint32_t)parser->remaining;
+            ret = parser->cb.on_body ? parser->cb.on_body(parser->cb.ctx, data + i, n) : 0;
+            if(ret < 0) {
+                parser->state = HTTPS_PARSE_ERROR;
+                return -1;
+            }
+            i += n;
+            parser->body_received += n;
+            if(parser->rsp.body_mode != HTTPS_BODY_CLOSE) {
+                parser->remaining -= n;
+                if(parser->remaining == 0)
+                    parser->state = parser->state == HTTPS_PARSE_CHUNK_DATA ? HTTPS_PARSE_CHUNK_END : HTTPS_PARSE_DONE;
+            }
+            // stopping right at the end still leaves a clean connection
+            if(ret > 0 && parser->state != HTTPS_PARSE_DONE)
+                parser->state = HTTPS_PARSE_STOPPED;
+            break;
+        }
+
+        case HTTPS_PARSE_DONE:
+        case HTTPS_PARSE_STOPPED:
+            return (int)i;
+
+        default:
+            return -1;
+        }
+    }
+
+    return (int)i;
+}
+
+const char *https_response_header(const https_response_t *rsp, const char *name)
+{
+    uint32_t off = 0;
+
+    while(off < rsp->headers_len) {
+        const char *n = rsp->headers + off;
+        const char *v = n + strlen(n) + 1;
+        if(strcasecmp(n, name) == 0)
+            return v;
+        off = (uint32_t)(v + strlen(v) + 1 - rsp->headers);
+    }
+    return NULL;
+}
+
+int https_parser_finish(https_parser_t *parser)
+{
+    if(parser->state == HTTPS_PARSE_BODY && parser->rsp.body_mode == HTTPS_BODY_CLOSE)
+        parser->state = HTTPS_PARSE_DONE;
+    return parser->state == HTTPS_PARSE_DONE ? 0 : -1;
+}
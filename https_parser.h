@@ -0,0 +1,121 @@
+#ifndef HTTPS_PARSER_H
+#define HTTPS_PARSER_H
+
+// Incremental HTTP/1.1 response parser, internal to the download library
+//
+// Fragments of the response are fed in as they arrive, split anywhere.
+// Every byte is looked at once: head lines are collected in a small line
+// buffer, body bytes are handed to the body callback straight out of the
+// caller's buffer without another copy.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTPS_PARSER_MAX_LINE      8192           // Longest status, header or chunk-size line
+#define HTTPS_PARSER_MAX_HEAD      (64 * 1024)    // Longest response head
+#define HTTPS_MAX_VALIDATOR_LEN    128            // ETag and Last-Modified values
+#define HTTPS_PARSER_HEADER_STORE  4096           // Header lines kept for lookup, later ones are dropped
+
+typedef enum {
+    HTTPS_BODY_NONE,            // No body: 204, 304 or Content-Length: 0
+    HTTPS_BODY_LENGTH,          // Content-Length bytes
+    HTTPS_BODY_CHUNKED,         // Transfer-Encoding: chunked
+    HTTPS_BODY_CLOSE            // Everything until the server closes the connection
+} https_body_mode_t;
+
+// Parsed response head
+typedef struct {
+    uint32_t status_code;
+    https_body_mode_t body_mode;
+    uint64_t content_length;        // Valid for HTTPS_BODY_LENGTH
+    int keep_alive;                 // The connection can carry another request afterwards
+    uint64_t range_start;           // From Content-Range of a 206 response
+    uint64_t range_total;           // Full resource size from Content-Range, 0 = none
+    char etag[HTTPS_MAX_VALIDATOR_LEN];
+    char last_modified[HTTPS_MAX_VALIDATOR_LEN];
+    uint32_t headers_len;
+    char headers[HTTPS_PARSER_HEADER_STORE];   // "name\0value\0" pairs
+} https_response_t;
+
+// Callbacks return 0 to go on, 1 to stop parsing, negative to fail
+typedef struct {
+    int (*on_headers)(void *ctx, const https_response_t *rsp);
+    int (*on_body)(void *ctx, const uint8_t *data, uint32_t len);
+    void *ctx;
+} https_parser_callbacks_t;
+
+typedef enum {
+    HTTPS_PARSE_STATUS_LINE,
+    HTTPS_PARSE_HEADER_LINE,
+    HTTPS_PARSE_BODY,               // Content-Length or read-until-close body
+    HTTPS_PARSE_CHUNK_SIZE,
+    HTTPS_PARSE_CHUNK_DATA,
+    HTTPS_PARSE_CHUNK_END,          // CRLF after the chunk data
+    HTTPS_PARSE_TRAILER,
+    HTTPS_PARSE_DONE,               // The whole response was consumed
+    HTTPS_PARSE_STOPPED,            // A callback stopped the parser early
+    HTTPS_PARSE_ERROR
+} https_parse_state_t;
+
+typedef struct {
+    https_response_t rsp;
+    https_parser_callbacks_t cb;
+    https_parse_state_t state;
+    uint64_t remaining;             // Bytes left of the body or the current chunk
+    uint64_t body_received;         // Body bytes handed to on_body so far
+    uint32_t head_len;
+    int has_length;
+    int chunked;
+    int interim;                    // Skipping a 1xx response
+    uint32_t line_len;
+    char line[HTTPS_PARSER_MAX_LINE];
+} https_parser_t;
+
+/**
+ * Prepare a parser for a new response
+ *
+ * @param parser The parser to initialize
+ * @param cb Callbacks for the parsed head and the body bytes
+ */
+void https_parser_init(https_parser_t *parser, const https_parser_callbacks_t *cb);
+
+/**
+ * Feed the next fragment of the response
+ *
+ * Parsing ends at the end of the response or when a callback stops it, so
+ * fewer than len bytes are consumed if data follows the response.
+ *
+ * @param parser The parser
+ * @param data The received bytes
+ * @param len Number of received bytes
+ * @return Number of bytes consumed, negative value on a malformed response
+ *         or a failing callback
+ */
+int https_parser_execute(https_parser_t *parser, const uint8_t *data, uint32_t len);
+
+/**
+ * Look up a response header
+ *
+ * @param rsp The parsed response head
+ * @param name Header name, compared case-insensitively
+ * @return The value of the first header with that name, or NULL
+ */
+const char *https_response_header(const https_response_t *rsp, const char *name);
+
+/**
+ * Tell the parser that the connection reached end of stream
+ *
+ * @param parser The parser
+ * @return 0 if the response is complete, which ends a read-until-close
+ *         body, negative value if the response was cut short
+ */
+int https_parser_finish(https_parser_t *parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTPS_PARSER_H
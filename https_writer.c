@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "system_abstraction.h"
+#include "https_writer.h"
+
+// Buffers are used in ring order: the writer drains `drain` and the next
+// `queued - 1` ones, the receive loop fills the one after them
+struct https_writer {
+    sys_file_t *file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;      // Signals the writer: a buffer is full or the writer closes
+    pthread_cond_t free_cond;       // Signals the receive loop: a buffer was written
+    int count;
+    uint32_t size;
+    uint8_t **bufs;
+    uint32_t *lens;
+    int fill;                       // Buffer being filled by the receive loop
+    uint32_t fill_len;
+    int drain;                      // Next buffer for the writer
+    int queued;                     // Full buffers, including the one being written
+    int closing;
+    int failed;
+    https_writer_stats_t stats;
+};
+
+static void *https_writer_thread(void *arg)
+{
+    https_writer_t *w = (https_writer_t *)arg;
+
+    pthread_mutex_lock(&w->lock);
+    for(;;) {
+        if(w->queued == 0 && !w->closing) {
+            uint64_t start = sys_get_time_us();
+            while(w->queued == 0 && !w->closing)
+                pthread_cond_wait(&w->ready_cond, &w->lock);
+            w->stats.writer_wait_us += sys_get_time_us() - start;
+        }
+        if(w->queued == 0)
+            break;
+
+        int idx = w->drain, failed = w->failed;
+        uint32_t len = w->lens[idx], written = 0;
+        pthread_mutex_unlock(&w->lock);
+
+        // after a failure buffers are only recycled so the receive loop can't block
+        int ok = failed || (sys_file_write(w->file, w->bufs[idx], len, &written) == SYS_FILE_OK && written == len);
+
+        pthread_mutex_lock(&w->lock);
+        if(!ok) {
+            SYS_LOG_ERROR("[HTTPS] Write file failed: wrote %u/%u bytes", written, len);
+            w->failed = 1;
+        } else if(!failed) {
+            w->stats.bytes += len;
+            w->stats.writes++;
+        }
+        w->drain = (w->drain + 1) % w->count;
+        w->queued--;
+        pthread_cond_signal(&w->free_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void https_writer_free(https_writer_t *w)
+{
+    if(w->bufs) {
+        for(int i = 0; i < w->count; i++)
+            sys_free(w->bufs[i]);
+        sys_free(w->bufs);
+    }
+    if(w->lens)
+        sys_free(w->lens);
+    pthread_cond_destroy(&w->free_cond);
+    pthread_cond_destroy(&w->ready_cond);
+    pthread_mutex_destroy(&w->lock);
+    sys_free(w);
+}
+
+https_writer_t *https_writer_create(sys_file_t *file, int buffers, uint32_t buffer_size)
+{
+    https_writer_t *w;
+
+    w = (https_writer_t *)sys_calloc(1, sizeof(https_writer_t));
+    if(!w) {
+        SYS_LOG_ERROR("[HTTPS] Alloc writer failed");
+        return NULL;
+    }
+    w->file = file;
+    w->count = buffers > HTTPS_WRITER_MIN_BUFFERS ? buffers : HTTPS_WRITER_MIN_BUFFERS;
+    w->size = buffer_size > 0 ? buffer_size : HTTPS_WRITER_BUFFER_SIZE;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready_cond, NULL);
+    pthread_cond_init(&w->free_cond, NULL);
+
+    w->bufs = (uint8_t **)sys_calloc(w->count, sizeof(uint8_t *));
+    w->lens = (uint32_t *)sys_calloc(w->count, sizeof(uint32_t));
+    if(!w->bufs || !w->lens)
+        goto https_writer_create_fail;
+    for(int i = 0; i < w->count; i++) {
+        if(!(w->bufs[i] = (uint8_t *)sys_malloc(w->size)))
+            goto https_writer_create_fail;
+    }
+
+    if(pthread_create(&w->thread, NULL, https_writer_thread, w) != 0) {
+        SYS_LOG_ERROR("[HTTPS] Failed to start writer thread");
+        goto https_writer_create_fail;
+    }
+    return w;
+
+https_writer_create_fail:
+    SYS_LOG_ERROR("[HTTPS] Alloc writer buffers failed");
+    https_writer_free(w);
+    return NULL;
+}
+
+// Hand the buffer being filled to the writer; wait_for_space makes the
+// caller wait until the next buffer is free
+static int https_writer_submit(https_writer_t *w, int wait_for_space)
+{
+    int failed;
+
+    pthread_mutex_lock(&w->lock);
+    w->lens[w->fill] = w->fill_len;
+    w->queued++;
+    w->fill = (w->fill + 1) % w->count;
+    w->fill_len = 0;
+    pthread_cond_signal(&w->ready_cond);
+
+    if(wait_for_space && w->queued == w->count) {
+        // backpressure: every buffer is waiting for the disk
+        uint64_t start = sys_get_time_us();
+        while(w->queued == w->count)
+            pthread_cond_wait(&w->free_cond, &w->lock);
+        w->stats.producer_wait_us += sys_get_time_us() - start;
+    }
+    failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+
+    return failed ? -1 : 0;
+}
+
+int https_writer_write(https_writer_t *w, const uint8_t *data, uint32_t len)
+{
+    while(len > 0) {
+        uint32_t n = w->size - w->fill_len;
+        if(n > len)
+            n = len;
+        memcpy(w->bufs[w->fill] + w->fill_len, data, n);
+        w->fill_len += n;
+        data += n;
+        len -= n;
+
+        if(w->fill_len == w->size && https_writer_submit(w, 1) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int https_writer_close(https_writer_t *w, https_writer_stats_t *stats)
+{
+    int ret;
+
+    if(!w)
+        return 0;
+
+    if(w->fill_len > 0)
+        https_writer_submit(w, 0);
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_signal(&w->ready_cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    ret = w->failed ? -1 : 0;
+    if(stats)
+        *stats = w->stats;
+    https_writer_free(w);
+    return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef HTTPS_WRITER_H
+#define HTTPS_WRITER_H
+
+// Write-behind stage for file downloads, internal to the download library
+//
+// The receive loop copies body bytes into a small ring of large buffers and
+// a writer thread drains full buffers to the file, so a slow disk or an
+// fsync stall doesn't stop the network reads. When every buffer is full the
+// receive loop waits for the writer; a failed write is reported back to it
+// when it hands over its next buffer.
+
+#include <stdint.h>
+#include "system_abstraction.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HTTPS_WRITER_MIN_BUFFERS   2
+#define HTTPS_WRITER_BUFFER_SIZE   (1024 * 1024)  // Default size of one ring buffer
+
+typedef struct https_writer https_writer_t;
+
+typedef struct {
+    uint64_t bytes;                 // Bytes handed to the file
+    uint32_t writes;                // Buffers written
+    uint64_t producer_wait_us;      // Time the receive loop waited for a free buffer
+    uint64_t writer_wait_us;        // Time the writer thread waited for a full buffer
+} https_writer_stats_t;
+
+/**
+ * Start a writer thread for a file opened for writing
+ *
+ * @param file The file, written sequentially at its current position
+ * @param buffers Number of ring buffers, at least HTTPS_WRITER_MIN_BUFFERS are used
+ * @param buffer_size Bytes per buffer, 0 = HTTPS_WRITER_BUFFER_SIZE
+ * @return The writer, or NULL on error
+ */
+https_writer_t *https_writer_create(sys_file_t *file, int buffers, uint32_t buffer_size);
+
+/**
+ * Queue bytes for writing; data is copied, so it may be reused at once
+ *
+ * @param writer The writer
+ * @param data The bytes to write
+ * @param len Number of bytes
+ * @return 0 on success, negative value once a write to the file has failed
+ */
+int https_writer_write(https_writer_t *writer, const uint8_t *data, uint32_t len);
+
+/**
+ * Write what is still queued, stop the thread and free the writer
+ *
+ * @param writer The writer, may be NULL
+ * @param stats Filled with the writer's counters, may be NULL
+ * @return 0 if every byte reached the file, negative value otherwise
+ */
+int https_writer_close(https_writer_t *writer, https_writer_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HTTPS_WRITER_H
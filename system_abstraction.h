@@ -1,60 +1,166 @@
-#ifndef SYSTEM_ABSTRACTION_H
-#define SYSTEM_ABSTRACTION_H
-
-#include <stdint.h>
-#include <stdlib.h>
-#include <stdio.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-// Memory management functions
-void* sys_malloc(size_t size);
-void* sys_calloc(size_t nelements, size_t elementSize);
-void sys_free(void* ptr);
-
-// Random number generation
-int sys_get_random_bytes(unsigned char* output, size_t output_len);
-
-// Time/delay functions
-void sys_delay_ms(uint32_t ms);
-
-// Logging functions
-typedef enum {
-    LOG_LEVEL_INFO,
-    LOG_LEVEL_ERROR,
-    LOG_LEVEL_DEBUG
-} log_level_t;
-
-void sys_log(log_level_t level, const char* format, ...);
-
-#define SYS_LOG_INFO(fmt, ...) sys_log(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
-#define SYS_LOG_ERROR(fmt, ...) sys_log(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
-#define SYS_LOG_DEBUG(fmt, ...) sys_log(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
-
-// File system abstraction
-typedef struct {
-    FILE* fp;
-    int is_open;
-} sys_file_t;
-
-typedef enum {
-    SYS_FILE_OK = 0,
-    SYS_FILE_ERROR = -1
-} sys_file_result_t;
-
-typedef enum {
-    SYS_FILE_CREATE_ALWAYS = 1,
-    SYS_FILE_WRITE = 2
-} sys_file_mode_t;
-
-sys_file_result_t sys_file_open(sys_file_t* file, const char* path, sys_file_mode_t mode);
-sys_file_result_t sys_file_write(sys_file_t* file, const void* data, uint32_t size, uint32_t* written);
-void sys_file_close(sys_file_t* file);
-
-#ifdef __cplusplus
-}
-#endif
-
-#endif // SYSTEM_ABSTRACTION_H
+#ifndef SYSTEM_ABSTRACTION_H
+#define SYSTEM_ABSTRACTION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Memory management functions
+//
+// Blocks up to 1 MB come from size-class pools: a freed block is kept for
+// the next allocation of its class instead of going back to the heap, so a
+// process that repeats the same work settles at no heap calls at all.
+// Build with SYS_MEM_NO_POOL to hand every call to the heap, e.g. for valgrind.
+void* sys_malloc(size_t size);
+void* sys_calloc(size_t nelements, size_t elementSize);
+void sys_free(void* ptr);
+
+typedef struct {
+    uint64_t allocs;                // sys_malloc and sys_calloc calls
+    uint64_t frees;                 // sys_free calls with a block
+    uint64_t heap_allocs;           // Allocations the pools couldn't serve
+    uint64_t heap_frees;            // Blocks given back to the heap
+    uint64_t pool_hits;             // Allocations served from a pool
+    uint64_t cached_bytes;          // Held by the pools for reuse
+} sys_mem_stats_t;
+
+// Counters since the start of the process
+void sys_mem_get_stats(sys_mem_stats_t* stats);
+// Give the blocks the pools hold back to the heap
+void sys_mem_trim(void);
+
+// Arena: allocations that live and die together, e.g. those of one request.
+// Memory is carved from chunks in order and released all at once by
+// sys_arena_reset() or sys_arena_destroy(); there is no per-allocation free.
+typedef struct sys_arena_chunk sys_arena_chunk_t;
+
+typedef struct {
+    sys_arena_chunk_t* chunks;      // Newest first
+    size_t chunk_size;
+} sys_arena_t;
+
+// chunk_size is the size of each chunk as passed to sys_malloc, a larger
+// allocation gets a chunk of its own. No memory is taken until the first one.
+void sys_arena_init(sys_arena_t* arena, size_t chunk_size);
+// Aligned like sys_malloc, NULL when out of memory
+void* sys_arena_alloc(sys_arena_t* arena, size_t size);
+// Release every allocation but keep the newest chunk for the next round
+void sys_arena_reset(sys_arena_t* arena);
+void sys_arena_destroy(sys_arena_t* arena);
+
+// Random number generation
+int sys_get_random_bytes(unsigned char* output, size_t output_len);
+
+// Time/delay functions
+void sys_delay_ms(uint32_t ms);
+uint64_t sys_get_time_ms(void);   // Monotonic clock, for measuring intervals only
+uint64_t sys_get_time_us(void);   // Same clock in microseconds, for short waits
+
+// Logging functions
+//
+// A message is formatted by the calling thread into a ring buffer of its
+// own and written out by a background thread, so logging never waits for
+// stdout or stderr. A full ring drops the message rather than block.
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+} log_level_t;  // In order of verbosity
+
+// Levels above this are compiled out; release builds (NDEBUG) keep errors only
+#ifndef SYS_LOG_MAX_LEVEL
+#ifdef NDEBUG
+#define SYS_LOG_MAX_LEVEL LOG_LEVEL_ERROR
+#else
+#define SYS_LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+extern volatile int sys_log_threshold;  // Runtime level, change it with sys_log_set_level()
+
+void sys_log(log_level_t level, const char* format, ...);
+void sys_log_set_level(log_level_t level);
+log_level_t sys_log_get_level(void);
+// Write out everything logged so far, e.g. before printing to the same stream
+void sys_log_flush(void);
+uint64_t sys_log_dropped(void);   // Messages lost to full rings
+
+#define SYS_LOG_ON(level) ((level) <= SYS_LOG_MAX_LEVEL && (int)(level) <= sys_log_threshold)
+
+// The arguments are not evaluated for a level that is off
+#define SYS_LOG_INFO(fmt, ...) do { if (SYS_LOG_ON(LOG_LEVEL_INFO)) sys_log(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__); } while (0)
+#define SYS_LOG_ERROR(fmt, ...) do { if (SYS_LOG_ON(LOG_LEVEL_ERROR)) sys_log(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__); } while (0)
+#define SYS_LOG_DEBUG(fmt, ...) do { if (SYS_LOG_ON(LOG_LEVEL_DEBUG)) sys_log(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__); } while (0)
+
+// File system abstraction
+typedef enum {
+    SYS_FILE_BACKEND_STDIO = 0,     // stdio buffering, the portable default
+    SYS_FILE_BACKEND_WRITE,         // write(2) straight from one large aligned buffer
+    SYS_FILE_BACKEND_DIRECT,        // O_DIRECT, bypasses the page cache
+    SYS_FILE_BACKEND_URING,         // io_uring with several buffer writes in flight
+    SYS_FILE_BACKEND_MMAP           // Copies into a mapping of the preallocated size, write(2) before and past it
+} sys_file_backend_t;
+
+typedef struct {
+    FILE* fp;
+    int is_open;
+    sys_file_backend_t backend;     // The backend actually in use
+    int fd;                         // Everything but stdio
+    uint8_t* buf;                   // Sequential writes collect here
+    uint32_t buf_len;
+    uint32_t buf_size;
+    uint64_t pos;                   // File offset of buf[0]
+    uint64_t size;                  // End of the furthest write
+    void* ring;                     // io_uring state
+    uint8_t* map;                   // SYS_FILE_BACKEND_MMAP once preallocated
+    uint64_t map_size;
+} sys_file_t;
+
+typedef enum {
+    SYS_FILE_OK = 0,
+    SYS_FILE_ERROR = -1,
+    SYS_FILE_NO_SPACE = -2,         // The storage device is full
+    SYS_FILE_UNSUPPORTED = -3       // The file system can't do it, nothing changed
+} sys_file_result_t;
+
+typedef enum {
+    SYS_FILE_CREATE_ALWAYS = 1,
+    SYS_FILE_WRITE = 2,
+    SYS_FILE_OPEN_EXISTING = 4,     // Keep the existing contents, fail if the file is missing
+    SYS_FILE_READ = 8
+} sys_file_mode_t;
+
+sys_file_result_t sys_file_open(sys_file_t* file, const char* path, sys_file_mode_t mode);
+// Create a file with a chosen write backend. Backends the platform or file
+// system can't provide fall back to a simpler one, file->backend tells
+// which one is in use. Modes other than SYS_FILE_CREATE_ALWAYS use stdio.
+sys_file_result_t sys_file_open_backend(sys_file_t* file, const char* path, sys_file_mode_t mode,
+                                        sys_file_backend_t backend);
+const char* sys_file_backend_name(sys_file_backend_t backend);
+sys_file_result_t sys_file_write(sys_file_t* file, const void* data, uint32_t size, uint32_t* written);
+// Positioned write that leaves the file offset alone, safe to call from several threads.
+// Not for SYS_FILE_BACKEND_DIRECT unless offset, size and data are block aligned.
+sys_file_result_t sys_file_write_at(sys_file_t* file, uint64_t offset, const void* data, uint32_t size, uint32_t* written);
+sys_file_result_t sys_file_read(sys_file_t* file, void* data, uint32_t size, uint32_t* read);
+// Reserve disk space for the first size bytes without changing the file
+// size, so the file isn't fragmented and a full disk shows up before any
+// data is written. An mmap file gets its size and mapping here.
+sys_file_result_t sys_file_preallocate(sys_file_t* file, uint64_t size);
+// Hand buffered writes to the kernel and wait for writes in flight
+sys_file_result_t sys_file_flush(sys_file_t* file);
+// Push buffered and cached writes down to the storage device
+sys_file_result_t sys_file_sync(sys_file_t* file);
+void sys_file_close(sys_file_t* file);
+sys_file_result_t sys_file_remove(const char* path);
+// Atomically replace new_path with old_path
+sys_file_result_t sys_file_rename(const char* old_path, const char* new_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SYSTEM_ABSTRACTION_H
@@ -4,21 +4,43 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include "system_abstraction.h"
 #include "https_download.h"
+#include "https_parser.h"
+#include "https_writer.h"
 
 // Test configuration
 #define TEST_FILE_PATH "./test_download.tmp"
-#define TEST_URL_SMALL "https://httpbin.org/json"
-#define TEST_URL_LARGER "https://raw.githubusercontent.com/curl/curl/master/README.md"
+#define TEST_SERVER "https://127.0.0.1:4433"   // bench_server, as started by make test
+#define TEST_PATH_SMALL "/size/4096"
+#define TEST_PATH_LARGER "/size/1048576"
+#define TEST_PATH_REDIRECT "/size/1000?redirect=2"
 
 // Test result tracking
 static int tests_passed = 0;
 static int tests_failed = 0;
+static const char* test_server = TEST_SERVER;
+
+// URL of path on the test server, valid until a few calls later
+static char* test_url(const char* path)
+{
+    static char urls[4][256];
+    static int next = 0;
+    char* url = urls[next++ % 4];
+    
+    snprintf(url, sizeof(urls[0]), "%s%s", test_server, path);
+    return url;
+}
 
 // Test utility functions
 void test_assert(int condition, const char* test_name)
 {
+    // the library logs from a background thread, keep its lines before the verdict
+    sys_log_flush();
     if (condition) {
         printf("✓ PASS: %s\n", test_name);
         tests_passed++;
@@ -79,6 +101,31 @@ void test_system_abstraction()
     test_assert(is_zeroed, "sys_calloc zeros memory");
     sys_free(ptr);
     
+    // Test the pools: a freed block serves the next allocation of its size
+    sys_mem_stats_t mem_before, mem_after;
+    sys_mem_get_stats(&mem_before);
+    for (int i = 0; i < 100; i++) {
+        sys_free(sys_malloc(3000));
+    }
+    sys_mem_get_stats(&mem_after);
+    test_assert(mem_after.allocs - mem_before.allocs == 100 && mem_after.frees - mem_before.frees == 100,
+                "Memory stats count allocations and frees");
+    test_assert(mem_after.heap_allocs - mem_before.heap_allocs <= 1, "Repeated allocations reuse a pooled block");
+    test_assert(sys_calloc((size_t)-1 / 2, 4) == NULL, "sys_calloc rejects an overflowing size");
+    
+    // Test the arena
+    sys_arena_t arena;
+    sys_arena_init(&arena, 1024);
+    char* a = (char*)sys_arena_alloc(&arena, 100);
+    char* b = (char*)sys_arena_alloc(&arena, 100);
+    char* big = (char*)sys_arena_alloc(&arena, 4096);
+    test_assert(a && b && big && b >= a + 100 && ((uintptr_t)b % 16) == 0, "Arena allocations are aligned and apart");
+    memset(big, 0x5a, 4096);
+    sys_arena_reset(&arena);
+    test_assert(sys_arena_alloc(&arena, 100) == big, "Arena reset reuses the newest chunk");
+    sys_arena_destroy(&arena);
+    test_assert(arena.chunks == NULL, "Arena destroy releases every chunk");
+    
     // Test random number generation
     unsigned char random_buf[32];
     int rand_result = sys_get_random_bytes(random_buf, sizeof(random_buf));
@@ -99,6 +146,19 @@ void test_system_abstraction()
     SYS_LOG_INFO("This is an info message");
     SYS_LOG_ERROR("This is an error message");
     SYS_LOG_DEBUG("This is a debug message");
+    sys_log_flush();
+    
+    // A level that is off costs only the check, the arguments are not evaluated
+    int evaluated = 0;
+    log_level_t saved_level = sys_log_get_level();
+    sys_log_set_level(LOG_LEVEL_ERROR);
+    SYS_LOG_INFO("Suppressed %d", ++evaluated);
+    SYS_LOG_DEBUG("Suppressed %d", ++evaluated);
+    test_assert(evaluated == 0 && sys_log_get_level() == LOG_LEVEL_ERROR, "Messages above the log level are skipped");
+    sys_log_set_level(LOG_LEVEL_INFO);
+    SYS_LOG_INFO("Logged once the level allows it (%d)", ++evaluated);
+    test_assert(evaluated == (SYS_LOG_MAX_LEVEL >= LOG_LEVEL_INFO), "Raising the log level enables compiled-in messages");
+    sys_log_set_level(saved_level);
     
     // Test file operations
     sys_file_t test_file;
@@ -118,10 +178,481 @@ void test_system_abstraction()
     test_assert(file_exists("test_sys_file.tmp"), "File was created on disk");
     test_assert(get_file_size("test_sys_file.tmp") == test_data_len, "File has correct size");
     
+    // Open for update keeps the existing bytes
+    result = sys_file_open(&test_file, "test_sys_file.tmp", SYS_FILE_OPEN_EXISTING | SYS_FILE_WRITE);
+    test_assert(result == SYS_FILE_OK, "sys_file_open opens existing file for update");
+    result = sys_file_write_at(&test_file, 0, "J", 1, &written);
+    test_assert(result == SYS_FILE_OK && written == 1, "sys_file_write_at writes at offset");
+    test_assert(sys_file_sync(&test_file) == SYS_FILE_OK, "sys_file_sync succeeds");
+    sys_file_close(&test_file);
+    test_assert(get_file_size("test_sys_file.tmp") == test_data_len, "Update keeps the file size");
+    
+    char read_buf[64] = {0};
+    uint32_t nread = 0;
+    result = sys_file_open(&test_file, "test_sys_file.tmp", SYS_FILE_READ);
+    test_assert(result == SYS_FILE_OK, "sys_file_open opens file for reading");
+    result = sys_file_read(&test_file, read_buf, sizeof(read_buf) - 1, &nread);
+    test_assert(result == SYS_FILE_OK && nread == test_data_len && read_buf[0] == 'J' &&
+                memcmp(read_buf + 1, test_data + 1, test_data_len - 1) == 0, "sys_file_read returns updated content");
+    sys_file_close(&test_file);
+    
+    result = sys_file_open(&test_file, "test_sys_file_missing.tmp", SYS_FILE_OPEN_EXISTING | SYS_FILE_WRITE);
+    test_assert(result != SYS_FILE_OK, "sys_file_open for update fails on missing file");
+    
+    test_assert(sys_file_rename("test_sys_file.tmp", "test_sys_file2.tmp") == SYS_FILE_OK &&
+                file_exists("test_sys_file2.tmp"), "sys_file_rename moves the file");
+    test_assert(sys_file_remove("test_sys_file2.tmp") == SYS_FILE_OK && !file_exists("test_sys_file2.tmp"),
+                "sys_file_remove deletes the file");
+    
     // Cleanup
     unlink("test_sys_file.tmp");
 }
 
+// Collects the body handed out by the response parser
+typedef struct {
+    char body[256];
+    uint32_t body_len;
+    int headers_seen;
+} test_parse_ctx_t;
+
+static int test_parse_on_headers(void* ctx, const https_response_t* rsp)
+{
+    (void)rsp;
+    ((test_parse_ctx_t*)ctx)->headers_seen++;
+    return 0;
+}
+
+static int test_parse_on_body(void* ctx, const uint8_t* data, uint32_t len)
+{
+    test_parse_ctx_t* c = (test_parse_ctx_t*)ctx;
+    if (c->body_len + len >= sizeof(c->body)) {
+        return -1;
+    }
+    memcpy(c->body + c->body_len, data, len);
+    c->body_len += len;
+    return 0;
+}
+
+// Feed a response in fragments of frag bytes, returns the parser state
+static int test_parse(https_parser_t* parser, test_parse_ctx_t* ctx, const char* rsp, uint32_t frag, int eof)
+{
+    https_parser_callbacks_t cb = { test_parse_on_headers, test_parse_on_body, ctx };
+    uint32_t len = strlen(rsp), off;
+
+    memset(ctx, 0, sizeof(*ctx));
+    https_parser_init(parser, &cb);
+    for (off = 0; off < len; off += frag) {
+        uint32_t n = len - off < frag ? len - off : frag;
+        int used = https_parser_execute(parser, (const uint8_t*)rsp + off, n);
+        if (used < 0 || (uint32_t)used < n) {
+            break;
+        }
+    }
+    if (eof) {
+        https_parser_finish(parser);
+    }
+    return parser->state;
+}
+
+// Test the incremental response parser, offline
+void test_response_parser()
+{
+    printf("\n=== Testing Response Parser ===\n");
+    
+    static https_parser_t parser;
+    test_parse_ctx_t ctx;
+    const char* chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nETag: \"v1\"\r\n\r\n"
+                          "5\r\nHello\r\n8;ext=1\r\n, World!\r\n0\r\nTrailer: x\r\n\r\n";
+    int all_ok = 1;
+    
+    // every possible fragment size, down to one byte at a time
+    for (uint32_t frag = 1; frag <= strlen(chunked); frag++) {
+        if (test_parse(&parser, &ctx, chunked, frag, 0) != HTTPS_PARSE_DONE || ctx.body_len != 13 ||
+            memcmp(ctx.body, "Hello, World!", 13) != 0 || ctx.headers_seen != 1) {
+            all_ok = 0;
+        }
+    }
+    test_assert(all_ok, "Chunked body parses at every fragment size");
+    test_assert(strcmp(parser.rsp.etag, "\"v1\"") == 0 && parser.rsp.keep_alive, "Chunked response keeps headers and keep-alive");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.1 206 Partial Content\r\nContent-Length: 4\r\n"
+                           "Content-Range: bytes 10-13/100\r\n\r\nabcdEXTRA", 3, 0) == HTTPS_PARSE_DONE &&
+                ctx.body_len == 4 && parser.rsp.range_start == 10 && parser.rsp.range_total == 100,
+                "Content-Length body stops at its length");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.1 206 Partial Content\r\nContent-Length: 5000000000\r\n"
+                           "Content-Range: bytes 6000000000-10999999999/12000000000\r\n\r\nab", 7, 0) == HTTPS_PARSE_BODY &&
+                parser.rsp.content_length == 5000000000ULL && parser.rsp.range_start == 6000000000ULL &&
+                parser.rsp.range_total == 12000000000ULL && parser.remaining == 5000000000ULL - 2,
+                "Sizes past 4 GB are kept in full");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.0 200 OK\r\n\r\nuntil close", 4, 1) == HTTPS_PARSE_DONE &&
+                ctx.body_len == 11 && parser.rsp.body_mode == HTTPS_BODY_CLOSE && !parser.rsp.keep_alive,
+                "Read-until-close body ends at end of stream");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort", 64, 1) != HTTPS_PARSE_DONE,
+                "Truncated Content-Length body is detected");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 204 No Content\r\n\r\n", 5, 0) == HTTPS_PARSE_DONE &&
+                parser.rsp.status_code == 204 && ctx.headers_seen == 1, "Interim 1xx response is skipped");
+    
+    test_assert(test_parse(&parser, &ctx, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", 64, 0) == HTTPS_PARSE_ERROR,
+                "Bad chunk size is rejected");
+    test_assert(test_parse(&parser, &ctx, "garbage\r\n\r\n", 64, 0) == HTTPS_PARSE_ERROR, "Bad status line is rejected");
+}
+
+// Test the write-behind writer, offline
+void test_async_writer()
+{
+    printf("\n=== Testing Write-Behind Writer ===\n");
+    
+    static uint8_t pattern[100000];
+    static uint8_t readback[100000];
+    sys_file_t file;
+    https_writer_stats_t stats;
+    https_writer_t* writer;
+    uint32_t off = 0, piece = 1;
+    int write_ok = 1;
+    
+    for (uint32_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+    
+    test_assert(sys_file_open(&file, TEST_FILE_PATH, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE) == SYS_FILE_OK,
+                "Open file for the writer");
+    writer = https_writer_create(&file, 3, 4096);
+    test_assert(writer != NULL, "Create writer with 3 x 4096 buffers");
+    if (!writer) {
+        sys_file_close(&file);
+        cleanup_test_files();
+        return;
+    }
+    // odd-sized pieces, some larger than a whole buffer
+    while (off < sizeof(pattern)) {
+        uint32_t n = piece;
+        if (n > sizeof(pattern) - off) n = sizeof(pattern) - off;
+        if (https_writer_write(writer, pattern + off, n) != 0) write_ok = 0;
+        off += n;
+        piece = piece * 7 % 9973 + 1;
+    }
+    test_assert(write_ok, "Writes are queued");
+    test_assert(https_writer_close(writer, &stats) == 0, "Writer closes cleanly");
+    test_assert(stats.bytes == sizeof(pattern), "Writer reports every byte");
+    sys_file_close(&file);
+    
+    FILE* fp = fopen(TEST_FILE_PATH, "rb");
+    size_t got = fp ? fread(readback, 1, sizeof(readback), fp) : 0;
+    if (fp) fclose(fp);
+    test_assert(got == sizeof(pattern) && memcmp(pattern, readback, sizeof(pattern)) == 0,
+                "File content matches what was written");
+    
+    // a file that can't be written makes the writer fail
+    test_assert(sys_file_open(&file, TEST_FILE_PATH, SYS_FILE_READ) == SYS_FILE_OK, "Open file read-only");
+    writer = https_writer_create(&file, 2, 4096);
+    if (writer) {
+        for (off = 0; off < sizeof(pattern); off += 1000) {
+            https_writer_write(writer, pattern + off, 1000);
+        }
+        test_assert(https_writer_close(writer, NULL) != 0, "Failed write is reported on close");
+    }
+    sys_file_close(&file);
+    cleanup_test_files();
+}
+
+// Test every file backend with odd-sized writes and an unaligned tail, offline
+void test_file_backends()
+{
+    printf("\n=== Testing File Backends ===\n");
+    
+    static const sys_file_backend_t backends[] = {
+        SYS_FILE_BACKEND_STDIO, SYS_FILE_BACKEND_WRITE, SYS_FILE_BACKEND_DIRECT, SYS_FILE_BACKEND_URING,
+        SYS_FILE_BACKEND_MMAP
+    };
+    const uint32_t total = 3 * 1024 * 1024 + 4321;
+    uint8_t* pattern = malloc(total);
+    uint8_t* readback = malloc(total);
+    char name[96];
+    
+    if (!pattern || !readback) {
+        free(pattern);
+        free(readback);
+        test_assert(0, "Allocate backend test buffers");
+        return;
+    }
+    for (uint32_t i = 0; i < total; i++) {
+        pattern[i] = (uint8_t)(i * 7 + (i >> 12));
+    }
+    
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        sys_file_t file;
+        uint32_t off = 0, piece = 1, written;
+        int ok = sys_file_open_backend(&file, TEST_FILE_PATH, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE, backends[b]) == SYS_FILE_OK;
+        sys_file_result_t pre;
+        
+        // reserve less than the whole file, the rest is written past the preallocated part
+        pre = ok ? sys_file_preallocate(&file, total - 100000) : SYS_FILE_ERROR;
+        ok = ok && (pre == SYS_FILE_OK || pre == SYS_FILE_UNSUPPORTED);
+        while (ok && off < total) {
+            uint32_t n = piece < total - off ? piece : total - off;
+            ok = sys_file_write(&file, pattern + off, n, &written) == SYS_FILE_OK && written == n;
+            off += n;
+            piece = piece * 5 % 70001 + 1;
+            // a sync in the middle leaves an unaligned tail behind for O_DIRECT
+            if (ok && off > total / 2 && off - n <= total / 2) {
+                ok = sys_file_sync(&file) == SYS_FILE_OK && get_file_size(TEST_FILE_PATH) >= (long)off;
+            }
+        }
+        ok = ok && sys_file_flush(&file) == SYS_FILE_OK;
+        if (file.is_open) {
+            sys_file_close(&file);
+        }
+        
+        FILE* fp = fopen(TEST_FILE_PATH, "rb");
+        size_t got = fp ? fread(readback, 1, total, fp) : 0;
+        if (fp) fclose(fp);
+        snprintf(name, sizeof(name), "Backend %s (used %s) writes the exact content",
+                 sys_file_backend_name(backends[b]), sys_file_backend_name(file.backend));
+        test_assert(ok && got == total && get_file_size(TEST_FILE_PATH) == (long)total &&
+                    memcmp(pattern, readback, total) == 0, name);
+        cleanup_test_files();
+    }
+    free(pattern);
+    free(readback);
+    
+    sys_file_t file;
+    if (sys_file_open(&file, TEST_FILE_PATH, SYS_FILE_CREATE_ALWAYS | SYS_FILE_WRITE) == SYS_FILE_OK) {
+        sys_file_result_t pre = sys_file_preallocate(&file, 1024 * 1024);
+        test_assert((pre == SYS_FILE_OK || pre == SYS_FILE_UNSUPPORTED) && get_file_size(TEST_FILE_PATH) == 0,
+                    "Preallocation leaves the file size alone");
+        pre = sys_file_preallocate(&file, 1ULL << 60);
+        test_assert(pre == SYS_FILE_NO_SPACE || pre == SYS_FILE_UNSUPPORTED, "Preallocating more than the disk holds fails");
+        sys_file_close(&file);
+    }
+    cleanup_test_files();
+}
+
+// Test TLS profile and cipher suite configuration, offline
+void test_tls_profiles()
+{
+    printf("\n=== Testing TLS Profiles ===\n");
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    test_assert(config.tls_profile == HTTPS_TLS_PROFILE_COMPAT, "Compat profile is the default");
+    
+    config.tls_profile = HTTPS_TLS_PROFILE_FAST;
+    https_client_t* client = https_client_create(&config);
+    test_assert(client != NULL, "Create client with the fast profile");
+    https_client_destroy(client);
+    
+    config.ciphersuites = "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256:TLS-RSA-WITH-AES-128-CBC-SHA";
+    client = https_client_create(&config);
+    test_assert(client != NULL, "Create client with an explicit suite list");
+    https_client_destroy(client);
+    
+    config.ciphersuites = "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256:NO-SUCH-SUITE";
+    client = https_client_create(&config);
+    test_assert(client == NULL, "Unknown suite name is rejected");
+    https_client_destroy(client);
+}
+
+// Test that failed downloads report what went wrong, without the network
+void test_error_classes()
+{
+    printf("\n=== Testing Error Classes ===\n");
+    
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    test_assert(strcmp(https_error_class_name(HTTPS_ERROR_NONE), "none") == 0, "Error class NONE is named none");
+    test_assert(strcmp(https_error_class_name(HTTPS_ERROR_TLS), "tls") == 0, "Error class TLS is named tls");
+    test_assert(strcmp(https_error_class_name(12345), "other") == 0, "Unknown error class is named other");
+    
+    cleanup_test_files();
+    int result = https_download_ex("https://no-such-host.invalid/file", TEST_FILE_PATH, &opts);
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_DNS, "Unresolvable host is a DNS error");
+    test_assert(ts.status_code == 0 && ts.end_us >= ts.start_us, "Failed download still gets its timestamps");
+    
+    // nothing listens on port 1
+    result = https_download_ex("https://127.0.0.1:1/file", TEST_FILE_PATH, &opts);
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_CONNECT, "Refused connection is a connect error");
+    test_assert(ts.dns_us != 0 && ts.connect_us == 0, "Refused connection has a DNS phase but no connect phase");
+    cleanup_test_files();
+}
+
+// Test the resolver cache, without the network: numeric hosts resolve
+// locally and nothing listens on port 1
+void test_dns_cache()
+{
+    printf("\n=== Testing DNS Cache ===\n");
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.dns_cache_ttl_ms = 200;
+    https_client_t* client = https_client_create(&config);
+    test_assert(client != NULL, "Create client with a short DNS TTL");
+    if (!client) {
+        return;
+    }
+    
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_client_stats_t stats;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    test_assert(https_client_resolve(client, "127.0.0.1") == 0, "Prewarming resolves the host");
+    cleanup_test_files();
+    int result = https_client_download_ex(client, "https://127.0.0.1:1/file", TEST_FILE_PATH, &opts);
+    https_client_get_stats(client, &stats);
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_CONNECT, "Download after prewarming gets to connect");
+    test_assert(ts.dns_cached && stats.dns_cache_hits == 1 && stats.dns_resolves == 1,
+                "Prewarmed addresses are used without resolving again");
+    
+    sys_delay_ms(300);
+    https_client_download_ex(client, "https://127.0.0.1:1/file", TEST_FILE_PATH, &opts);
+    https_client_get_stats(client, &stats);
+    test_assert(!ts.dns_cached && stats.dns_cache_misses == 1 && stats.dns_resolves == 2,
+                "Expired addresses are resolved again");
+    
+    // an empty label is refused by the resolver itself
+    test_assert(https_client_resolve(client, "bad..name") != 0, "Invalid name does not resolve");
+    result = https_client_download_ex(client, "https://bad..name/file", TEST_FILE_PATH, &opts);
+    https_client_get_stats(client, &stats);
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_DNS, "Cached failure is a DNS error");
+    test_assert(stats.dns_negative_hits == 1 && stats.dns_resolves == 3, "Failure is served from the cache");
+    cleanup_test_files();
+    https_client_destroy(client);
+    
+    config.dns_cache_size = 0;
+    client = https_client_create(&config);
+    https_client_download_ex(client, "https://127.0.0.1:1/file", TEST_FILE_PATH, &opts);
+    https_client_download_ex(client, "https://127.0.0.1:1/file", TEST_FILE_PATH, &opts);
+    https_client_get_stats(client, &stats);
+    test_assert(stats.dns_resolves == 2 && stats.dns_cache_hits == 0, "Disabled cache resolves every connect");
+    cleanup_test_files();
+    https_client_destroy(client);
+}
+
+// A local listener that never answers: the kernel completes the TCP
+// handshake, the TLS handshake then waits for the read timeout
+void test_socket_timeout()
+{
+    printf("\n=== Testing Socket Timeout and Backoff ===\n");
+    
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        test_assert(0, "Silent listener is set up");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.read_timeout_ms = 200;
+    config.handshake_retries = 2;
+    config.backoff_base_ms = 50;
+    config.backoff_jitter = 0;
+    https_client_t* client = https_client_create(&config);
+    
+    char url[64];
+    snprintf(url, sizeof(url), "https://127.0.0.1:%d/file", ntohs(addr.sin_port));
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    cleanup_test_files();
+    uint64_t start = sys_get_time_ms();
+    int result = https_client_download_ex(client, url, TEST_FILE_PATH, &opts);
+    uint64_t elapsed = sys_get_time_ms() - start;
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_TLS, "Silent server fails the handshake");
+    test_assert(elapsed >= 400 && elapsed < 2000, "Handshake gives up after its read timeouts");
+    test_assert(ts.io_wait_us >= 400000, "Time waiting for the socket is reported");
+    test_assert(ts.backoff_us >= 50000 && ts.backoff_us < 200000, "Backoff before the handshake retry is reported");
+    test_assert(ts.handshake_retries == 1, "Failed handshake is retried once");
+    
+    // the retry must not reuse the connection the first handshake broke
+    int accepted = 0;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    for (int conn_fd; (conn_fd = accept(fd, NULL, NULL)) >= 0; accepted++) {
+        close(conn_fd);
+    }
+    test_assert(accepted == 2 && ts.connect_attempts == 2, "Handshake retry connects again");
+    test_assert(strcmp(ts.remote_addr, "127.0.0.1") == 0, "Connected address is reported");
+    cleanup_test_files();
+    
+    https_client_destroy(client);
+    close(fd);
+}
+
+// A listener whose accept queue is full drops further SYNs, so connecting
+// to it hangs the way a blackholed address does
+void test_connect_timeout()
+{
+    printf("\n=== Testing Connect Timeout ===\n");
+    
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int fillers[4];
+    int i;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 0) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        test_assert(0, "Full listener is set up");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(fillers[i], F_SETFL, O_NONBLOCK);
+        connect(fillers[i], (struct sockaddr*)&addr, sizeof(addr));
+    }
+    sys_delay_ms(50);
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.connect_timeout_ms = 300;
+    https_client_t* client = https_client_create(&config);
+    
+    char url[64];
+    snprintf(url, sizeof(url), "https://127.0.0.1:%d/file", ntohs(addr.sin_port));
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    cleanup_test_files();
+    uint64_t start = sys_get_time_ms();
+    int result = https_client_download_ex(client, url, TEST_FILE_PATH, &opts);
+    uint64_t elapsed = sys_get_time_ms() - start;
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_CONNECT, "Unanswered connect is a connect error");
+    test_assert(elapsed >= 250 && elapsed < 1500, "Connect gives up at its deadline");
+    test_assert(ts.connect_attempts == 1 && ts.connect_us == 0, "One attempt was made and none completed");
+    cleanup_test_files();
+    
+    https_client_destroy(client);
+    for (i = 0; i < 4; i++) {
+        close(fillers[i]);
+    }
+    close(fd);
+}
+
 // Test HTTPS download functionality
 void test_https_download()
 {
@@ -129,9 +660,9 @@ void test_https_download()
     
     cleanup_test_files();
     
-    // Test 1: Download a small JSON file
-    printf("Test 1: Downloading small JSON file...\n");
-    int result = https_download(TEST_URL_SMALL, TEST_FILE_PATH);
+    // Test 1: Download a small file
+    printf("Test 1: Downloading small file...\n");
+    int result = https_download(test_url(TEST_PATH_SMALL), TEST_FILE_PATH);
     test_assert(result == 0, "Small file download succeeds");
     test_assert(file_exists(TEST_FILE_PATH), "Downloaded file exists");
     
@@ -143,12 +674,12 @@ void test_https_download()
     
     // Test 2: Download a larger file
     printf("\nTest 2: Downloading larger file...\n");
-    result = https_download(TEST_URL_LARGER, TEST_FILE_PATH);
+    result = https_download(test_url(TEST_PATH_LARGER), TEST_FILE_PATH);
     test_assert(result == 0, "Larger file download succeeds");
     test_assert(file_exists(TEST_FILE_PATH), "Downloaded larger file exists");
     
     file_size = get_file_size(TEST_FILE_PATH);
-    test_assert(file_size > 1000, "Downloaded larger file has substantial content");
+    test_assert(file_size == 1048576, "Downloaded larger file has the full size");
     printf("Downloaded file size: %ld bytes\n", file_size);
     
     cleanup_test_files();
@@ -160,10 +691,570 @@ void test_https_download()
     
     // Test 4: Invalid path handling
     printf("\nTest 4: Testing invalid path handling...\n");
-    result = https_download(TEST_URL_SMALL, "/root/cannot_write_here.tmp");
+    result = https_download(test_url(TEST_PATH_SMALL), "./no-such-dir/cannot_write_here.tmp");
     test_assert(result != 0, "Invalid write path properly fails");
 }
 
+// Test that a stalled response fails after one read timeout, on a new and
+// on a pooled connection
+void test_read_timeout()
+{
+    printf("\n=== Testing Read Timeout ===\n");
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.read_timeout_ms = 300;
+    https_client_t* client = https_client_create(&config);
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    cleanup_test_files();
+    uint64_t start = sys_get_time_ms();
+    int result = https_client_download_ex(client, test_url("/size/1000?delay=3000"), TEST_FILE_PATH, &opts);
+    uint64_t elapsed = sys_get_time_ms() - start;
+    test_assert(result != 0 && ts.error_class == HTTPS_ERROR_NETWORK, "Stalled response fails the download");
+    test_assert(elapsed >= 250 && elapsed < 1000, "Stalled response gives up after one read timeout");
+    cleanup_test_files();
+    
+    result = https_client_download_ex(client, test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+    test_assert(result == 0, "Download after a read timeout succeeds");
+    start = sys_get_time_ms();
+    result = https_client_download_ex(client, test_url("/size/1000?delay=3000"), TEST_FILE_PATH, &opts);
+    elapsed = sys_get_time_ms() - start;
+    test_assert(result != 0 && ts.reused_connection && elapsed >= 250 && elapsed < 1000,
+                "Stalled response on a pooled connection gives up after one read timeout");
+    cleanup_test_files();
+    
+    https_client_destroy(client);
+}
+
+// Test client context reuse and the keep-alive connection pool
+void test_client_reuse()
+{
+    printf("\n=== Testing Client Connection Reuse ===\n");
+    
+    https_client_t* client = https_client_create(NULL);
+    test_assert(client != NULL, "https_client_create succeeds");
+    if (!client) {
+        return;
+    }
+    
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    sys_mem_stats_t mem_before, mem_after;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    
+    cleanup_test_files();
+    int result = https_client_download_ex(client, test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+    test_assert(result == 0, "First client download succeeds");
+    uint32_t warm_buffer = ts.recv_buffer_size;
+    cleanup_test_files();
+    
+    // How far the receive buffer grows depends on how fast data arrives.
+    // Repeat until a download stays within the sizes seen so far, whose
+    // blocks are pooled by then; the buffer doubles, so this ends quickly.
+    for (int round = 0; round < 8; round++) {
+        sys_mem_get_stats(&mem_before);
+        result = https_client_download_ex(client, test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+        sys_mem_get_stats(&mem_after);
+        if (result != 0 || ts.recv_buffer_size <= warm_buffer) {
+            break;
+        }
+        warm_buffer = ts.recv_buffer_size;
+        cleanup_test_files();
+    }
+    test_assert(result == 0, "Second client download succeeds");
+    test_assert(ts.recv_buffer_size <= warm_buffer, "Receive buffer stops growing on a warm client");
+    test_assert(mem_after.heap_allocs == mem_before.heap_allocs, "Download on a warm client makes no heap allocations");
+    test_assert(get_file_size(TEST_FILE_PATH) > 0, "Second client download has content");
+    test_assert(ts.body_bytes == (uint64_t)get_file_size(TEST_FILE_PATH), "Transfer stats count the body bytes");
+    test_assert(ts.reused_connection && ts.handshake_us == 0, "Transfer stats report the reused connection");
+    test_assert(ts.first_byte_us >= ts.request_us && ts.end_us >= ts.first_byte_us, "Transfer stats phases are ordered");
+    cleanup_test_files();
+    
+    https_client_stats_t stats;
+    https_client_get_stats(client, &stats);
+    printf("Pool hits: %llu, misses: %llu, evictions: %llu\n",
+           (unsigned long long)stats.pool_hits, (unsigned long long)stats.pool_misses,
+           (unsigned long long)stats.pool_evictions);
+    test_assert(stats.pool_hits >= 1, "Second download reuses the pooled connection");
+    
+    https_client_destroy(client);
+}
+
+// Records the redirects of a download
+typedef struct {
+    int hops;
+    int in_order;
+    int refuse;                 // Refuse the first redirect
+    uint32_t status_code;       // Status of the last redirect
+    uint32_t same_connection;   // Bit n - 1 set when hop n kept the connection
+} test_redirect_ctx_t;
+
+static int test_redirect(void* ctx, const https_redirect_t* r)
+{
+    test_redirect_ctx_t* c = (test_redirect_ctx_t*)ctx;
+    
+    if (r->hop != (uint32_t)c->hops + 1 || strncmp(r->to, "https://", 8) != 0 || strcmp(r->from, r->to) == 0) {
+        c->in_order = 0;
+    }
+    if (r->same_connection) {
+        c->same_connection |= 1u << c->hops;
+    }
+    c->hops++;
+    c->status_code = r->status_code;
+    return c->refuse;
+}
+
+// Test that redirects are followed, reported hop by hop and can be refused
+void test_redirect_download()
+{
+    printf("\n=== Testing Redirects ===\n");
+    
+    https_transfer_stats_t ts;
+    test_redirect_ctx_t rc;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.stats = &ts;
+    opts.redirect = test_redirect;
+    opts.redirect_ctx = &rc;
+    
+    cleanup_test_files();
+    memset(&rc, 0, sizeof(rc));
+    rc.in_order = 1;
+    int result = https_download_ex(test_url(TEST_PATH_REDIRECT), TEST_FILE_PATH, &opts);
+    test_assert(result == 0 && get_file_size(TEST_FILE_PATH) == 1000, "Redirected download succeeds");
+    test_assert(ts.status_code == 200 && ts.requests == 3, "Only the final response is kept");
+    test_assert(ts.redirects == 2 && rc.hops == 2 && rc.in_order, "Each redirect is reported once, in order");
+    test_assert(rc.status_code == 302, "Redirect status is reported");
+    test_assert(rc.same_connection == 0x3, "Same-host redirects keep the connection");
+    test_assert(ts.redirect_us > 0 && ts.redirect_us <= ts.end_us - ts.start_us, "Time spent on redirects is reported");
+    cleanup_test_files();
+    
+    // the first hop goes from 127.0.0.1 to localhost, the second stays there
+    memset(&rc, 0, sizeof(rc));
+    rc.in_order = 1;
+    result = https_download_ex(test_url(TEST_PATH_REDIRECT "&via=localhost"), TEST_FILE_PATH, &opts);
+    test_assert(result == 0 && get_file_size(TEST_FILE_PATH) == 1000, "Cross-origin redirected download succeeds");
+    test_assert(rc.hops == 2 && rc.in_order && rc.same_connection == 0x2, "Cross-origin redirect opens a new connection");
+    cleanup_test_files();
+    
+    const uint32_t codes[] = { 307, 308 };
+    for (int i = 0; i < 2; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s&code=%u", TEST_PATH_REDIRECT, codes[i]);
+        memset(&rc, 0, sizeof(rc));
+        rc.in_order = 1;
+        result = https_download_ex(test_url(path), TEST_FILE_PATH, &opts);
+        snprintf(path, sizeof(path), "%u redirect is followed", codes[i]);
+        test_assert(result == 0 && ts.status_code == 200 && rc.hops == 2 && rc.status_code == codes[i], path);
+        cleanup_test_files();
+    }
+    
+    memset(&rc, 0, sizeof(rc));
+    rc.in_order = 1;
+    rc.refuse = 1;
+    result = https_download_ex(test_url(TEST_PATH_REDIRECT), TEST_FILE_PATH, &opts);
+    test_assert(result != 0 && rc.hops == 1 && ts.error_class == HTTPS_ERROR_HTTP, "Refused redirect fails the download");
+    cleanup_test_files();
+    
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.max_redirects = 1;
+    https_client_t* client = https_client_create(&config);
+    memset(&rc, 0, sizeof(rc));
+    rc.in_order = 1;
+    result = https_client_download_ex(client, test_url(TEST_PATH_REDIRECT), TEST_FILE_PATH, &opts);
+    test_assert(result != 0 && ts.redirects == 1 && ts.error_class == HTTPS_ERROR_HTTP,
+                "Redirects beyond max_redirects fail the download");
+    cleanup_test_files();
+    https_client_destroy(client);
+}
+
+// Test inline SHA-256 verification: a wrong digest fails and removes the file
+void test_checksum_download()
+{
+    printf("\n=== Testing Checksum Verification ===\n");
+    
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.sha256 = "0000000000000000000000000000000000000000000000000000000000000000";
+    
+    cleanup_test_files();
+    int result = https_download_ex(test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+    test_assert(result == HTTPS_ERR_CHECKSUM, "Wrong SHA-256 fails the download");
+    test_assert(!file_exists(TEST_FILE_PATH), "File with the wrong SHA-256 is deleted");
+    
+    opts.sha256 = "not-a-digest";
+    test_assert(https_download_ex(test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts) != 0, "Malformed SHA-256 is rejected");
+    cleanup_test_files();
+}
+
+// Records the progress reports of a download
+typedef struct {
+    int calls;
+    int dones;
+    int in_order;
+    int cancel;                 // Ask to stop on the first report
+    uint64_t bytes;
+} test_progress_ctx_t;
+
+static int test_progress(void* ctx, const https_progress_t* p)
+{
+    test_progress_ctx_t* c = (test_progress_ctx_t*)ctx;
+    
+    if (c->dones != 0 || p->bytes < c->bytes || (p->total >= 0 && p->bytes > (uint64_t)p->total)) {
+        c->in_order = 0;
+    }
+    c->calls++;
+    c->dones += p->done;
+    c->bytes = p->bytes;
+    return c->cancel;
+}
+
+void test_progress_download()
+{
+    printf("\n=== Testing Progress Callback ===\n");
+    
+    https_transfer_stats_t stats;
+    test_progress_ctx_t ctx = { 0, 0, 1, 0, 0 };
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.progress = test_progress;
+    opts.progress_ctx = &ctx;
+    opts.progress_bytes = 1;
+    opts.stats = &stats;
+    
+    cleanup_test_files();
+    int result = https_download_ex(test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+    test_assert(result == 0, "Download with a progress callback");
+    test_assert(ctx.calls >= 2 && ctx.dones == 1 && ctx.in_order, "Progress reports grow and end with one done report");
+    test_assert(ctx.bytes == stats.body_bytes, "Last progress report has the whole body");
+    
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.in_order = 1;
+    ctx.cancel = 1;
+    result = https_download_ex(test_url(TEST_PATH_SMALL), TEST_FILE_PATH, &opts);
+    test_assert(result == HTTPS_ERR_CANCELLED, "Progress callback cancels the download");
+    test_assert(stats.error_class == HTTPS_ERROR_CANCELLED, "Cancelled download is classified");
+    test_assert(ctx.calls == 2 && ctx.dones == 1, "Cancel is followed by the done report only");
+    cleanup_test_files();
+}
+
+// Records the events a sink receives
+typedef struct {
+    int begins;
+    int ends;
+    int in_order;
+    int end_result;
+    int64_t content_length;
+    uint64_t bytes;
+} test_sink_ctx_t;
+
+static int test_sink(void* user_ctx, https_sink_event_t event, const https_sink_info_t* info,
+                     const uint8_t* data, uint32_t len)
+{
+    test_sink_ctx_t* c = (test_sink_ctx_t*)user_ctx;
+    (void)data;
+    
+    switch (event) {
+    case HTTPS_SINK_BEGIN:
+        c->begins++;
+        c->content_length = info->content_length;
+        break;
+    case HTTPS_SINK_DATA:
+        if (c->begins != 1 || c->ends != 0 || info->received != c->bytes) {
+            c->in_order = 0;
+        }
+        c->bytes += len;
+        break;
+    case HTTPS_SINK_END:
+        c->ends++;
+        c->end_result = info->result;
+        break;
+    }
+    return 0;
+}
+
+// Test streaming a download into a sink callback
+void test_sink_download()
+{
+    printf("\n=== Testing Sink Download ===\n");
+    
+    test_sink_ctx_t ctx = {0};
+    ctx.in_order = 1;
+    int result = https_download_to_sink(test_url(TEST_PATH_SMALL), test_sink, &ctx);
+    test_assert(result == 0, "Sink download succeeds");
+    test_assert(ctx.begins == 1 && ctx.ends == 1 && ctx.end_result == 0, "Sink gets one BEGIN and one successful END");
+    test_assert(ctx.in_order && ctx.bytes > 0, "Sink gets the body in order");
+    test_assert(ctx.content_length < 0 || (uint64_t)ctx.content_length == ctx.bytes, "Sink body matches Content-Length");
+    printf("Streamed %llu bytes\n", (unsigned long long)ctx.bytes);
+}
+
+// Test several downloads driven by the event engine from this thread
+void test_engine_download()
+{
+    printf("\n=== Testing Event Engine ===\n");
+    
+    https_client_t* client = https_client_create(NULL);
+    https_engine_t* engine = client ? https_engine_create(client, 2) : NULL;
+    test_assert(engine != NULL, "Create event engine");
+    if (!engine) {
+        https_client_destroy(client);
+        return;
+    }
+    
+    test_sink_ctx_t ctx[3];
+    memset(ctx, 0, sizeof(ctx));
+    int submitted = 1;
+    for (int i = 0; i < 3; i++) {
+        ctx[i].in_order = 1;
+        submitted &= https_engine_submit(engine, test_url(TEST_PATH_SMALL), test_sink, &ctx[i]) == 0;
+    }
+    test_assert(submitted && https_engine_pending(engine) == 3, "Submit three downloads");
+    
+    int completed = 0, succeeded = 0;
+    uint64_t start = sys_get_time_ms();
+    while (https_engine_pending(engine) > 0 && sys_get_time_ms() - start < 60000) {
+        https_completion_t done[3];
+        if (https_engine_poll(engine, 1000) < 0) {
+            break;
+        }
+        int n = https_engine_complete(engine, done, 3);
+        for (int i = 0; i < n; i++) {
+            test_sink_ctx_t* c = (test_sink_ctx_t*)done[i].user_ctx;
+            completed++;
+            if (done[i].result == 0 && done[i].status_code == 200 && done[i].received == c->bytes) {
+                succeeded++;
+            }
+        }
+    }
+    test_assert(completed == 3 && succeeded == 3, "All engine downloads complete");
+    
+    int events_ok = 1;
+    for (int i = 0; i < 3; i++) {
+        events_ok &= ctx[i].begins == 1 && ctx[i].ends == 1 && ctx[i].in_order && ctx[i].bytes > 0;
+    }
+    test_assert(events_ok, "Each engine download delivers its sink events in order");
+    
+    https_engine_destroy(engine);
+    https_client_destroy(client);
+}
+
+// Run one engine download to its completion, returns its result
+static int test_engine_run(https_client_t* client, const char* url, uint64_t* elapsed_ms)
+{
+    https_engine_t* engine = https_engine_create(client, 0);
+    test_sink_ctx_t ctx = {0};
+    https_completion_t done;
+    int result = -1000;
+    
+    if (!engine) {
+        return result;
+    }
+    uint64_t start = sys_get_time_ms();
+    https_engine_submit(engine, url, test_sink, &ctx);
+    while (https_engine_pending(engine) > 0 && sys_get_time_ms() - start < 10000) {
+        if (https_engine_poll(engine, 1000) < 0) {
+            break;
+        }
+        if (https_engine_complete(engine, &done, 1) == 1) {
+            result = done.result;
+        }
+    }
+    *elapsed_ms = sys_get_time_ms() - start;
+    https_engine_destroy(engine);
+    return result;
+}
+
+// Test that the engine keeps the connect deadline and backs off before a
+// handshake retry, offline against local listeners
+void test_engine_timeouts()
+{
+    printf("\n=== Testing Event Engine Timeouts ===\n");
+    
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int fillers[4];
+    int i;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 0) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        test_assert(0, "Full listener is set up");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        fillers[i] = socket(AF_INET, SOCK_STREAM, 0);
+        fcntl(fillers[i], F_SETFL, O_NONBLOCK);
+        connect(fillers[i], (struct sockaddr*)&addr, sizeof(addr));
+    }
+    sys_delay_ms(50);
+    
+    char url[64];
+    uint64_t elapsed = 0;
+    https_client_config_t config;
+    https_client_config_init(&config);
+    config.connect_timeout_ms = 300;
+    https_client_t* client = https_client_create(&config);
+    snprintf(url, sizeof(url), "https://127.0.0.1:%d/file", ntohs(addr.sin_port));
+    int result = test_engine_run(client, url, &elapsed);
+    test_assert(result < 0 && result != -1000, "Engine fails an unanswered connect");
+    test_assert(elapsed >= 250 && elapsed < 1500, "Engine connect gives up at its deadline");
+    https_client_destroy(client);
+    for (i = 0; i < 4; i++) {
+        close(fillers[i]);
+    }
+    close(fd);
+    
+    // A listener that accepts and never answers: each handshake times out
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    addr.sin_port = 0;
+    addr_len = sizeof(addr);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        test_assert(0, "Silent listener is set up");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    https_client_config_init(&config);
+    config.read_timeout_ms = 200;
+    config.handshake_retries = 2;
+    config.backoff_base_ms = 300;
+    config.backoff_jitter = 0;
+    client = https_client_create(&config);
+    snprintf(url, sizeof(url), "https://127.0.0.1:%d/file", ntohs(addr.sin_port));
+    result = test_engine_run(client, url, &elapsed);
+    test_assert(result < 0 && result != -1000, "Engine fails a silent handshake");
+    test_assert(elapsed >= 650 && elapsed < 3000, "Engine backs off before the handshake retry");
+    
+    int accepted = 0;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    for (int conn_fd; (conn_fd = accept(fd, NULL, NULL)) >= 0; accepted++) {
+        close(conn_fd);
+    }
+    test_assert(accepted == 2, "Engine handshake retry connects again");
+    https_client_destroy(client);
+    close(fd);
+}
+
+// Test segmented download over several connections
+void test_parallel_download()
+{
+    printf("\n=== Testing Parallel Download ===\n");
+    
+    cleanup_test_files();
+    int result = https_download(test_url(TEST_PATH_LARGER), TEST_FILE_PATH);
+    test_assert(result == 0, "Single stream reference download succeeds");
+    long expected_size = get_file_size(TEST_FILE_PATH);
+    cleanup_test_files();
+    
+    result = https_download_parallel(test_url(TEST_PATH_LARGER), TEST_FILE_PATH, 4);
+    test_assert(result == 0, "Parallel download succeeds");
+    test_assert(get_file_size(TEST_FILE_PATH) == expected_size, "Parallel download has the full size");
+    printf("Downloaded file size: %ld bytes\n", get_file_size(TEST_FILE_PATH));
+    cleanup_test_files();
+}
+
+// Check that a file holds the first size bytes of a bench_server payload
+static int test_bench_payload(const char* path, long size)
+{
+    FILE* f = fopen(path, "rb");
+    long n = 0;
+    int c;
+    
+    if (!f) {
+        return 0;
+    }
+    while ((c = fgetc(f)) != EOF && c == (int)((n * 7 + 3) & 0xff)) {
+        n++;
+    }
+    fclose(f);
+    return c == EOF && n == size;
+}
+
+// Cancels a download once it got this far
+static int test_cancel_at(void* ctx, const https_progress_t* p)
+{
+    return !p->done && p->bytes >= *(uint64_t*)ctx;
+}
+
+// Test that an interrupted resumable download continues from its sidecar,
+// and starts over when the resource changed
+void test_resume_download()
+{
+    printf("\n=== Testing Resumed Download ===\n");
+    
+    const long total = 32 * 1024 * 1024;
+    const char* sidecar = TEST_FILE_PATH ".resume";
+    char path[64];
+    uint64_t cancel_at = 4 * 1024 * 1024;
+    https_transfer_stats_t ts;
+    https_download_opts_t opts;
+    https_download_opts_init(&opts);
+    opts.resume = 1;
+    opts.connections = 2;
+    opts.stats = &ts;
+    opts.progress = test_cancel_at;
+    opts.progress_ctx = &cancel_at;
+    opts.progress_bytes = 256 * 1024;
+    snprintf(path, sizeof(path), "/size/%ld", total);
+    
+    cleanup_test_files();
+    unlink(sidecar);
+    int result = https_download_ex(test_url(path), TEST_FILE_PATH, &opts);
+    test_assert(result == HTTPS_ERR_CANCELLED, "Resumable download is cancelled");
+    test_assert(file_exists(sidecar), "Cancelled download leaves its sidecar");
+    
+    opts.progress = NULL;
+    result = https_download_ex(test_url(path), TEST_FILE_PATH, &opts);
+    test_assert(result == 0 && test_bench_payload(TEST_FILE_PATH, total), "Resumed download has the whole payload");
+    test_assert(ts.body_bytes < (uint64_t)total, "Resumed download fetches only the missing ranges");
+    test_assert(!file_exists(sidecar), "Sidecar is removed after the download");
+    printf("Resumed with %llu of %ld bytes\n", (unsigned long long)ts.body_bytes, total);
+    
+    // a sidecar for another version of the resource is not trusted
+    opts.progress = test_cancel_at;
+    cleanup_test_files();
+    https_download_ex(test_url(path), TEST_FILE_PATH, &opts);
+    FILE* f = fopen(sidecar, "rb");
+    char text[4096];
+    size_t len = f ? fread(text, 1, sizeof(text) - 1, f) : 0;
+    if (f) {
+        fclose(f);
+    }
+    text[len] = '\0';
+    char* etag = strstr(text, "\netag \"bench-");
+    if (etag) {
+        memcpy(etag + 7, "other", 5);
+        f = fopen(sidecar, "wb");
+        if (f) {
+            fwrite(text, 1, len, f);
+            fclose(f);
+        }
+    }
+    test_assert(etag != NULL, "Sidecar records the ETag");
+    
+    opts.progress = NULL;
+    result = https_download_ex(test_url(path), TEST_FILE_PATH, &opts);
+    test_assert(result == 0 && test_bench_payload(TEST_FILE_PATH, total), "Restarted download has the whole payload");
+    test_assert(ts.body_bytes >= (uint64_t)total, "Changed ETag restarts the download");
+    test_assert(!file_exists(sidecar), "Sidecar is removed after the restarted download");
+    
+    cleanup_test_files();
+    unlink(sidecar);
+}
+
 // Performance and stress tests
 void test_performance()
 {
@@ -177,7 +1268,7 @@ void test_performance()
     struct timespec start, end;
     clock_gettime(CLOCK_MONOTONIC, &start);
     
-    int result = https_download(TEST_URL_SMALL, TEST_FILE_PATH);
+    int result = https_download(test_url(TEST_PATH_SMALL), TEST_FILE_PATH);
     
     clock_gettime(CLOCK_MONOTONIC, &end);
     
@@ -200,18 +1291,20 @@ void test_url_parsing()
     printf("\n=== URL Parsing Tests ===\n");
     
     // These tests verify that various URL formats work
-    const char* test_urls[] = {
-        "https://httpbin.org/json",
-        "https://raw.githubusercontent.com/curl/curl/master/README.md",
+    const char* test_paths[] = {
+        "/size/100",
+        "/size/100000?chunked",
+        "/size/5000?norange&delay=10",
         NULL
     };
     
-    for (int i = 0; test_urls[i] != NULL; i++) {
-        printf("Testing URL: %s\n", test_urls[i]);
+    for (int i = 0; test_paths[i] != NULL; i++) {
+        char* url = test_url(test_paths[i]);
+        printf("Testing URL: %s\n", url);
         
         cleanup_test_files();
         
-        int result = https_download((char*)test_urls[i], TEST_FILE_PATH);
+        int result = https_download(url, TEST_FILE_PATH);
         
         char test_name[256];
         snprintf(test_name, sizeof(test_name), "URL parsing and download for URL %d", i + 1);
@@ -256,9 +1349,12 @@ int main(int argc, char* argv[])
             run_performance_tests = 0;
         } else if (strcmp(argv[i], "--no-url-tests") == 0) {
             run_url_tests = 0;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            test_server = argv[++i];
         } else if (strcmp(argv[i], "--help") == 0) {
             printf("Usage: %s [options]\n", argv[0]);
             printf("Options:\n");
+            printf("  --server <url>    bench_server to download from (default %s)\n", TEST_SERVER);
             printf("  --no-performance  Skip performance tests\n");
             printf("  --no-url-tests    Skip URL parsing tests\n");
             printf("  --help            Show this help message\n");
@@ -268,7 +1364,25 @@ int main(int argc, char* argv[])
     
     // Run tests
     test_system_abstraction();
+    test_response_parser();
+    test_async_writer();
+    test_file_backends();
+    test_tls_profiles();
+    test_error_classes();
+    test_dns_cache();
+    test_socket_timeout();
+    test_connect_timeout();
     test_https_download();
+    test_read_timeout();
+    test_client_reuse();
+    test_checksum_download();
+    test_redirect_download();
+    test_progress_download();
+    test_sink_download();
+    test_engine_download();
+    test_engine_timeouts();
+    test_parallel_download();
+    test_resume_download();
     
     if (run_performance_tests) {
         test_performance();